@@ -0,0 +1,516 @@
+#define RBT_IMPLEMENTATION
+#include "rb_tree.h"
+#include "rb_tree_pool.h"
+#include "rb_tree_frozen.h"
+#include "rb_tree_compact.h"
+#include "rb_tree_small.h"
+#include "bench.h"
+
+typedef struct
+{
+  struct rbt_node rbt_node;
+  int key;
+} Bench_Node;
+
+RBT_DEFINE (bench, Bench_Node, rbt_node, key, RBT_NUMERIC_COMPARE)
+RBT_DEFINE_SMALL (bench, Bench_Node, rbt_node, key, RBT_NUMERIC_COMPARE)
+
+typedef struct
+{
+  struct rbt_inode node;
+  int key;
+} Bench_Index_Node;
+
+typedef struct
+{
+  struct rbt_cnode node;
+  int key;
+} Bench_Compact_Node;
+
+static int64_t
+bench_key (const struct rbt_node *node)
+{
+  return RBT_CONTAINER_OF (node, Bench_Node, rbt_node)->key;
+}
+
+static int
+bench_compare (const struct rbt_node *a, const struct rbt_node *b)
+{
+  const int x = RBT_CONTAINER_OF (a, Bench_Node, rbt_node)->key;
+  const int y = RBT_CONTAINER_OF (b, Bench_Node, rbt_node)->key;
+  return (x > y) - (x < y);
+}
+
+/* Keys per range for `range_scan` and `erase_range`. */
+#define BENCH_WINDOW 1024
+
+#if defined(RBT_PACKED_COLOR)
+#  define BENCH_IMPL "rbt_packed"
+#elif defined(RBT_THREADED)
+#  define BENCH_IMPL "rbt_threaded"
+#else
+#  define BENCH_IMPL "rbt"
+#endif
+
+static void
+bench_run (enum bench_distribution dist, size_t n, struct bench_counter *counter)
+{
+  struct rbtree tree = RBT_EMPTY;
+  struct bench_keys keys;
+  struct bench_phase phase;
+  struct rbt_frozen frozen;
+  struct rbt_range range;
+  struct rbt_node *node, **sorted;
+  Bench_Node *nodes, *found, **removed;
+  size_t i, removed_count = 0;
+  unsigned long long sum = 0;
+  int lo;
+
+  bench_rand_state = 0x9E3779B97F4A7C15ull;
+  bench_keys_init (&keys, dist, n);
+  nodes = (Bench_Node *)malloc (n * sizeof (Bench_Node));
+  removed = (Bench_Node **)malloc (n * sizeof (Bench_Node *));
+  for (i = 0; i < n; ++i)
+    nodes[i].key = keys.order[i];
+
+  bench_phase_begin (&phase, counter);
+  for (i = 0; i < n; ++i)
+    bench_insert_unique (&tree, nodes + i);
+  bench_phase_end (&phase, BENCH_IMPL, dist, n, "insert", n);
+
+  bench_phase_begin (&phase, counter);
+  for (i = 0; i < n; ++i)
+    sum += bench_find (&tree, keys.lookups[i]) != NULL;
+  bench_phase_end (&phase, BENCH_IMPL, dist, n, "find", n);
+
+  bench_phase_begin (&phase, counter);
+  rbt_freeze (&frozen, &tree, bench_key);
+  bench_phase_end (&phase, BENCH_IMPL, dist, n, "freeze", n);
+
+  bench_phase_begin (&phase, counter);
+  for (i = 0; i < n; ++i)
+    sum += rbt_frozen_find (&frozen, keys.lookups[i]) != NULL;
+  bench_phase_end (&phase, BENCH_IMPL, dist, n, "frozen_find", n);
+  rbt_frozen_free (&frozen);
+
+  bench_phase_begin (&phase, counter);
+  for (node = rbt_first (&tree); node; node = rbt_next (node))
+    sum += RBT_CONTAINER_OF (node, Bench_Node, rbt_node)->key;
+  bench_phase_end (&phase, BENCH_IMPL, dist, n, "iterate", n);
+
+  /* 80% finds, 10% erases and 10% re-insertions of erased keys. */
+  bench_phase_begin (&phase, counter);
+  for (i = 0; i < n; ++i)
+    switch (bench_rand () % 10)
+      {
+      case 0:
+        if ((found = bench_erase_key (&tree, keys.lookups[i])))
+          removed[removed_count++] = found;
+        break;
+      case 1:
+        if (removed_count)
+          {
+            bench_insert_unique (&tree, removed[--removed_count]);
+            break;
+          }
+        /* fallthrough */
+      default:
+        sum += bench_find (&tree, keys.lookups[i]) != NULL;
+        break;
+      }
+  bench_phase_end (&phase, BENCH_IMPL, dist, n, "mixed", n);
+  while (removed_count)
+    bench_insert_unique (&tree, removed[--removed_count]);
+
+  bench_phase_begin (&phase, counter);
+  for (i = 0; i < n; ++i)
+    bench_erase_key (&tree, keys.order[i]);
+  bench_phase_end (&phase, BENCH_IMPL, dist, n, "erase", n);
+
+  sorted = (struct rbt_node **)malloc (n * sizeof (struct rbt_node *));
+  for (i = 0; i < n; ++i)
+    sorted[nodes[i].key] = &nodes[i].rbt_node;
+  bench_phase_begin (&phase, counter);
+  rbt_build_sorted (&tree, sorted, n);
+  bench_phase_end (&phase, BENCH_IMPL, dist, n, "build", n);
+
+  bench_phase_begin (&phase, counter);
+  for (lo = 0; lo < (int)n; lo += BENCH_WINDOW)
+    for (found = bench_range_begin (&range, &tree, lo, lo + BENCH_WINDOW - 1);
+         found; found = bench_range_next (&range))
+      sum += found->key;
+  bench_phase_end (&phase, BENCH_IMPL, dist, n, "range_scan", n);
+
+  /* Expiring windows of the oldest keys. */
+  bench_phase_begin (&phase, counter);
+  for (lo = 0; lo < (int)n; lo += BENCH_WINDOW)
+    bench_erase_range (&tree, lo, lo + BENCH_WINDOW - 1, NULL);
+  bench_phase_end (&phase, BENCH_IMPL, dist, n, "erase_range", n);
+
+  /* Inserting next to the previous node, which is the position of the new
+     one for sequential keys. */
+  bench_phase_begin (&phase, counter);
+  for (i = 0, node = NULL; i < n; node = &nodes[i++].rbt_node)
+    rbt_insert_hint (&tree, &nodes[i].rbt_node, node, bench_compare);
+  bench_phase_end (&phase, BENCH_IMPL, dist, n, "insert_hint", n);
+
+  /* Loading the nodes in insertion order, on all cores. */
+  for (i = 0; i < n; ++i)
+    sorted[i] = &nodes[i].rbt_node;
+  bench_phase_begin (&phase, counter);
+  rbt_build_parallel (&tree, sorted, n, bench_compare, RBT_DUPLICATES_KEEP,
+                      NULL, (unsigned)sysconf (_SC_NPROCESSORS_ONLN));
+  bench_phase_end (&phase, BENCH_IMPL, dist, n, "build_parallel", n);
+
+  /* Keep the loops from being optimized away. */
+  if (sum == 42)
+    putchar ('\0');
+
+  free (sorted);
+  free (removed);
+  free (nodes);
+  bench_keys_free (&keys);
+}
+
+static void
+bench_free_tree (struct rbt_node *node)
+{
+  if (node->left)
+    bench_free_tree (node->left);
+  if (node->right)
+    bench_free_tree (node->right);
+  free (RBT_CONTAINER_OF (node, Bench_Node, rbt_node));
+}
+
+/* Allocating the nodes on insertion and freeing them on erasure, with malloc
+   or a pool.  `churn` erases a key and inserts it again in a new node. */
+static void
+bench_run_alloc (enum bench_distribution dist, size_t n, bool use_pool,
+                 struct bench_counter *counter)
+{
+  const char *impl = use_pool ? "rbt+pool" : "rbt+malloc";
+  struct rbtree tree = RBT_EMPTY;
+  struct rbt_pool pool;
+  struct bench_keys keys;
+  struct bench_phase phase;
+  Bench_Node *node;
+  size_t i;
+
+  bench_rand_state = 0x9E3779B97F4A7C15ull;
+  bench_keys_init (&keys, dist, n);
+  rbt_pool_init (&pool, sizeof (Bench_Node), _Alignof (Bench_Node));
+
+  bench_phase_begin (&phase, counter);
+  for (i = 0; i < n; ++i)
+    {
+      node = (Bench_Node *)(use_pool ? rbt_pool_alloc (&pool)
+                            : malloc (sizeof (Bench_Node)));
+      node->key = keys.order[i];
+      bench_insert_unique (&tree, node);
+    }
+  bench_phase_end (&phase, impl, dist, n, "insert", n);
+
+  bench_phase_begin (&phase, counter);
+  for (i = 0; i < n; ++i)
+    {
+      node = bench_erase_key (&tree, keys.lookups[i]);
+      if (use_pool)
+        rbt_pool_free (&pool, node);
+      else
+        free (node);
+      node = (Bench_Node *)(use_pool ? rbt_pool_alloc (&pool)
+                            : malloc (sizeof (Bench_Node)));
+      node->key = keys.lookups[i];
+      bench_insert_unique (&tree, node);
+    }
+  bench_phase_end (&phase, impl, dist, n, "churn", n);
+
+  bench_phase_begin (&phase, counter);
+  if (use_pool)
+    rbt_pool_release (&pool);
+  else
+    bench_free_tree (tree.root);
+  bench_phase_end (&phase, impl, dist, n, "teardown", n);
+
+  bench_keys_free (&keys);
+}
+
+/* Elements per set for `bench_run_small`. */
+#define BENCH_SMALL_SET 12
+
+/* Many sets of `BENCH_SMALL_SET` elements, the keys spread over them
+   round-robin, as small sets or as trees. */
+static void
+bench_run_small (enum bench_distribution dist, size_t n, bool use_small,
+                 struct bench_counter *counter)
+{
+  const char *impl = use_small ? "rbt_small" : BENCH_IMPL "_sets";
+  const size_t count = (n + BENCH_SMALL_SET - 1) / BENCH_SMALL_SET;
+  struct bench_small *sets;
+  struct rbtree *trees;
+  struct rbt_small_cursor cursor;
+  struct bench_keys keys;
+  struct bench_phase phase;
+  Bench_Node *nodes, *found;
+  struct rbt_node *node;
+  size_t i;
+  unsigned long long sum = 0;
+
+  bench_rand_state = 0x9E3779B97F4A7C15ull;
+  bench_keys_init (&keys, dist, n);
+  nodes = (Bench_Node *)malloc (n * sizeof (Bench_Node));
+  sets = (struct bench_small *)malloc (count * sizeof (struct bench_small));
+  trees = (struct rbtree *)malloc (count * sizeof (struct rbtree));
+  for (i = 0; i < n; ++i)
+    nodes[i].key = keys.order[i];
+  for (i = 0; i < count; ++i)
+    {
+      bench_small_init (&sets[i]);
+      trees[i] = RBT_EMPTY;
+    }
+
+  bench_phase_begin (&phase, counter);
+  for (i = 0; i < n; ++i)
+    if (use_small)
+      bench_small_insert (&sets[i % count], &nodes[i]);
+    else
+      bench_insert_unique (&trees[i % count], &nodes[i]);
+  bench_phase_end (&phase, impl, dist, n, "insert", n);
+
+  bench_phase_begin (&phase, counter);
+  for (i = 0; i < n; ++i)
+    sum += (use_small ? bench_small_find (&sets[i % count], keys.lookups[i])
+            : bench_find (&trees[i % count], keys.lookups[i])) != NULL;
+  bench_phase_end (&phase, impl, dist, n, "find", n);
+
+  bench_phase_begin (&phase, counter);
+  for (i = 0; i < count; ++i)
+    if (use_small)
+      for (found = bench_small_first (&sets[i], &cursor); found;
+           found = bench_small_next (&sets[i], &cursor))
+        sum += found->key;
+    else
+      for (node = rbt_first (&trees[i]); node; node = rbt_next (node))
+        sum += RBT_CONTAINER_OF (node, Bench_Node, rbt_node)->key;
+  bench_phase_end (&phase, impl, dist, n, "iterate", n);
+
+  bench_phase_begin (&phase, counter);
+  for (i = 0; i < n; ++i)
+    if (use_small)
+      bench_small_erase_key (&sets[i % count], keys.order[i]);
+    else
+      bench_erase_key (&trees[i % count], keys.order[i]);
+  bench_phase_end (&phase, impl, dist, n, "erase", n);
+
+  if (sum == 42)
+    putchar ('\0');
+
+  free (trees);
+  free (sets);
+  free (nodes);
+  bench_keys_free (&keys);
+}
+
+/* Index-based and compact trees do not depend on the `rbt_node` layout, so
+   only the default build runs them. */
+#if !defined(RBT_PACKED_COLOR) && !defined(RBT_THREADED)
+static uint32_t
+bench_index_find (const struct rbtree_index *tree, int key)
+{
+  uint32_t node = tree->root;
+  int test;
+  while (node != RBT_NIL)
+    {
+      test = RBT_INDEX_ELEMENT (tree, node, Bench_Index_Node)->key;
+      if (key == test)
+        break;
+      node = RBT_INODE (tree, node)->child[key > test];
+    }
+  return node;
+}
+
+static void
+bench_index_insert (struct rbtree_index *tree, uint32_t i)
+{
+  const int key = RBT_INDEX_ELEMENT (tree, i, Bench_Index_Node)->key;
+  uint32_t node = tree->root, parent = RBT_NIL;
+  enum rbt_direction dir = RBT_LEFT;
+  while (node != RBT_NIL)
+    {
+      parent = node;
+      dir = (key < RBT_INDEX_ELEMENT (tree, node, Bench_Index_Node)->key
+             ? RBT_LEFT : RBT_RIGHT);
+      node = RBT_INODE (tree, node)->child[dir];
+    }
+  rbt_index_insert (tree, i, parent, dir);
+}
+
+/* The same workloads on an index-based tree, the element at index `i` has
+   the key `keys.order[i]`. */
+static void
+bench_run_index (enum bench_distribution dist, size_t n,
+                 struct bench_counter *counter)
+{
+  const char *impl = "rbt_index";
+  struct bench_keys keys;
+  struct bench_phase phase;
+  Bench_Index_Node *nodes;
+  struct rbtree_index tree;
+  uint32_t node, *removed;
+  size_t i, removed_count = 0;
+  unsigned long long sum = 0;
+
+  bench_rand_state = 0x9E3779B97F4A7C15ull;
+  bench_keys_init (&keys, dist, n);
+  nodes = (Bench_Index_Node *)malloc (n * sizeof (Bench_Index_Node));
+  removed = (uint32_t *)malloc (n * sizeof (uint32_t));
+  tree = RBT_INDEX_EMPTY (nodes, Bench_Index_Node, node);
+  for (i = 0; i < n; ++i)
+    nodes[i].key = keys.order[i];
+
+  bench_phase_begin (&phase, counter);
+  for (i = 0; i < n; ++i)
+    bench_index_insert (&tree, (uint32_t)i);
+  bench_phase_end (&phase, impl, dist, n, "insert", n);
+
+  bench_phase_begin (&phase, counter);
+  for (i = 0; i < n; ++i)
+    sum += bench_index_find (&tree, keys.lookups[i]) != RBT_NIL;
+  bench_phase_end (&phase, impl, dist, n, "find", n);
+
+  bench_phase_begin (&phase, counter);
+  for (node = rbt_index_first (&tree); node != RBT_NIL;
+       node = rbt_index_next (&tree, node))
+    sum += nodes[node].key;
+  bench_phase_end (&phase, impl, dist, n, "iterate", n);
+
+  bench_phase_begin (&phase, counter);
+  for (i = 0; i < n; ++i)
+    switch (bench_rand () % 10)
+      {
+      case 0:
+        if ((node = bench_index_find (&tree, keys.lookups[i])) != RBT_NIL)
+          {
+            rbt_index_erase (&tree, node);
+            removed[removed_count++] = node;
+          }
+        break;
+      case 1:
+        if (removed_count)
+          {
+            bench_index_insert (&tree, removed[--removed_count]);
+            break;
+          }
+        /* fallthrough */
+      default:
+        sum += bench_index_find (&tree, keys.lookups[i]) != RBT_NIL;
+        break;
+      }
+  bench_phase_end (&phase, impl, dist, n, "mixed", n);
+  while (removed_count)
+    bench_index_insert (&tree, removed[--removed_count]);
+
+  bench_phase_begin (&phase, counter);
+  for (i = 0; i < n; ++i)
+    rbt_index_erase (&tree, bench_index_find (&tree, keys.order[i]));
+  bench_phase_end (&phase, impl, dist, n, "erase", n);
+
+  if (sum == 42)
+    putchar ('\0');
+
+  free (removed);
+  free (nodes);
+  bench_keys_free (&keys);
+}
+
+static int
+bench_compact_compare (const void *key, const struct rbt_cnode *node)
+{
+  const int x = *(const int *)key;
+  const int y = RBT_CONTAINER_OF (node, Bench_Compact_Node, node)->key;
+  return (x > y) - (x < y);
+}
+
+/* Insert, find, iterate and erase on a compact tree. */
+static void
+bench_run_compact (enum bench_distribution dist, size_t n,
+                   struct bench_counter *counter)
+{
+  const char *impl = "rbt_compact";
+  struct rbtree_compact tree = RBT_COMPACT_EMPTY;
+  struct rbt_compact_cursor cursor;
+  struct bench_keys keys;
+  struct bench_phase phase;
+  Bench_Compact_Node *nodes;
+  struct rbt_cnode *node;
+  size_t i;
+  unsigned long long sum = 0;
+
+  bench_rand_state = 0x9E3779B97F4A7C15ull;
+  bench_keys_init (&keys, dist, n);
+  nodes = (Bench_Compact_Node *)malloc (n * sizeof (Bench_Compact_Node));
+  for (i = 0; i < n; ++i)
+    nodes[i].key = keys.order[i];
+
+  bench_phase_begin (&phase, counter);
+  for (i = 0; i < n; ++i)
+    rbt_compact_insert (&tree, &nodes[i].node, &nodes[i].key,
+                        bench_compact_compare);
+  bench_phase_end (&phase, impl, dist, n, "insert", n);
+
+  bench_phase_begin (&phase, counter);
+  for (i = 0; i < n; ++i)
+    sum += rbt_compact_find (&tree, &keys.lookups[i], bench_compact_compare)
+           != NULL;
+  bench_phase_end (&phase, impl, dist, n, "find", n);
+
+  bench_phase_begin (&phase, counter);
+  for (node = rbt_compact_first (&cursor, &tree); node;
+       node = rbt_compact_next (&cursor))
+    sum += RBT_CONTAINER_OF (node, Bench_Compact_Node, node)->key;
+  bench_phase_end (&phase, impl, dist, n, "iterate", n);
+
+  bench_phase_begin (&phase, counter);
+  for (i = 0; i < n; ++i)
+    rbt_compact_erase (&tree, &keys.order[i], bench_compact_compare);
+  bench_phase_end (&phase, impl, dist, n, "erase", n);
+
+  if (sum == 42)
+    putchar ('\0');
+
+  free (nodes);
+  bench_keys_free (&keys);
+}
+#endif
+
+int
+main (int argc, char **argv)
+{
+  struct bench_counter counter;
+  size_t n;
+  int dist;
+
+  bench_parse_args (argc, argv);
+  bench_counter_open (&counter);
+  if (!bench_csv)
+    printf ("node size: %zu bytes, entry size: %zu bytes, index entry size: "
+            "%zu bytes, compact entry size: %zu bytes\n",
+            sizeof (struct rbt_node), sizeof (Bench_Node),
+            sizeof (Bench_Index_Node), sizeof (Bench_Compact_Node));
+  bench_print_header ();
+  for (n = 1000; n <= bench_max_size; n *= 10)
+    for (dist = 0; dist < BENCH_DISTRIBUTION_COUNT; ++dist)
+      {
+        bench_run ((enum bench_distribution)dist, n, &counter);
+        bench_run_alloc ((enum bench_distribution)dist, n, false, &counter);
+        bench_run_alloc ((enum bench_distribution)dist, n, true, &counter);
+        bench_run_small ((enum bench_distribution)dist, n, false, &counter);
+        bench_run_small ((enum bench_distribution)dist, n, true, &counter);
+#if !defined(RBT_PACKED_COLOR) && !defined(RBT_THREADED)
+        bench_run_index ((enum bench_distribution)dist, n, &counter);
+        bench_run_compact ((enum bench_distribution)dist, n, &counter);
+#endif
+      }
+  bench_counter_close (&counter);
+  return 0;
+}
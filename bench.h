@@ -0,0 +1,283 @@
+/* Shared helpers for the benchmarks, usable from C and C++. */
+#ifndef BENCH_H
+#define BENCH_H
+
+#ifndef _GNU_SOURCE
+#  define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#  include <linux/perf_event.h>
+#  include <sys/ioctl.h>
+#  include <sys/syscall.h>
+#endif
+
+enum bench_distribution
+{
+  BENCH_SEQUENTIAL,
+  BENCH_UNIFORM,
+  BENCH_ZIPFIAN,
+  BENCH_DISTRIBUTION_COUNT
+};
+
+static const char *const bench_distribution_names[] = {
+  "sequential", "uniform", "zipfian"
+};
+
+static bool bench_csv = false;
+static size_t bench_max_size = 1000000;
+
+static unsigned long long bench_rand_state = 0x9E3779B97F4A7C15ull;
+
+static inline unsigned long long
+bench_rand (void)
+{
+  unsigned long long z = (bench_rand_state += 0x9E3779B97F4A7C15ull);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+  return z ^ (z >> 31);
+}
+
+static inline double
+bench_now_ns (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Resident set size of the process in MiB. */
+static inline double
+bench_rss_mib (void)
+{
+  long pages = 0, resident = 0;
+  FILE *f = fopen ("/proc/self/statm", "r");
+  if (!f)
+    return 0.0;
+  if (fscanf (f, "%ld %ld", &pages, &resident) != 2)
+    resident = 0;
+  fclose (f);
+  return (double)resident * sysconf (_SC_PAGESIZE) / (1024.0 * 1024.0);
+}
+
+/* Zipfian generator over [0, n) with the method from "Quickly Generating
+   Billion-Record Synthetic Databases" (Gray et al.), as used by YCSB. */
+struct bench_zipf
+{
+  double n, theta, alpha, zetan, eta;
+};
+
+static inline void
+bench_zipf_init (struct bench_zipf *z, size_t n, double theta)
+{
+  double zeta2 = 1.0 + pow (0.5, theta);
+  size_t i;
+  z->n = (double)n;
+  z->theta = theta;
+  z->alpha = 1.0 / (1.0 - theta);
+  z->zetan = 0.0;
+  for (i = 1; i <= n; ++i)
+    z->zetan += 1.0 / pow ((double)i, theta);
+  z->eta = ((1.0 - pow (2.0 / z->n, 1.0 - theta)) / (1.0 - zeta2 / z->zetan));
+}
+
+static inline size_t
+bench_zipf_next (const struct bench_zipf *z)
+{
+  double u = (double)(bench_rand () >> 11) / 9007199254740992.0;
+  double uz = u * z->zetan;
+  size_t r;
+  if (uz < 1.0)
+    return 0;
+  if (uz < 1.0 + pow (0.5, z->theta))
+    return 1;
+  r = (size_t)(z->n * pow (z->eta * u - z->eta + 1.0, z->alpha));
+  return r < (size_t)z->n ? r : (size_t)z->n - 1;
+}
+
+/* Key streams for one benchmark run.  `order` is the order in which the keys
+   0..n-1 are inserted and erased, `lookups` are `n` keys to search for. */
+struct bench_keys
+{
+  size_t n;
+  int *order;
+  int *lookups;
+};
+
+static inline void
+bench_keys_init (struct bench_keys *keys, enum bench_distribution dist,
+                 size_t n)
+{
+  struct bench_zipf zipf;
+  size_t i, j;
+  int tmp;
+
+  keys->n = n;
+  keys->order = (int *)malloc (n * sizeof (int));
+  keys->lookups = (int *)malloc (n * sizeof (int));
+  for (i = 0; i < n; ++i)
+    keys->order[i] = (int)i;
+  if (dist != BENCH_SEQUENTIAL)
+    for (i = n - 1; i > 0; --i)
+      {
+        j = bench_rand () % (i + 1);
+        tmp = keys->order[i];
+        keys->order[i] = keys->order[j];
+        keys->order[j] = tmp;
+      }
+
+  switch (dist)
+    {
+    case BENCH_SEQUENTIAL:
+      memcpy (keys->lookups, keys->order, n * sizeof (int));
+      break;
+    case BENCH_UNIFORM:
+      for (i = 0; i < n; ++i)
+        keys->lookups[i] = (int)(bench_rand () % n);
+      break;
+    case BENCH_ZIPFIAN:
+      /* Map the ranks through the shuffled order so the hot keys are
+         scattered over the tree. */
+      bench_zipf_init (&zipf, n, 0.99);
+      for (i = 0; i < n; ++i)
+        keys->lookups[i] = keys->order[bench_zipf_next (&zipf)];
+      break;
+    default:
+      break;
+    }
+}
+
+static inline void
+bench_keys_free (struct bench_keys *keys)
+{
+  free (keys->order);
+  free (keys->lookups);
+}
+
+/* Hardware cache miss counter, unavailable (`fd < 0`) if the kernel does not
+   allow it. */
+struct bench_counter
+{
+  int fd;
+};
+
+static inline void
+bench_counter_open (struct bench_counter *c)
+{
+#ifdef __linux__
+  struct perf_event_attr attr;
+  memset (&attr, 0, sizeof (attr));
+  attr.size = sizeof (attr);
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.config = PERF_COUNT_HW_CACHE_MISSES;
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  c->fd = (int)syscall (SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+  c->fd = -1;
+#endif
+}
+
+static inline void
+bench_counter_close (struct bench_counter *c)
+{
+  if (c->fd >= 0)
+    close (c->fd);
+}
+
+/* A measured phase of a benchmark. */
+struct bench_phase
+{
+  struct bench_counter *counter;
+  double start;
+};
+
+static inline void
+bench_phase_begin (struct bench_phase *phase, struct bench_counter *counter)
+{
+  phase->counter = counter;
+#ifdef __linux__
+  if (counter->fd >= 0)
+    {
+      ioctl (counter->fd, PERF_EVENT_IOC_RESET, 0);
+      ioctl (counter->fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+  phase->start = bench_now_ns ();
+}
+
+static inline void
+bench_print_header (void)
+{
+  if (bench_csv)
+    puts ("impl,distribution,size,operation,ns_per_op,misses_per_op,"
+          "rss_mib");
+  else
+    printf ("%-18s %-10s %10s %-14s %10s %10s %9s\n", "impl", "keys", "size",
+            "op", "ns/op", "misses/op", "rss MiB");
+}
+
+/* Ends the phase and prints its result for `ops` operations. */
+static inline void
+bench_phase_end (struct bench_phase *phase, const char *impl,
+                 enum bench_distribution dist, size_t n, const char *op,
+                 size_t ops)
+{
+  double ns = bench_now_ns () - phase->start;
+  long long misses = -1;
+  double rss = bench_rss_mib ();
+#ifdef __linux__
+  if (phase->counter->fd >= 0)
+    {
+      ioctl (phase->counter->fd, PERF_EVENT_IOC_DISABLE, 0);
+      if (read (phase->counter->fd, &misses, sizeof (misses))
+          != sizeof (misses))
+        misses = -1;
+    }
+#endif
+  if (ops == 0)
+    ops = 1;
+  if (bench_csv)
+    {
+      printf ("%s,%s,%zu,%s,%.2f,", impl, bench_distribution_names[dist], n,
+              op, ns / ops);
+      if (misses >= 0)
+        printf ("%.3f", (double)misses / ops);
+      printf (",%.1f\n", rss);
+    }
+  else
+    {
+      printf ("%-18s %-10s %10zu %-14s %10.1f ", impl,
+              bench_distribution_names[dist], n, op, ns / ops);
+      if (misses >= 0)
+        printf ("%10.3f", (double)misses / ops);
+      else
+        printf ("%10s", "-");
+      printf (" %9.1f\n", rss);
+    }
+  fflush (stdout);
+}
+
+/* Parses `[--csv] [max_size]`. */
+static inline void
+bench_parse_args (int argc, char **argv)
+{
+  int i;
+  for (i = 1; i < argc; ++i)
+    {
+      if (strcmp (argv[i], "--csv") == 0)
+        bench_csv = true;
+      else
+        bench_max_size = strtoull (argv[i], NULL, 10);
+    }
+}
+
+#endif /* BENCH_H */
@@ -0,0 +1,236 @@
+/* Reader scaling of latched trees compared to trees behind a mutex or a
+   reader-writer lock.  Every reader does a fixed number of lookups while one
+   writer keeps erasing and reinserting random keys. */
+#define RBT_IMPLEMENTATION
+#include "rb_tree_latch.h"
+#include "bench.h"
+#include <pthread.h>
+
+#define BENCH_LOOKUPS 1000000
+
+typedef struct
+{
+  struct rbt_node rbt_node;
+  struct rbt_latch_node latch;
+  int key;
+} Bench_Node;
+
+RBT_DEFINE (bench, Bench_Node, rbt_node, key, RBT_NUMERIC_COMPARE)
+
+enum bench_sync
+{
+  BENCH_LATCH,
+  BENCH_RWLOCK,
+  BENCH_MUTEX,
+  BENCH_SYNC_COUNT
+};
+
+static const char *const bench_sync_names[] = { "latch", "rwlock", "mutex" };
+
+struct bench_shared
+{
+  enum bench_sync sync;
+  size_t n;
+  Bench_Node *nodes;
+  struct rbtree tree;
+  struct rbt_latch_tree latch;
+  pthread_mutex_t mutex;
+  pthread_rwlock_t rwlock;
+  pthread_barrier_t start;
+  unsigned readers_running;
+  unsigned long long writes;
+};
+
+struct bench_reader
+{
+  struct bench_shared *shared;
+  unsigned long long seed;
+  unsigned long long found;
+};
+
+static bool
+bench_latch_less (const struct rbt_latch_node *a,
+                  const struct rbt_latch_node *b)
+{
+  return (RBT_CONTAINER_OF (a, Bench_Node, latch)->key
+          < RBT_CONTAINER_OF (b, Bench_Node, latch)->key);
+}
+
+static int
+bench_latch_comp (const void *key, const struct rbt_latch_node *node)
+{
+  const int k = *(const int *)key;
+  const int test = RBT_CONTAINER_OF (node, Bench_Node, latch)->key;
+  return (k > test) - (k < test);
+}
+
+static const struct rbt_latch_ops bench_latch_ops = {
+  bench_latch_less, bench_latch_comp
+};
+
+/* Per-thread generator, `bench_rand` is not thread-safe. */
+static unsigned long long
+bench_rand_r (unsigned long long *state)
+{
+  unsigned long long z = (*state += 0x9E3779B97F4A7C15ull);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+  return z ^ (z >> 31);
+}
+
+static void *
+bench_reader_main (void *arg)
+{
+  struct bench_reader *reader = (struct bench_reader *)arg;
+  struct bench_shared *shared = reader->shared;
+  int i, key;
+
+  pthread_barrier_wait (&shared->start);
+  for (i = 0; i < BENCH_LOOKUPS; ++i)
+    {
+      key = (int)(bench_rand_r (&reader->seed) % shared->n);
+      switch (shared->sync)
+        {
+        case BENCH_LATCH:
+          reader->found += rbt_latch_find (&shared->latch, &key,
+                                           &bench_latch_ops) != NULL;
+          break;
+        case BENCH_RWLOCK:
+          pthread_rwlock_rdlock (&shared->rwlock);
+          reader->found += bench_find (&shared->tree, key) != NULL;
+          pthread_rwlock_unlock (&shared->rwlock);
+          break;
+        default:
+          pthread_mutex_lock (&shared->mutex);
+          reader->found += bench_find (&shared->tree, key) != NULL;
+          pthread_mutex_unlock (&shared->mutex);
+          break;
+        }
+    }
+  __atomic_fetch_sub (&shared->readers_running, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+/* Erased nodes are reinserted right away.  That is only safe for latched
+   trees because the nodes are never freed, so readers still on an erased
+   node can always finish their search and then retry. */
+static void *
+bench_writer_main (void *arg)
+{
+  struct bench_shared *shared = (struct bench_shared *)arg;
+  unsigned long long seed = 42;
+  Bench_Node *node;
+
+  pthread_barrier_wait (&shared->start);
+  while (__atomic_load_n (&shared->readers_running, __ATOMIC_ACQUIRE))
+    {
+      node = shared->nodes + bench_rand_r (&seed) % shared->n;
+      switch (shared->sync)
+        {
+        case BENCH_LATCH:
+          rbt_latch_erase (&shared->latch, &node->latch);
+          rbt_latch_insert (&shared->latch, &node->latch, &bench_latch_ops);
+          break;
+        case BENCH_RWLOCK:
+          pthread_rwlock_wrlock (&shared->rwlock);
+          rbt_erase (&shared->tree, &node->rbt_node);
+          bench_insert_unique (&shared->tree, node);
+          pthread_rwlock_unlock (&shared->rwlock);
+          break;
+        default:
+          pthread_mutex_lock (&shared->mutex);
+          rbt_erase (&shared->tree, &node->rbt_node);
+          bench_insert_unique (&shared->tree, node);
+          pthread_mutex_unlock (&shared->mutex);
+          break;
+        }
+      ++shared->writes;
+    }
+  return NULL;
+}
+
+static void
+bench_run (struct bench_shared *shared, enum bench_sync sync,
+           unsigned readers)
+{
+  pthread_t *threads = (pthread_t *)malloc (readers * sizeof (pthread_t));
+  struct bench_reader *args
+    = (struct bench_reader *)malloc (readers * sizeof (struct bench_reader));
+  pthread_t writer;
+  double start, ns;
+  unsigned i;
+
+  shared->sync = sync;
+  shared->readers_running = readers;
+  shared->writes = 0;
+  pthread_barrier_init (&shared->start, NULL, readers + 2);
+  for (i = 0; i < readers; ++i)
+    {
+      args[i].shared = shared;
+      args[i].seed = i + 1;
+      args[i].found = 0;
+      pthread_create (&threads[i], NULL, bench_reader_main, &args[i]);
+    }
+  pthread_create (&writer, NULL, bench_writer_main, shared);
+
+  pthread_barrier_wait (&shared->start);
+  start = bench_now_ns ();
+  for (i = 0; i < readers; ++i)
+    pthread_join (threads[i], NULL);
+  ns = bench_now_ns () - start;
+  pthread_join (writer, NULL);
+  pthread_barrier_destroy (&shared->start);
+
+  if (bench_csv)
+    printf ("%s,%u,%zu,%.2f,%.2f,%.0f\n", bench_sync_names[sync], readers,
+            shared->n, ns / BENCH_LOOKUPS,
+            readers * (double)BENCH_LOOKUPS / ns * 1e3,
+            shared->writes / ns * 1e9);
+  else
+    printf ("%-8s %8u %10zu %12.1f %12.2f %12.0f\n", bench_sync_names[sync],
+            readers, shared->n, ns / BENCH_LOOKUPS,
+            readers * (double)BENCH_LOOKUPS / ns * 1e3,
+            shared->writes / ns * 1e9);
+  fflush (stdout);
+  free (args);
+  free (threads);
+}
+
+int
+main (int argc, char **argv)
+{
+  struct bench_shared shared;
+  long cpus = sysconf (_SC_NPROCESSORS_ONLN);
+  unsigned readers, max_readers = cpus > 4 ? (unsigned)cpus : 4;
+  size_t i;
+  int sync;
+
+  bench_parse_args (argc, argv);
+  shared.n = bench_max_size;
+  shared.nodes = (Bench_Node *)malloc (shared.n * sizeof (Bench_Node));
+  shared.tree = RBT_EMPTY;
+  shared.latch = RBT_LATCH_EMPTY;
+  pthread_mutex_init (&shared.mutex, NULL);
+  pthread_rwlock_init (&shared.rwlock, NULL);
+  for (i = 0; i < shared.n; ++i)
+    {
+      shared.nodes[i].key = (int)i;
+      bench_insert_unique (&shared.tree, &shared.nodes[i]);
+      rbt_latch_insert (&shared.latch, &shared.nodes[i].latch,
+                        &bench_latch_ops);
+    }
+
+  if (bench_csv)
+    puts ("impl,readers,size,ns_per_lookup,mlookups_per_s,writes_per_s");
+  else
+    printf ("%-8s %8s %10s %12s %12s %12s\n", "impl", "readers", "size",
+            "ns/lookup", "Mlookups/s", "writes/s");
+  for (readers = 1; readers <= max_readers; readers *= 2)
+    for (sync = 0; sync < BENCH_SYNC_COUNT; ++sync)
+      bench_run (&shared, (enum bench_sync)sync, readers);
+
+  pthread_rwlock_destroy (&shared.rwlock);
+  pthread_mutex_destroy (&shared.mutex);
+  free (shared.nodes);
+  return 0;
+}
@@ -0,0 +1,153 @@
+/* Writer scaling of sharded trees compared to one tree behind a mutex.  The
+   writers insert disjoint sets of random keys, then erase them again. */
+#define RBT_IMPLEMENTATION
+#include "rb_tree_sharded.h"
+#include "bench.h"
+
+#define BENCH_SHARDS 32
+
+typedef struct
+{
+  struct rbt_node rbt_node;
+  int key;
+} Bench_Node;
+
+RBT_DEFINE (bench, Bench_Node, rbt_node, key, RBT_NUMERIC_COMPARE)
+
+static int
+bench_compare (const void *a, const void *b)
+{
+  const int x = *(const int *)a, y = *(const int *)b;
+  return (x > y) - (x < y);
+}
+
+static const void *
+bench_key (const struct rbt_node *node)
+{
+  return &RBT_CONTAINER_OF (node, Bench_Node, rbt_node)->key;
+}
+
+static const struct rbt_sharded_ops bench_ops = {
+  bench_compare, bench_key, sizeof (int)
+};
+
+struct bench_shared
+{
+  bool sharded;
+  size_t per_writer;
+  Bench_Node *nodes;
+  struct rbtree tree;
+  pthread_mutex_t mutex;
+  struct rbt_sharded shards;
+  pthread_barrier_t start;
+};
+
+struct bench_writer
+{
+  struct bench_shared *shared;
+  Bench_Node *nodes;
+};
+
+static void *
+bench_writer_main (void *arg)
+{
+  struct bench_writer *writer = (struct bench_writer *)arg;
+  struct bench_shared *shared = writer->shared;
+  size_t i;
+
+  pthread_barrier_wait (&shared->start);
+  for (i = 0; i < shared->per_writer; ++i)
+    if (shared->sharded)
+      rbt_sharded_insert (&shared->shards, &writer->nodes[i].rbt_node);
+    else
+      {
+        pthread_mutex_lock (&shared->mutex);
+        bench_insert_unique (&shared->tree, &writer->nodes[i]);
+        pthread_mutex_unlock (&shared->mutex);
+      }
+  for (i = 0; i < shared->per_writer; ++i)
+    if (shared->sharded)
+      rbt_sharded_erase_key (&shared->shards, &writer->nodes[i].key);
+    else
+      {
+        pthread_mutex_lock (&shared->mutex);
+        bench_erase_key (&shared->tree, writer->nodes[i].key);
+        pthread_mutex_unlock (&shared->mutex);
+      }
+  return NULL;
+}
+
+static void
+bench_run (struct bench_shared *shared, bool sharded, unsigned writers)
+{
+  pthread_t *threads = (pthread_t *)malloc (writers * sizeof (pthread_t));
+  struct bench_writer *args
+    = (struct bench_writer *)malloc (writers * sizeof (struct bench_writer));
+  const char *impl = sharded ? "sharded" : "mutex";
+  const double ops = 2.0 * writers * shared->per_writer;
+  double start, ns;
+  unsigned i;
+
+  shared->sharded = sharded;
+  shared->tree = RBT_EMPTY;
+  rbt_sharded_init (&shared->shards, BENCH_SHARDS, &bench_ops);
+  pthread_barrier_init (&shared->start, NULL, writers + 1);
+  for (i = 0; i < writers; ++i)
+    {
+      args[i].shared = shared;
+      args[i].nodes = shared->nodes + i * shared->per_writer;
+      pthread_create (&threads[i], NULL, bench_writer_main, &args[i]);
+    }
+  pthread_barrier_wait (&shared->start);
+  start = bench_now_ns ();
+  for (i = 0; i < writers; ++i)
+    pthread_join (threads[i], NULL);
+  ns = bench_now_ns () - start;
+  pthread_barrier_destroy (&shared->start);
+  rbt_sharded_destroy (&shared->shards);
+
+  if (bench_csv)
+    printf ("%s,%u,%zu,%.2f,%.2f\n", impl, writers, shared->per_writer,
+            ns / ops * writers, ops / ns * 1e3);
+  else
+    printf ("%-8s %8u %12zu %12.1f %12.2f\n", impl, writers,
+            shared->per_writer, ns / ops * writers, ops / ns * 1e3);
+  fflush (stdout);
+  free (args);
+  free (threads);
+}
+
+int
+main (int argc, char **argv)
+{
+  struct bench_shared shared;
+  struct bench_keys keys;
+  long cpus = sysconf (_SC_NPROCESSORS_ONLN);
+  unsigned writers, max_writers = cpus > 4 ? (unsigned)cpus : 4;
+  size_t i, n;
+
+  bench_parse_args (argc, argv);
+  shared.per_writer = bench_max_size / max_writers;
+  n = shared.per_writer * max_writers;
+  bench_keys_init (&keys, BENCH_UNIFORM, n);
+  shared.nodes = (Bench_Node *)malloc (n * sizeof (Bench_Node));
+  for (i = 0; i < n; ++i)
+    shared.nodes[i].key = keys.order[i];
+  pthread_mutex_init (&shared.mutex, NULL);
+
+  if (bench_csv)
+    puts ("impl,writers,ops_per_writer,ns_per_op,mops_per_s");
+  else
+    printf ("%-8s %8s %12s %12s %12s\n", "impl", "writers", "keys/writer",
+            "ns/op", "Mops/s");
+  for (writers = 1; writers <= max_writers; writers *= 2)
+    {
+      bench_run (&shared, false, writers);
+      bench_run (&shared, true, writers);
+    }
+
+  pthread_mutex_destroy (&shared.mutex);
+  free (shared.nodes);
+  bench_keys_free (&keys);
+  return 0;
+}
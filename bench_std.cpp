@@ -0,0 +1,191 @@
+/* Baselines for `bench.c`: the same workloads on `std::set`, `std::map` and
+   the `rbt::intrusive_set` wrapper. */
+#define RBT_STATIC
+#define RBT_IMPLEMENTATION
+#include "rb_tree.hpp"
+#include "bench.h"
+
+#include <map>
+#include <set>
+#include <vector>
+
+struct Bench_Entry
+{
+  rbt_node node;
+  int key;
+};
+
+struct Bench_Compare
+{
+  using is_transparent = void;
+
+  static int key (int k) { return k; }
+  static int key (const Bench_Entry &e) { return e.key; }
+
+  template <class A, class B>
+  bool
+  operator() (const A &a, const B &b) const
+  {
+    return key (a) < key (b);
+  }
+};
+
+struct Std_Set
+{
+  static constexpr const char *name = "std::set";
+  std::set<int> set;
+
+  explicit Std_Set (size_t) {}
+  void insert (int key) { set.insert (key); }
+  bool find (int key) const { return set.find (key) != set.end (); }
+  bool erase (int key) { return set.erase (key) != 0; }
+
+  unsigned long long
+  iterate () const
+  {
+    unsigned long long sum = 0;
+    for (int key : set)
+      sum += key;
+    return sum;
+  }
+};
+
+struct Std_Map
+{
+  static constexpr const char *name = "std::map";
+  std::map<int, int> map;
+
+  explicit Std_Map (size_t) {}
+  void insert (int key) { map.emplace (key, key); }
+  bool find (int key) const { return map.find (key) != map.end (); }
+  bool erase (int key) { return map.erase (key) != 0; }
+
+  unsigned long long
+  iterate () const
+  {
+    unsigned long long sum = 0;
+    for (const auto &entry : map)
+      sum += entry.second;
+    return sum;
+  }
+};
+
+struct Intrusive_Set
+{
+  static constexpr const char *name = "rbt::intrusive_set";
+  std::vector<Bench_Entry> entries;
+  rbt::intrusive_set<Bench_Entry, &Bench_Entry::node, Bench_Compare> set;
+
+  explicit Intrusive_Set (size_t n) : entries (n)
+  {
+    for (size_t i = 0; i < n; ++i)
+      entries[i].key = (int)i;
+  }
+
+  void insert (int key) { set.insert (entries[key]); }
+  bool find (int key) const { return set.contains (key); }
+
+  bool
+  erase (int key)
+  {
+    auto it = set.find (key);
+    if (it == set.end ())
+      return false;
+    set.erase (it);
+    return true;
+  }
+
+  unsigned long long
+  iterate () const
+  {
+    unsigned long long sum = 0;
+    for (const Bench_Entry &entry : set)
+      sum += entry.key;
+    return sum;
+  }
+};
+
+template <class Impl>
+static void
+bench_run (enum bench_distribution dist, size_t n, bench_counter *counter)
+{
+  bench_keys keys;
+  bench_phase phase;
+  std::vector<int> removed;
+  unsigned long long sum = 0;
+  size_t i;
+
+  bench_rand_state = 0x9E3779B97F4A7C15ull;
+  bench_keys_init (&keys, dist, n);
+  removed.reserve (n);
+  {
+    Impl impl (n);
+
+    bench_phase_begin (&phase, counter);
+    for (i = 0; i < n; ++i)
+      impl.insert (keys.order[i]);
+    bench_phase_end (&phase, Impl::name, dist, n, "insert", n);
+
+    bench_phase_begin (&phase, counter);
+    for (i = 0; i < n; ++i)
+      sum += impl.find (keys.lookups[i]);
+    bench_phase_end (&phase, Impl::name, dist, n, "find", n);
+
+    bench_phase_begin (&phase, counter);
+    sum += impl.iterate ();
+    bench_phase_end (&phase, Impl::name, dist, n, "iterate", n);
+
+    bench_phase_begin (&phase, counter);
+    for (i = 0; i < n; ++i)
+      switch (bench_rand () % 10)
+        {
+        case 0:
+          if (impl.erase (keys.lookups[i]))
+            removed.push_back (keys.lookups[i]);
+          break;
+        case 1:
+          if (!removed.empty ())
+            {
+              impl.insert (removed.back ());
+              removed.pop_back ();
+              break;
+            }
+          [[fallthrough]];
+        default:
+          sum += impl.find (keys.lookups[i]);
+          break;
+        }
+    bench_phase_end (&phase, Impl::name, dist, n, "mixed", n);
+    for (int key : removed)
+      impl.insert (key);
+
+    bench_phase_begin (&phase, counter);
+    for (i = 0; i < n; ++i)
+      impl.erase (keys.order[i]);
+    bench_phase_end (&phase, Impl::name, dist, n, "erase", n);
+  }
+
+  if (sum == 42)
+    putchar ('\0');
+  bench_keys_free (&keys);
+}
+
+int
+main (int argc, char **argv)
+{
+  bench_counter counter;
+
+  bench_parse_args (argc, argv);
+  bench_counter_open (&counter);
+  bench_print_header ();
+  for (size_t n = 1000; n <= bench_max_size; n *= 10)
+    for (int dist = 0; dist < BENCH_DISTRIBUTION_COUNT; ++dist)
+      {
+        const auto d = (enum bench_distribution)dist;
+        bench_run<Std_Set> (d, n, &counter);
+        bench_run<Std_Map> (d, n, &counter);
+        bench_run<Intrusive_Set> (d, n, &counter);
+      }
+  bench_counter_close (&counter);
+  return 0;
+}
@@ -2,13 +2,67 @@
 #ifndef RB_TREE_H
 #define RB_TREE_H
 #include <stdio.h>
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 #define RBT_CONTAINER_OF(ptr, type, member) \
-  ((type *)((char *)(ptr) + offsetof (type, member)))
+  ((type *)((char *)(ptr) - offsetof (type, member)))
 
 #define RBT_EMPTY (struct rbtree) { NULL, }
 
+#define RBT_CACHED_EMPTY (struct rbtree_cached) { { NULL, }, NULL, NULL }
+
+/* Node link accessors.  With `RBT_PACKED_COLOR` defined the color is stored
+   in the lowest bit of the parent pointer, so these must be used instead of
+   accessing the `parent` and `color` fields directly. */
+#ifdef RBT_PACKED_COLOR
+#  define RBT_PARENT(n) \
+  ((struct rbt_node *)((n)->parent_color & ~(uintptr_t)1))
+#  define RBT_COLOR(n) ((enum rbt_color)((n)->parent_color & 1))
+#  define RBT_SET_PARENT(n, p) \
+  ((n)->parent_color = (uintptr_t)(p) | ((n)->parent_color & 1))
+#  define RBT_SET_COLOR(n, c) \
+  ((n)->parent_color = ((n)->parent_color & ~(uintptr_t)1) | (uintptr_t)(c))
+#  define RBT_SET_PARENT_COLOR(n, p, c) \
+  ((n)->parent_color = (uintptr_t)(p) | (uintptr_t)(c))
+#else
+#  define RBT_PARENT(n) ((n)->parent)
+#  define RBT_COLOR(n) ((n)->color)
+#  define RBT_SET_PARENT(n, p) ((n)->parent = (p))
+#  define RBT_SET_COLOR(n, c) ((n)->color = (c))
+#  define RBT_SET_PARENT_COLOR(n, p, c) ((n)->parent = (p), (n)->color = (c))
+#endif
+
+/* Instrumentation.  With `RBT_STATS` defined every tree counts the work its
+   operations do, see `struct rbt_stats`.  Without it these expand to nothing
+   and trees have no extra fields. */
+#ifdef RBT_STATS
+#  define RBT_STATS_ADD(tree, counter, n) \
+  ((void)__atomic_add_fetch (&(tree)->stats.counter, (n), __ATOMIC_RELAXED))
+#  define RBT_STATS_DEPTH(depth) unsigned depth = 0
+#  define RBT_STATS_STEP(depth) (++(depth))
+#  define RBT_STATS_SEARCH(tree, depth) rbt_stats_search ((tree), (depth))
+#else
+#  define RBT_STATS_ADD(tree, counter, n) ((void)0)
+#  define RBT_STATS_DEPTH(depth)
+#  define RBT_STATS_STEP(depth) ((void)0)
+#  define RBT_STATS_SEARCH(tree, depth) ((void)0)
+#endif
+
+/* Number of buckets of the search depth histogram. */
+#ifndef RBT_STATS_DEPTHS
+#  define RBT_STATS_DEPTHS 64
+#endif
+
+/* Defining `RBT_STATIC` together with `RBT_IMPLEMENTATION` makes all
+   functions static, so the compiler can inline them into their callers. */
+#ifdef RBT_STATIC
+#  define RBT_DEF static inline
+#else
+#  define RBT_DEF extern
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -27,8 +81,12 @@ enum rbt_color
 
 struct rbt_node
 {
+#ifdef RBT_PACKED_COLOR
+  uintptr_t parent_color;
+#else
   enum rbt_color color;
   struct rbt_node *parent;
+#endif
   union
   {
     struct rbt_node *child[2];
@@ -38,41 +96,267 @@ struct rbt_node
       struct rbt_node *right;
     };
   };
+#ifdef RBT_ORDER_STATISTICS
+  /* Number of nodes in the subtree rooted at this node. */
+  unsigned count;
+#endif
+#ifdef RBT_THREADED
+  /* In-order neighbors, NULL at the ends of the tree. */
+  struct rbt_node *prev;
+  struct rbt_node *next;
+#endif
 };
 
+#ifdef RBT_STATS
+/* Operation counters of a tree, updated with relaxed atomics.  Only
+   functions that modify the tree count, so lookups on a const tree never
+   write to it.  Joins, splits, range erasure and set operations add their
+   rotations and rebalancing iterations but not their inserts and erases. */
+struct rbt_stats
+{
+  unsigned long long inserts;
+  unsigned long long erases;
+  unsigned long long rotations;
+  /* Iterations of the rebalancing loops. */
+  unsigned long long insert_fixups;
+  unsigned long long erase_fixups;
+  /* Erased nodes with two children, swapped with their successor. */
+  unsigned long long swaps;
+  /* Searches by the inserting and erasing `RBT_DEFINE` functions and
+     `rbt_insert_hint`, and the number of them by nodes visited; the last
+     bucket also counts all longer searches. */
+  unsigned long long searches;
+  unsigned long long depth[RBT_STATS_DEPTHS];
+};
+#endif
+
 struct rbtree
 {
   struct rbt_node *root;
+#ifdef RBT_STATS
+  struct rbt_stats stats;
+#endif
+};
+
+/* Tree that also keeps track of its first and last node.  The `tree` member
+   can be used with all functions that do not change the tree. */
+struct rbtree_cached
+{
+  struct rbtree tree;
+  struct rbt_node *leftmost;
+  struct rbt_node *rightmost;
 };
 
 /* Inserts a node into the tree as a child of the given parent. `dir` specifies
    the direction of the child. Rebalances the tree if neccessary. */
-void rbt_insert (struct rbtree *self, struct rbt_node *node,
-                 struct rbt_node *parent, enum rbt_direction dir);
+RBT_DEF void rbt_insert (struct rbtree *self, struct rbt_node *node,
+                         struct rbt_node *parent, enum rbt_direction dir);
 
 /* Erases the given node from the tree. Rebalances the free if neccessary. */
-void rbt_erase (struct rbtree *self, struct rbt_node *victim);
+RBT_DEF void rbt_erase (struct rbtree *self, struct rbt_node *victim);
+
+/* Callbacks used to keep per-subtree ("augmented") data, such as subtree
+   sizes or maximums, up to date while the shape of the tree changes.  Only
+   nodes on the path touched by an operation are passed to them. */
+struct rbt_augment_callbacks
+{
+  /* Recomputes the data of `node` from its children and then does the same
+     for each ancestor, stopping before `stop` (a NULL `stop` goes up to the
+     root).  The walk may end early once the data of a node did not change. */
+  void (*propagate) (struct rbt_node *node, struct rbt_node *stop);
+  /* Copies the data of `from` to `to`. */
+  void (*copy) (struct rbt_node *from, struct rbt_node *to);
+  /* Called after a rotation in which `to` took the place of `from`.  Should
+     copy the data of `from` to `to` and recompute `from`. */
+  void (*rotate) (struct rbt_node *from, struct rbt_node *to);
+};
+
+/* Like `rbt_insert` but keeps augmented data up to date.  The data of `node`
+   must already be initialized as for a node without children. */
+RBT_DEF void rbt_insert_augmented (struct rbtree *self, struct rbt_node *node,
+                                   struct rbt_node *parent,
+                                   enum rbt_direction dir,
+                                   const struct rbt_augment_callbacks *aug);
+
+/* Like `rbt_erase` but keeps augmented data up to date. */
+RBT_DEF void rbt_erase_augmented (struct rbtree *self, struct rbt_node *victim,
+                                  const struct rbt_augment_callbacks *aug);
+
+/* Like `rbt_insert` but also updates the cached first and last node. */
+RBT_DEF void rbt_insert_cached (struct rbtree_cached *self,
+                                struct rbt_node *node, struct rbt_node *parent,
+                                enum rbt_direction dir);
+
+/* Like `rbt_erase` but also updates the cached first and last node. */
+RBT_DEF void rbt_erase_cached (struct rbtree_cached *self,
+                               struct rbt_node *victim);
+
+/* Returns the first node of the tree in O(1), NULL if the tree is empty. */
+RBT_DEF struct rbt_node *rbt_first_cached (const struct rbtree_cached *self);
+
+/* Returns the last node of the tree in O(1), NULL if the tree is empty. */
+RBT_DEF struct rbt_node *rbt_last_cached (const struct rbtree_cached *self);
+
+/* Erases and returns the first node of the tree, NULL if the tree is
+   empty. */
+RBT_DEF struct rbt_node *rbt_pop_first (struct rbtree_cached *self);
+
+/* Replaces the contents of the tree with the `n` nodes in the array, which
+   must already be sorted.  Runs in O(n) without any comparisons or
+   rotations. */
+RBT_DEF void rbt_build_sorted (struct rbtree *self, struct rbt_node **nodes,
+                               size_t n);
+
+/* Joins the nodes of `left`, `pivot` and `right` into `left`, leaving `right`
+   empty.  All nodes of `left` must be ordered before `pivot` and all nodes of
+   `right` after it.  Runs in O(log n).  Augmented data is not updated. */
+RBT_DEF void rbt_join (struct rbtree *left, struct rbt_node *pivot,
+                       struct rbtree *right);
+
+/* Splits the tree at `pivot`, which must be a node of the tree.  The nodes
+   before `pivot` are moved into `less` and the nodes after it into `greater`,
+   `pivot` itself is removed.  `self` is left empty, but may be the same as
+   `less` or `greater`.  Runs in O(log n).  Augmented data is not updated. */
+RBT_DEF void rbt_split (struct rbtree *self, struct rbt_node *pivot,
+                        struct rbtree *less, struct rbtree *greater);
+
+/* Should return a negative value if `a` is ordered before `b`, a positive
+   value if it is ordered after `b` and 0 if they are equal. */
+typedef int (*rbt_compare_t) (const struct rbt_node *a,
+                              const struct rbt_node *b);
+
+/* Inserts a node after any equal nodes, starting the search at `hint`, a node
+   of the tree near the position of `node` such as the last inserted one, or
+   at the root if `hint` is NULL.  A node that belongs right next to `hint`,
+   as when appending in order, is linked after two comparisons.  Otherwise
+   the walk up stops at the first ancestor that bounds `node` and the search
+   continues below it.  For a distance d that takes O(log d) comparisons on
+   average over the positions of `hint`, but O(log n) when the path between
+   them crosses a high ancestor.  Finding the neighbour of `hint` is O(1)
+   with `RBT_THREADED`, without it `rbt_next` or `rbt_prev` may walk up to
+   the root, as from the last node. */
+RBT_DEF void rbt_insert_hint (struct rbtree *self, struct rbt_node *node,
+                              struct rbt_node *hint, rbt_compare_t cmp);
+
+/* Called for nodes that are dropped from a tree by an operation. */
+typedef void (*rbt_free_node_t) (struct rbt_node *node);
+
+/* Set operations.  The result is stored in `self` and `other` is left empty.
+   Nodes that are not part of the result are passed to `free_node` if it is
+   not NULL; for equal nodes the one from `self` is kept.  Both trees must be
+   ordered by `cmp` and may not contain duplicates.
+   The work is O(m log(n/m + 1)) for trees of size m <= n.  If the header was
+   included with `RBT_THREADS` defined large operations are split across up
+   to `nthreads` threads, otherwise `nthreads` is ignored. */
+RBT_DEF void rbt_union (struct rbtree *self, struct rbtree *other,
+                        rbt_compare_t cmp, rbt_free_node_t free_node,
+                        unsigned nthreads);
+RBT_DEF void rbt_intersect (struct rbtree *self, struct rbtree *other,
+                            rbt_compare_t cmp, rbt_free_node_t free_node,
+                            unsigned nthreads);
+RBT_DEF void rbt_difference (struct rbtree *self, struct rbtree *other,
+                             rbt_compare_t cmp, rbt_free_node_t free_node,
+                             unsigned nthreads);
+
+/* What `rbt_build_parallel` does with nodes that compare equal. */
+enum rbt_duplicates
+{
+  /* Keep all of them in their order in the array. */
+  RBT_DUPLICATES_KEEP,
+  /* Keep the first one in the array. */
+  RBT_DUPLICATES_FIRST,
+  /* Keep the last one in the array. */
+  RBT_DUPLICATES_LAST
+};
+
+/* Replaces the contents of the tree with the `n` nodes in the array, which
+   may be in any order.  The array is stably sorted by `cmp` in place and
+   nodes dropped by the `duplicates` policy are passed to `free_node` if it
+   is not NULL.  Returns false if out of memory, leaving the tree and the
+   array unchanged.  If the header was included with `RBT_THREADS` defined
+   the sort and the linking of the tree are split across up to `nthreads`
+   threads, otherwise `nthreads` is ignored. */
+RBT_DEF bool rbt_build_parallel (struct rbtree *self, struct rbt_node **nodes,
+                                 size_t n, rbt_compare_t cmp,
+                                 enum rbt_duplicates duplicates,
+                                 rbt_free_node_t free_node,
+                                 unsigned nthreads);
+
+/* Erases the nodes from `first` to `last`, inclusive, which must both be in
+   the tree with `first` not ordered after `last`.  The erased nodes are
+   passed to `free_node` if it is not NULL.  Restructures the tree with two
+   splits and a join, so it runs in O(log n) plus O(k) for freeing k nodes.
+   Augmented data is not updated. */
+RBT_DEF void rbt_erase_range (struct rbtree *self, struct rbt_node *first,
+                              struct rbt_node *last,
+                              rbt_free_node_t free_node);
 
 /* Gets the height of the tree. */
-unsigned rbt_height (const struct rbtree *self);
+RBT_DEF unsigned rbt_height (const struct rbtree *self);
 
 /* Gets the size (number of nodes) of the tree.
    Note that this is O(n) as the tree does not keep track of the size
-   and just counts the nodes.  If you need fast access to the size you
-   should keep track of it manually. */
-unsigned rbt_size (const struct rbtree *self);
+   and just counts the nodes, unless `RBT_ORDER_STATISTICS` is defined.  If
+   you need fast access to the size you should keep track of it manually or
+   use that mode. */
+RBT_DEF unsigned rbt_size (const struct rbtree *self);
+
+#ifdef RBT_ORDER_STATISTICS
+/* Returns the node at the zero-based in-order position `k`, or NULL if `k` is
+   not less than the size of the tree. */
+RBT_DEF struct rbt_node *rbt_select (const struct rbtree *self, unsigned k);
+
+/* Returns the zero-based in-order position of the given node. */
+RBT_DEF unsigned rbt_rank (const struct rbt_node *node);
+#endif
+
+#ifdef RBT_STATS
+/* Writes the counters of the tree to `stream` as a single line JSON object
+   tagged with `name`, which is not escaped.  The depth histogram is cut
+   after its last non-zero bucket. */
+RBT_DEF void rbt_stats_dump (const struct rbtree *self, const char *name,
+                             FILE *stream);
+
+/* Sets all counters of the tree to zero. */
+RBT_DEF void rbt_stats_reset (struct rbtree *self);
+
+static inline void
+rbt_stats_search (struct rbtree *self, unsigned depth)
+{
+  RBT_STATS_ADD (self, searches, 1);
+  RBT_STATS_ADD (self, depth[depth < RBT_STATS_DEPTHS
+                             ? depth : RBT_STATS_DEPTHS - 1], 1);
+}
+#endif
 
 /* Returns the first node of the tree. */
-struct rbt_node *rbt_first (const struct rbtree *self);
+RBT_DEF struct rbt_node *rbt_first (const struct rbtree *self);
 
 /* Returns the last node of the tree. */
-struct rbt_node *rbt_last (const struct rbtree *self);
+RBT_DEF struct rbt_node *rbt_last (const struct rbtree *self);
 
 /* Returns the in-order successor of the given node. */
-struct rbt_node *rbt_next (const struct rbt_node *node);
+RBT_DEF struct rbt_node *rbt_next (const struct rbt_node *node);
 
 /* Returns the in-order predecessor of the given node. */
-struct rbt_node *rbt_prev (const struct rbt_node *node);
+RBT_DEF struct rbt_node *rbt_prev (const struct rbt_node *node);
+
+/* Cursor over the nodes of a range, it prefetches the links needed for the
+   next step while the caller works on the current node. */
+struct rbt_range
+{
+  struct rbt_node *node;
+  const struct rbt_node *last;
+};
+
+/* Starts iterating over the nodes from `first` to `last`, inclusive.  Returns
+   `first`, which may be NULL for an empty range. */
+RBT_DEF struct rbt_node *rbt_range_begin (struct rbt_range *range,
+                                          struct rbt_node *first,
+                                          const struct rbt_node *last);
+
+/* Returns the next node of the range, or NULL after `last`. */
+RBT_DEF struct rbt_node *rbt_range_next (struct rbt_range *range);
 
 /* Should print the nodes value into the given buffer. `width` is the
    `node_width` parameter given to `rbt_print`. */
@@ -82,22 +366,321 @@ typedef void (*rbt_print_node_t) (const struct rbt_node *node, unsigned width,
 /* Prints the tree into the given stream.
    The `print_node` function should format a given node into the given buffer.
    `node_width` is the width each node takes in the output. */
-void rbt_print (const struct rbtree *tree, rbt_print_node_t print_node,
-                unsigned node_width, FILE *stream);
+RBT_DEF void rbt_print (const struct rbtree *tree, rbt_print_node_t print_node,
+                        unsigned node_width, FILE *stream);
+
+/* Index-based trees.  The nodes live in one caller-supplied arena of
+   equally sized elements and link to each other by their 32-bit position in
+   the arena instead of by pointer, with the color in the highest bit of the
+   parent index.  A node takes 12 bytes and the tree stays valid when the
+   arena is moved or reallocated, only `base` has to be updated.  At most
+   `RBT_NIL` elements can be used.  The compile-time options only apply to
+   pointer-based trees. */
+#define RBT_NIL ((uint32_t)0x7FFFFFFF)
+
+struct rbt_inode
+{
+  uint32_t parent_color;
+  union
+  {
+    uint32_t child[2];
+    struct
+    {
+      uint32_t left;
+      uint32_t right;
+    };
+  };
+};
+
+struct rbtree_index
+{
+  /* Start of the arena. */
+  char *base;
+  /* Size of one element of the arena. */
+  size_t stride;
+  /* Offset of the `struct rbt_inode` inside an element. */
+  size_t offset;
+  uint32_t root;
+};
+
+/* Empty tree over the array `base` of `type` elements, which are linked
+   through their `member` field. */
+#define RBT_INDEX_EMPTY(base, type, member) \
+  ((struct rbtree_index) { (char *)(base), sizeof (type), \
+                           offsetof (type, member), RBT_NIL })
+
+/* Node of the element at index `i`. */
+#define RBT_INODE(tree, i) \
+  ((struct rbt_inode *)((tree)->base + (size_t)(i) * (tree)->stride \
+                        + (tree)->offset))
+
+/* The element at index `i`. */
+#define RBT_INDEX_ELEMENT(tree, i, type) \
+  ((type *)((tree)->base + (size_t)(i) * (tree)->stride))
+
+#define RBT_INDEX_PARENT(n) ((n)->parent_color & RBT_NIL)
+#define RBT_INDEX_COLOR(n) ((enum rbt_color)((n)->parent_color >> 31))
+#define RBT_INDEX_SET_PARENT(n, p) \
+  ((n)->parent_color = (p) | ((n)->parent_color & ~RBT_NIL))
+#define RBT_INDEX_SET_COLOR(n, c) \
+  ((n)->parent_color = ((n)->parent_color & RBT_NIL) | ((uint32_t)(c) << 31))
+#define RBT_INDEX_SET_PARENT_COLOR(n, p, c) \
+  ((n)->parent_color = (p) | ((uint32_t)(c) << 31))
+
+/* Like `rbt_insert`, `parent` is `RBT_NIL` if the tree is empty. */
+RBT_DEF void rbt_index_insert (struct rbtree_index *self, uint32_t node,
+                               uint32_t parent, enum rbt_direction dir);
+
+/* Like `rbt_erase`. */
+RBT_DEF void rbt_index_erase (struct rbtree_index *self, uint32_t victim);
+
+/* Returns the first node of the tree, or `RBT_NIL` if it is empty. */
+RBT_DEF uint32_t rbt_index_first (const struct rbtree_index *self);
+
+/* Returns the last node of the tree, or `RBT_NIL` if it is empty. */
+RBT_DEF uint32_t rbt_index_last (const struct rbtree_index *self);
+
+/* Returns the in-order successor of the given node, or `RBT_NIL`. */
+RBT_DEF uint32_t rbt_index_next (const struct rbtree_index *self,
+                                 uint32_t node);
+
+/* Returns the in-order predecessor of the given node, or `RBT_NIL`. */
+RBT_DEF uint32_t rbt_index_prev (const struct rbtree_index *self,
+                                 uint32_t node);
 
 #ifdef __cplusplus
 }
 #endif
 
+/* Three-way comparison for keys that support the `<` and `>` operators. */
+#define RBT_NUMERIC_COMPARE(a, b) (((a) > (b)) - ((a) < (b)))
+
+#ifdef __cplusplus
+#  define RBT_KEY_TYPE(type, key_field) \
+  decltype (((type *)0)->key_field)
+#else
+#  define RBT_KEY_TYPE(type, key_field) \
+  __typeof__ (((type *)0)->key_field)
+#endif
+
+/* Defines search, insertion and removal functions for containers of `type`
+   whose `struct rbt_node` is `member`, ordered by `key_field` using
+   `cmp (a, b)`, which is a function or macro returning a negative value, 0
+   or a positive value like `RBT_NUMERIC_COMPARE`.  Since `cmp` is expanded
+   into the generated code it can be inlined into the search loops.  The
+   generated functions are:
+
+   type *prefix_find (const struct rbtree *tree, key)
+     Returns the element with the given key or NULL.
+   type *prefix_lower_bound (const struct rbtree *tree, key)
+     Returns the first element not ordered before `key`, or NULL.
+   type *prefix_upper_bound (const struct rbtree *tree, key)
+     Returns the first element ordered after `key`, or NULL.
+   type *prefix_insert_unique (struct rbtree *tree, type *data)
+     Inserts `data` unless an element with the same key exists, which is
+     returned instead.  Returns NULL if `data` was inserted.
+   void prefix_insert_multi (struct rbtree *tree, type *data)
+     Inserts `data` after all elements with the same key.
+   type *prefix_erase_key (struct rbtree *tree, key)
+     Erases and returns an element with the given key, NULL if there is
+     none. */
+#define RBT_DEFINE(prefix, type, member, key_field, cmp)                    \
+  static inline type *                                                      \
+  prefix##_find (const struct rbtree *tree,                                 \
+                 RBT_KEY_TYPE (type, key_field) key)                        \
+  {                                                                         \
+    struct rbt_node *node = tree->root;                                     \
+    int c;                                                                  \
+    while (node)                                                            \
+      {                                                                     \
+        type *data = RBT_CONTAINER_OF (node, type, member);                 \
+        c = cmp (key, data->key_field);                                     \
+        if (c == 0)                                                         \
+          return data;                                                      \
+        node = node->child[c > 0];                                          \
+      }                                                                     \
+    return NULL;                                                            \
+  }                                                                         \
+                                                                            \
+  static inline type *                                                      \
+  prefix##_lower_bound (const struct rbtree *tree,                          \
+                        RBT_KEY_TYPE (type, key_field) key)                 \
+  {                                                                         \
+    struct rbt_node *node = tree->root, *result = NULL;                     \
+    while (node)                                                            \
+      {                                                                     \
+        if (cmp (RBT_CONTAINER_OF (node, type, member)->key_field, key) < 0) \
+          node = node->right;                                               \
+        else                                                                \
+          {                                                                 \
+            result = node;                                                  \
+            node = node->left;                                              \
+          }                                                                 \
+      }                                                                     \
+    return result ? RBT_CONTAINER_OF (result, type, member) : NULL;         \
+  }                                                                         \
+                                                                            \
+  static inline type *                                                      \
+  prefix##_upper_bound (const struct rbtree *tree,                          \
+                        RBT_KEY_TYPE (type, key_field) key)                 \
+  {                                                                         \
+    struct rbt_node *node = tree->root, *result = NULL;                     \
+    while (node)                                                            \
+      {                                                                     \
+        if (cmp (key, RBT_CONTAINER_OF (node, type, member)->key_field) < 0) \
+          {                                                                 \
+            result = node;                                                  \
+            node = node->left;                                              \
+          }                                                                 \
+        else                                                                \
+          node = node->right;                                               \
+      }                                                                     \
+    return result ? RBT_CONTAINER_OF (result, type, member) : NULL;         \
+  }                                                                         \
+                                                                            \
+  static inline type *                                                      \
+  prefix##_insert_unique (struct rbtree *tree, type *data)                  \
+  {                                                                         \
+    struct rbt_node *node = tree->root, *parent = NULL;                     \
+    enum rbt_direction dir = RBT_LEFT;                                      \
+    int c;                                                                  \
+    RBT_STATS_DEPTH (depth);                                                \
+    while (node)                                                            \
+      {                                                                     \
+        type *test = RBT_CONTAINER_OF (node, type, member);                 \
+        RBT_STATS_STEP (depth);                                             \
+        c = cmp (data->key_field, test->key_field);                         \
+        if (c == 0)                                                         \
+          {                                                                 \
+            RBT_STATS_SEARCH (tree, depth);                                 \
+            return test;                                                    \
+          }                                                                 \
+        parent = node;                                                      \
+        dir = c < 0 ? RBT_LEFT : RBT_RIGHT;                                 \
+        node = node->child[dir];                                            \
+      }                                                                     \
+    RBT_STATS_SEARCH (tree, depth);                                         \
+    rbt_insert (tree, &data->member, parent, dir);                          \
+    return NULL;                                                            \
+  }                                                                         \
+                                                                            \
+  static inline void                                                        \
+  prefix##_insert_multi (struct rbtree *tree, type *data)                   \
+  {                                                                         \
+    struct rbt_node *node = tree->root, *parent = NULL;                     \
+    enum rbt_direction dir = RBT_LEFT;                                      \
+    RBT_STATS_DEPTH (depth);                                                \
+    while (node)                                                            \
+      {                                                                     \
+        RBT_STATS_STEP (depth);                                             \
+        parent = node;                                                      \
+        dir = (cmp (data->key_field,                                        \
+                    RBT_CONTAINER_OF (node, type, member)->key_field) < 0   \
+               ? RBT_LEFT : RBT_RIGHT);                                     \
+        node = node->child[dir];                                            \
+      }                                                                     \
+    RBT_STATS_SEARCH (tree, depth);                                         \
+    rbt_insert (tree, &data->member, parent, dir);                          \
+  }                                                                         \
+                                                                            \
+  static inline type *                                                      \
+  prefix##_erase_key (struct rbtree *tree,                                  \
+                      RBT_KEY_TYPE (type, key_field) key)                   \
+  {                                                                         \
+    struct rbt_node *node = tree->root;                                     \
+    type *data;                                                             \
+    int c;                                                                  \
+    RBT_STATS_DEPTH (depth);                                                \
+    while (node)                                                            \
+      {                                                                     \
+        data = RBT_CONTAINER_OF (node, type, member);                       \
+        RBT_STATS_STEP (depth);                                             \
+        c = cmp (key, data->key_field);                                     \
+        if (c == 0)                                                         \
+          {                                                                 \
+            RBT_STATS_SEARCH (tree, depth);                                 \
+            rbt_erase (tree, node);                                         \
+            return data;                                                    \
+          }                                                                 \
+        node = node->child[c > 0];                                          \
+      }                                                                     \
+    RBT_STATS_SEARCH (tree, depth);                                         \
+    return NULL;                                                            \
+  }                                                                         \
+                                                                            \
+  static inline bool                                                        \
+  prefix##_range_bounds (const struct rbtree *tree,                         \
+                         RBT_KEY_TYPE (type, key_field) lo,                 \
+                         RBT_KEY_TYPE (type, key_field) hi,                 \
+                         struct rbt_node **first, struct rbt_node **last)   \
+  {                                                                         \
+    type *begin = prefix##_lower_bound (tree, lo), *end;                    \
+    if (!begin || cmp (hi, begin->key_field) < 0)                           \
+      return false;                                                         \
+    end = prefix##_upper_bound (tree, hi);                                  \
+    *first = &begin->member;                                                \
+    *last = end ? rbt_prev (&end->member) : rbt_last (tree);                \
+    return true;                                                            \
+  }                                                                         \
+                                                                            \
+  static inline type *                                                      \
+  prefix##_range_begin (struct rbt_range *range, const struct rbtree *tree, \
+                        RBT_KEY_TYPE (type, key_field) lo,                  \
+                        RBT_KEY_TYPE (type, key_field) hi)                  \
+  {                                                                         \
+    struct rbt_node *first = NULL, *last = NULL;                            \
+    prefix##_range_bounds (tree, lo, hi, &first, &last);                    \
+    first = rbt_range_begin (range, first, last);                           \
+    return first ? RBT_CONTAINER_OF (first, type, member) : NULL;           \
+  }                                                                         \
+                                                                            \
+  static inline type *                                                      \
+  prefix##_range_next (struct rbt_range *range)                             \
+  {                                                                         \
+    struct rbt_node *node = rbt_range_next (range);                         \
+    return node ? RBT_CONTAINER_OF (node, type, member) : NULL;             \
+  }                                                                         \
+                                                                            \
+  static inline void                                                        \
+  prefix##_erase_range (struct rbtree *tree,                                \
+                        RBT_KEY_TYPE (type, key_field) lo,                  \
+                        RBT_KEY_TYPE (type, key_field) hi,                  \
+                        rbt_free_node_t free_node)                          \
+  {                                                                         \
+    struct rbt_node *first, *last;                                          \
+    if (prefix##_range_bounds (tree, lo, hi, &first, &last))                \
+      rbt_erase_range (tree, first, last, free_node);                       \
+  }
+
 #endif /* RB_TREE_H */
 
-#ifdef RBT_IMPLEMENTATION
+/* The companion headers include this one, so the implementation may be seen
+   more than once. */
+#if defined(RBT_IMPLEMENTATION) && !defined(RBT_IMPLEMENTED)
+#define RBT_IMPLEMENTED
 
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 
+#ifdef RBT_THREADS
+#  include <pthread.h>
+#endif
+
+/* Minimum black height of both trees for a set operation to hand one half of
+   its work to another thread.  A black height of 12 means at least 4095
+   nodes. */
+#ifndef RBT_PARALLEL_CUTOFF
+#  define RBT_PARALLEL_CUTOFF 12
+#endif
+
+/* Minimum number of nodes for a step of `rbt_build_parallel` to hand one half
+   of its work to another thread. */
+#ifndef RBT_PARALLEL_BUILD_CUTOFF
+#  define RBT_PARALLEL_BUILD_CUTOFF 16384
+#endif
+
 #ifdef _WIN32
 #  include <malloc.h>
 #  define alloca _alloca
@@ -106,7 +689,11 @@ void rbt_print (const struct rbtree *tree, rbt_print_node_t print_node,
 #endif
 
 #define rbt_child_direction(n) \
-  ((n) == (n)->parent->left ? RBT_LEFT : RBT_RIGHT)
+  ((n) == RBT_PARENT (n)->left ? RBT_LEFT : RBT_RIGHT)
+
+#ifdef RBT_ORDER_STATISTICS
+#  define rbt_count(n) ((n) ? (n)->count : 0)
+#endif
 
 #ifdef __cplusplus
 #define RBT_OPPOSITE(d) ((enum rbt_direction)(1 - (int)(d)))
@@ -118,107 +705,238 @@ void rbt_print (const struct rbtree *tree, rbt_print_node_t print_node,
 extern "C" {
 #endif
 
-static struct rbt_node *
+static inline struct rbt_node *
 rbt_rotate (struct rbtree *self, struct rbt_node *parent,
-            enum rbt_direction dir)
+            enum rbt_direction dir, const struct rbt_augment_callbacks *aug)
 {
   struct rbt_node *gparent, *sibling, *close;
-  gparent = parent->parent;
+  gparent = RBT_PARENT (parent);
   sibling = parent->child[RBT_OPPOSITE (dir)];
   assert (sibling);
   close = sibling->child[dir];
+  RBT_STATS_ADD (self, rotations, 1);
 
   parent->child[RBT_OPPOSITE (dir)] = close;
   if (close)
-    close->parent = parent;
+    RBT_SET_PARENT (close, parent);
 
   sibling->child[dir] = parent;
-  parent->parent = sibling;
+  RBT_SET_PARENT (parent, sibling);
 
-  sibling->parent = gparent;
+  RBT_SET_PARENT (sibling, gparent);
   if (gparent)
     gparent->child[parent == gparent->right ? RBT_RIGHT : RBT_LEFT] = sibling;
   else
     self->root = sibling;
+#ifdef RBT_ORDER_STATISTICS
+  sibling->count = parent->count;
+  parent->count = 1 + rbt_count (parent->left) + rbt_count (parent->right);
+#endif
+  if (aug)
+    aug->rotate (parent, sibling);
   return sibling;
 }
 
-void
-rbt_insert (struct rbtree *self, struct rbt_node *node,
-            struct rbt_node *parent, enum rbt_direction dir)
+#ifdef RBT_ORDER_STATISTICS
+/* Adds `delta` to the count of `node` and all of its ancestors. */
+static inline void
+rbt_count_add (struct rbt_node *node, int delta)
 {
-  struct rbt_node *gparent, *uncle;
-
-  node->color = RBT_RED;
-  node->left = NULL;
-  node->right = NULL;
-  node->parent = parent;
-
-  if (parent == NULL)
-    {
-      self->root = node;
-      return;
-    }
+  for (; node; node = RBT_PARENT (node))
+    node->count += delta;
+}
+#endif
 
-  parent->child[dir] = node;
+/* Restores the red-black properties after the red `node` was linked as a
+   child of `parent`. */
+static inline void
+rbt_insert_rebalance (struct rbtree *self, struct rbt_node *node,
+                      struct rbt_node *parent,
+                      const struct rbt_augment_callbacks *aug)
+{
+  struct rbt_node *gparent, *uncle;
+  enum rbt_direction dir;
 
   do
     {
-      if (parent->color == RBT_BLACK)
+      RBT_STATS_ADD (self, insert_fixups, 1);
+      if (RBT_COLOR (parent) == RBT_BLACK)
         /* case 1 */
         return;
-      if ((gparent = parent->parent) == NULL)
+      if ((gparent = RBT_PARENT (parent)) == NULL)
         {
           /* case 4 */
-          parent->color = RBT_BLACK;
+          RBT_SET_COLOR (parent, RBT_BLACK);
           return;
         }
       dir = rbt_child_direction (parent);
       uncle = gparent->child[RBT_OPPOSITE (dir)];
-      if (uncle == NULL || uncle->color == RBT_BLACK)
+      if (uncle == NULL || RBT_COLOR (uncle) == RBT_BLACK)
         {
           if (node == parent->child[RBT_OPPOSITE (dir)])
             {
               /* case 5 */
-              rbt_rotate (self, parent, dir);
+              rbt_rotate (self, parent, dir, aug);
               node = parent;
               parent = gparent->child[dir];
             }
           /* case 6 */
-          rbt_rotate (self, gparent, RBT_OPPOSITE (dir));
-          parent->color = RBT_BLACK;
-          gparent->color = RBT_RED;
+          rbt_rotate (self, gparent, RBT_OPPOSITE (dir), aug);
+          RBT_SET_COLOR (parent, RBT_BLACK);
+          RBT_SET_COLOR (gparent, RBT_RED);
           return;
         }
       /* case 2 */
-      parent->color = RBT_BLACK;
-      uncle->color = RBT_BLACK;
-      gparent->color = RBT_RED;
+      RBT_SET_COLOR (parent, RBT_BLACK);
+      RBT_SET_COLOR (uncle, RBT_BLACK);
+      RBT_SET_COLOR (gparent, RBT_RED);
       node = gparent;
     }
-  while ((parent = node->parent) != NULL);
+  while ((parent = RBT_PARENT (node)) != NULL);
   /* case 3 */
 }
 
+static inline void
+rbt_insert_impl (struct rbtree *self, struct rbt_node *node,
+                 struct rbt_node *parent, enum rbt_direction dir,
+                 const struct rbt_augment_callbacks *aug)
+{
+  RBT_STATS_ADD (self, inserts, 1);
+  RBT_SET_PARENT_COLOR (node, parent, RBT_RED);
+  node->left = NULL;
+  node->right = NULL;
+#ifdef RBT_ORDER_STATISTICS
+  node->count = 1;
+#endif
+#ifdef RBT_THREADED
+  /* A leaf position is between its parent and the parent's neighbor. */
+  if (parent == NULL)
+    node->prev = node->next = NULL;
+  else if (dir == RBT_LEFT)
+    {
+      node->prev = parent->prev;
+      node->next = parent;
+    }
+  else
+    {
+      node->prev = parent;
+      node->next = parent->next;
+    }
+  if (node->prev)
+    node->prev->next = node;
+  if (node->next)
+    node->next->prev = node;
+#endif
+
+  if (parent == NULL)
+    {
+      self->root = node;
+      return;
+    }
+
+  parent->child[dir] = node;
+#ifdef RBT_ORDER_STATISTICS
+  rbt_count_add (parent, 1);
+#endif
+  if (aug)
+    aug->propagate (parent, NULL);
+
+  rbt_insert_rebalance (self, node, parent, aug);
+}
+
+void
+rbt_insert (struct rbtree *self, struct rbt_node *node,
+            struct rbt_node *parent, enum rbt_direction dir)
+{
+  rbt_insert_impl (self, node, parent, dir, NULL);
+}
+
+void
+rbt_insert_augmented (struct rbtree *self, struct rbt_node *node,
+                      struct rbt_node *parent, enum rbt_direction dir,
+                      const struct rbt_augment_callbacks *aug)
+{
+  rbt_insert_impl (self, node, parent, dir, aug);
+}
+
+void
+rbt_insert_hint (struct rbtree *self, struct rbt_node *node,
+                 struct rbt_node *hint, rbt_compare_t cmp)
+{
+  struct rbt_node *start, *parent, *child, *neighbour;
+  enum rbt_direction dir, up;
+  RBT_STATS_DEPTH (depth);
+
+  if (!hint)
+    {
+      parent = NULL;
+      dir = RBT_LEFT;
+      child = self->root;
+    }
+  else
+    {
+      dir = cmp (node, hint) < 0 ? RBT_LEFT : RBT_RIGHT;
+      up = RBT_OPPOSITE (dir);
+      /* Between `hint` and its neighbour on that side one of them has a free
+         child slot facing the other. */
+      neighbour = dir == RBT_RIGHT ? rbt_next (hint) : rbt_prev (hint);
+      RBT_STATS_STEP (depth);
+      if (!neighbour || (cmp (node, neighbour) < 0) == (dir == RBT_RIGHT))
+        {
+          RBT_STATS_SEARCH (self, depth);
+          if (hint->child[dir])
+            rbt_insert (self, node, neighbour, up);
+          else
+            rbt_insert (self, node, hint, dir);
+          return;
+        }
+      /* `node` goes past the neighbour.  Only the ancestors it is on the
+         `up` side of bound the subtree `node` belongs in; the first one
+         that `node` does not go past ends the walk and the search continues
+         below the last one it did go past. */
+      start = neighbour;
+      for (child = neighbour; (parent = RBT_PARENT (child)); child = parent)
+        if (child == parent->child[up])
+          {
+            RBT_STATS_STEP (depth);
+            if ((cmp (node, parent) < 0) == (dir == RBT_LEFT))
+              start = parent;
+            else
+              break;
+          }
+      parent = start;
+      child = start->child[dir];
+    }
+  while (child)
+    {
+      RBT_STATS_STEP (depth);
+      parent = child;
+      dir = cmp (node, child) < 0 ? RBT_LEFT : RBT_RIGHT;
+      child = child->child[dir];
+    }
+  RBT_STATS_SEARCH (self, depth);
+  rbt_insert (self, node, parent, dir);
+}
+
 static void
 rbt_swap_nodes (struct rbt_node *a, struct rbt_node *b)
 {
   struct rbt_node swap;
 
-  if (a->parent)
+  if (RBT_PARENT (a))
     {
-      if (a == a->parent->left)
-        a->parent->left = b;
+      if (a == RBT_PARENT (a)->left)
+        RBT_PARENT (a)->left = b;
       else
-        a->parent->right = b;
+        RBT_PARENT (a)->right = b;
     }
 
   if (b->left)
-    b->left->parent = a;
+    RBT_SET_PARENT (b->left, a);
   if (b->right)
-    b->right->parent = a;
+    RBT_SET_PARENT (b->right, a);
 
-  if (a == b->parent)
+  if (a == RBT_PARENT (b))
     {
       swap = *b;
       if (b == a->left)
@@ -231,184 +949,1211 @@ rbt_swap_nodes (struct rbt_node *a, struct rbt_node *b)
           b->left = a->left;
           b->right = a;
         }
-      b->parent = a->parent;
-      b->color = a->color;
+      RBT_SET_PARENT_COLOR (b, RBT_PARENT (a), RBT_COLOR (a));
 
-      a->parent = b;
+      RBT_SET_PARENT_COLOR (a, b, RBT_COLOR (&swap));
       a->left = swap.left;
       a->right = swap.right;
-      a->color = swap.color;
+#ifdef RBT_ORDER_STATISTICS
+      b->count = a->count;
+      a->count = swap.count;
+#endif
     }
   else
     {
-      if (b == b->parent->left)
-        b->parent->left = a;
+      if (b == RBT_PARENT (b)->left)
+        RBT_PARENT (b)->left = a;
       else
-        b->parent->right = a;
+        RBT_PARENT (b)->right = a;
 
       swap = *b;
       *b = *a;
       *a = swap;
+#ifdef RBT_THREADED
+      /* Only the positions are swapped, not the order. */
+      a->prev = b->prev;
+      a->next = b->next;
+      b->prev = swap.prev;
+      b->next = swap.next;
+#endif
     }
 
   if (b->left)
-    b->left->parent = b;
+    RBT_SET_PARENT (b->left, b);
   if (b->right)
-    b->right->parent = b;
+    RBT_SET_PARENT (b->right, b);
 }
 
 
-static void rbt_erase_rebalance (struct rbtree *self, struct rbt_node *node);
-
-void
-rbt_erase (struct rbtree *self, struct rbt_node *victim)
-{
-  struct rbt_node *replacement, *parent;
-  enum rbt_direction dir;
-  if (victim == self->root && victim->left == victim->right)
-    {
-      self->root = NULL;
-      return;
-    }
-  if (victim->left && victim->right)
-    {
-      replacement = rbt_prev (victim);
-      if (victim == self->root)
-        self->root = replacement;
-      rbt_swap_nodes (victim, replacement);
-    }
-
-  /* `RBT_LEFT` is just a "random" value here, this is not used if the victims
-      parent is NULL. */
-  dir = victim->parent ? rbt_child_direction (victim) : RBT_LEFT;
-  parent = victim->parent;
-
-  if (victim->color == RBT_RED)
-    {
-      parent->child[dir] = NULL;
-      return;
-    }
-
-  if (victim->left == victim->right)
-    rbt_erase_rebalance (self, victim);
-  else
-    {
-      replacement = victim->left ? victim->left : victim->right;
-      replacement->parent = parent;
-      replacement->color = RBT_BLACK;
-      if (parent)
-        parent->child[dir] = replacement;
-      else
-        self->root = replacement;
-    }
-}
-
-static void
-rbt_erase_rebalance (struct rbtree *self, struct rbt_node *node)
+/* Removes a black leaf which has already been unlinked from `parent`, where
+   it was the child in direction `dir`. */
+static inline void
+rbt_erase_rebalance (struct rbtree *self, struct rbt_node *parent,
+                     enum rbt_direction dir,
+                     const struct rbt_augment_callbacks *aug)
 {
-  struct rbt_node *parent, *sibling, *close, *distant;
-  enum rbt_direction dir;
-
-  parent = node->parent;
-  dir = rbt_child_direction (node);
-
-  parent->child[dir] = NULL;
+  struct rbt_node *node, *sibling, *close, *distant;
 
   goto rbt_erase_skip_direction_update;
   do
     {
       dir = rbt_child_direction (node);
 rbt_erase_skip_direction_update:
+      RBT_STATS_ADD (self, erase_fixups, 1);
       sibling = parent->child[RBT_OPPOSITE (dir)];
       distant = sibling->child[RBT_OPPOSITE (dir)];
       close = sibling->child[dir];
 
-      if (sibling->color == RBT_RED)
+      if (RBT_COLOR (sibling) == RBT_RED)
         {
           /* case 3 */
-          rbt_rotate (self, parent, dir);
-          parent->color = RBT_RED;
-          sibling->color = RBT_BLACK;
+          rbt_rotate (self, parent, dir, aug);
+          RBT_SET_COLOR (parent, RBT_RED);
+          RBT_SET_COLOR (sibling, RBT_BLACK);
           sibling = close;
           distant = sibling->child[RBT_OPPOSITE (dir)];
-          if (distant && distant->color == RBT_RED)
+          if (distant && RBT_COLOR (distant) == RBT_RED)
             goto rbt_delete_1;
           close = sibling->child[dir];
-          if (close && close->color == RBT_RED)
+          if (close && RBT_COLOR (close) == RBT_RED)
             goto rbt_delete_2;
           goto rbt_delete_3;
         }
-      if (distant && distant->color == RBT_RED)
+      if (distant && RBT_COLOR (distant) == RBT_RED)
         {
 rbt_delete_1: /* case 6 */
-          rbt_rotate (self, parent, dir);
-          sibling->color = parent->color;
-          parent->color = RBT_BLACK;
-          distant->color = RBT_BLACK;
+          rbt_rotate (self, parent, dir, aug);
+          RBT_SET_COLOR (sibling, RBT_COLOR (parent));
+          RBT_SET_COLOR (parent, RBT_BLACK);
+          RBT_SET_COLOR (distant, RBT_BLACK);
           return;
         }
-      if (close && close->color == RBT_RED)
+      if (close && RBT_COLOR (close) == RBT_RED)
         {
 rbt_delete_2: /* case 5 */
-          rbt_rotate (self, sibling, RBT_OPPOSITE (dir));
-          sibling->color = RBT_RED;
-          close->color = RBT_BLACK;
+          rbt_rotate (self, sibling, RBT_OPPOSITE (dir), aug);
+          RBT_SET_COLOR (sibling, RBT_RED);
+          RBT_SET_COLOR (close, RBT_BLACK);
           distant = sibling;
           sibling = close;
           goto rbt_delete_1;
           __builtin_unreachable ();
         }
-      if (parent->color == RBT_RED)
+      if (RBT_COLOR (parent) == RBT_RED)
         {
 rbt_delete_3: /* case 4 */
-          sibling->color = RBT_RED;
-          parent->color = RBT_BLACK;
+          RBT_SET_COLOR (sibling, RBT_RED);
+          RBT_SET_COLOR (parent, RBT_BLACK);
           return;
         }
       /* case 1 */
-      sibling->color = RBT_RED;
+      RBT_SET_COLOR (sibling, RBT_RED);
       node = parent;
     }
-  while ((parent = node->parent) != NULL);
+  while ((parent = RBT_PARENT (node)) != NULL);
   /* case 2 */
 }
 
-
-static unsigned
-rbt_height_impl (const struct rbt_node *node)
+/* Updates subtree counts and augmented data after a node was unlinked from
+   `parent`.  If the erased node was swapped with its predecessor `top` is the
+   predecessor, which now holds a copy of the erased nodes data. */
+static inline void
+rbt_erase_propagate (const struct rbt_augment_callbacks *aug,
+                     struct rbt_node *parent, struct rbt_node *top)
 {
-  if (!node)
-    return 0;
-  const unsigned left = rbt_height_impl (node->left);
-  const unsigned right = rbt_height_impl (node->right);
-  return 1 + (left > right ? left : right);
+#ifdef RBT_ORDER_STATISTICS
+  rbt_count_add (parent, -1);
+#endif
+  if (!aug)
+    return;
+  if (parent)
+    aug->propagate (parent, top);
+  if (top)
+    aug->propagate (top, NULL);
 }
 
-unsigned
-rbt_height (const struct rbtree *tree)
+static inline void
+rbt_erase_impl (struct rbtree *self, struct rbt_node *victim,
+                const struct rbt_augment_callbacks *aug)
 {
-  return rbt_height_impl (tree->root);
-}
+  struct rbt_node *replacement, *parent, *top = NULL;
+  enum rbt_direction dir;
 
+  RBT_STATS_ADD (self, erases, 1);
+#ifdef RBT_THREADED
+  /* The links of `victim` stay intact for the `rbt_prev` below. */
+  if (victim->prev)
+    victim->prev->next = victim->next;
+  if (victim->next)
+    victim->next->prev = victim->prev;
+#endif
+  if (victim == self->root && victim->left == victim->right)
+    {
+      self->root = NULL;
+      return;
+    }
+  if (victim->left && victim->right)
+    {
+      replacement = rbt_prev (victim);
+      if (victim == self->root)
+        self->root = replacement;
+      rbt_swap_nodes (victim, replacement);
+      RBT_STATS_ADD (self, swaps, 1);
+      if (aug)
+        {
+          aug->copy (victim, replacement);
+          top = replacement;
+        }
+    }
 
-static unsigned
-rbt_size_impl (const struct rbt_node *node)
+  /* `RBT_LEFT` is just a "random" value here, this is not used if the victims
+      parent is NULL. */
+  dir = RBT_PARENT (victim) ? rbt_child_direction (victim) : RBT_LEFT;
+  parent = RBT_PARENT (victim);
+
+  if (RBT_COLOR (victim) == RBT_RED)
+    {
+      parent->child[dir] = NULL;
+      rbt_erase_propagate (aug, parent, top);
+      return;
+    }
+
+  if (victim->left == victim->right)
+    {
+      parent->child[dir] = NULL;
+      rbt_erase_propagate (aug, parent, top);
+      rbt_erase_rebalance (self, parent, dir, aug);
+    }
+  else
+    {
+      replacement = victim->left ? victim->left : victim->right;
+      RBT_SET_PARENT (replacement, parent);
+      RBT_SET_COLOR (replacement, RBT_BLACK);
+      if (parent)
+        parent->child[dir] = replacement;
+      else
+        self->root = replacement;
+      rbt_erase_propagate (aug, parent, top);
+    }
+}
+
+void
+rbt_erase (struct rbtree *self, struct rbt_node *victim)
 {
-  return (node
-          ? 1 + rbt_size_impl (node->left) + rbt_size_impl (node->right)
-          : 0);
+  rbt_erase_impl (self, victim, NULL);
 }
 
-unsigned
-rbt_size (const struct rbtree *tree)
+void
+rbt_erase_augmented (struct rbtree *self, struct rbt_node *victim,
+                     const struct rbt_augment_callbacks *aug)
 {
-  return rbt_size_impl (tree->root);
+  rbt_erase_impl (self, victim, aug);
 }
 
 
-struct rbt_node *
-rbt_next (const struct rbt_node *node)
+void
+rbt_insert_cached (struct rbtree_cached *self, struct rbt_node *node,
+                   struct rbt_node *parent, enum rbt_direction dir)
+{
+  if (parent == NULL)
+    {
+      self->leftmost = node;
+      self->rightmost = node;
+    }
+  else if (parent == self->leftmost && dir == RBT_LEFT)
+    self->leftmost = node;
+  else if (parent == self->rightmost && dir == RBT_RIGHT)
+    self->rightmost = node;
+  rbt_insert_impl (&self->tree, node, parent, dir, NULL);
+}
+
+void
+rbt_erase_cached (struct rbtree_cached *self, struct rbt_node *victim)
+{
+  if (victim == self->leftmost)
+    self->leftmost = rbt_next (victim);
+  if (victim == self->rightmost)
+    self->rightmost = rbt_prev (victim);
+  rbt_erase_impl (&self->tree, victim, NULL);
+}
+
+struct rbt_node *
+rbt_first_cached (const struct rbtree_cached *self)
+{
+  return self->leftmost;
+}
+
+struct rbt_node *
+rbt_last_cached (const struct rbtree_cached *self)
+{
+  return self->rightmost;
+}
+
+struct rbt_node *
+rbt_pop_first (struct rbtree_cached *self)
+{
+  struct rbt_node *first = self->leftmost;
+  if (!first)
+    return NULL;
+  /* The first node has no left child and if it has a right child that is its
+     successor, so there is no need for a full `rbt_next`. */
+  self->leftmost = first->right ? first->right : RBT_PARENT (first);
+  if (first == self->rightmost)
+    self->rightmost = NULL;
+  rbt_erase_impl (&self->tree, first, NULL);
+  return first;
+}
+
+
+static struct rbt_node *rbt_build_sorted_impl (
+  struct rbt_node **nodes, size_t n, struct rbt_node *parent, unsigned depth,
+  unsigned red_depth, unsigned nthreads);
+
+#ifdef RBT_THREADS
+struct rbt_build_task
+{
+  struct rbt_node **nodes;
+  size_t n;
+  struct rbt_node *parent, *result;
+  unsigned depth, red_depth, nthreads;
+};
+
+static void *
+rbt_build_task_run (void *arg)
+{
+  struct rbt_build_task *task = (struct rbt_build_task *)arg;
+  task->result = rbt_build_sorted_impl (task->nodes, task->n, task->parent,
+                                        task->depth, task->red_depth,
+                                        task->nthreads);
+  return NULL;
+}
+#endif
+
+static struct rbt_node *
+rbt_build_sorted_impl (struct rbt_node **nodes, size_t n,
+                       struct rbt_node *parent, unsigned depth,
+                       unsigned red_depth, unsigned nthreads)
+{
+  struct rbt_node *node;
+  size_t mid;
+
+  if (n == 0)
+    return NULL;
+
+  mid = n / 2;
+  node = nodes[mid];
+  /* Splitting in the middle puts every leaf on one of the last two levels.
+     Coloring only the incomplete last level red keeps the black height of
+     all paths the same. */
+  RBT_SET_PARENT_COLOR (node, parent,
+                        depth == red_depth ? RBT_RED : RBT_BLACK);
+#ifdef RBT_THREADS
+  if (nthreads > 1 && n >= RBT_PARALLEL_BUILD_CUTOFF)
+    {
+      struct rbt_build_task task;
+      pthread_t thread;
+      task.nodes = nodes;
+      task.n = mid;
+      task.parent = node;
+      task.depth = depth + 1;
+      task.red_depth = red_depth;
+      task.nthreads = nthreads / 2;
+      if (pthread_create (&thread, NULL, rbt_build_task_run, &task) == 0)
+        {
+          node->right = rbt_build_sorted_impl (nodes + mid + 1, n - mid - 1,
+                                               node, depth + 1, red_depth,
+                                               nthreads - nthreads / 2);
+          pthread_join (thread, NULL);
+          node->left = task.result;
+          goto rbt_build_done;
+        }
+    }
+#endif
+  node->left = rbt_build_sorted_impl (nodes, mid, node, depth + 1,
+                                      red_depth, nthreads);
+  node->right = rbt_build_sorted_impl (nodes + mid + 1, n - mid - 1, node,
+                                       depth + 1, red_depth, nthreads);
+#ifdef RBT_THREADS
+rbt_build_done:
+#endif
+#ifdef RBT_ORDER_STATISTICS
+  node->count = n;
+#endif
+  return node;
+}
+
+static void
+rbt_build_sorted_threads (struct rbtree *self, struct rbt_node **nodes,
+                          size_t n, unsigned nthreads)
+{
+  /* Number of complete levels, i.e. floor(log2(n + 1)). */
+  unsigned red_depth = 0;
+  size_t full;
+  for (full = n + 1; full > 1; full >>= 1)
+    ++red_depth;
+  self->root = rbt_build_sorted_impl (nodes, n, NULL, 0, red_depth,
+                                      nthreads);
+#ifdef RBT_THREADED
+  for (full = 0; full < n; ++full)
+    {
+      nodes[full]->prev = full ? nodes[full - 1] : NULL;
+      nodes[full]->next = full + 1 < n ? nodes[full + 1] : NULL;
+    }
+#endif
+}
+
+void
+rbt_build_sorted (struct rbtree *self, struct rbt_node **nodes, size_t n)
+{
+  rbt_build_sorted_threads (self, nodes, n, 1);
+}
+
+static void rbt_merge (struct rbt_node **a, size_t na, struct rbt_node **b,
+                       size_t nb, struct rbt_node **out, rbt_compare_t cmp,
+                       unsigned nthreads);
+
+static void rbt_merge_sort (struct rbt_node **a, struct rbt_node **b,
+                            size_t n, bool into_b, rbt_compare_t cmp,
+                            unsigned nthreads);
+
+#ifdef RBT_THREADS
+struct rbt_merge_task
+{
+  struct rbt_node **a, **b, **out;
+  size_t na, nb;
+  bool into_b;
+  rbt_compare_t cmp;
+  unsigned nthreads;
+};
+
+static void *
+rbt_merge_task_run (void *arg)
+{
+  struct rbt_merge_task *task = (struct rbt_merge_task *)arg;
+  rbt_merge (task->a, task->na, task->b, task->nb, task->out, task->cmp,
+             task->nthreads);
+  return NULL;
+}
+
+static void *
+rbt_merge_sort_task_run (void *arg)
+{
+  struct rbt_merge_task *task = (struct rbt_merge_task *)arg;
+  rbt_merge_sort (task->a, task->b, task->na, task->into_b, task->cmp,
+                  task->nthreads);
+  return NULL;
+}
+#endif
+
+/* Merges the sorted arrays `a` and `b` into `out`, nodes of `a` go before
+   equal nodes of `b`.  In parallel the larger array is cut in the middle and
+   the other one where that node belongs, and both sides are merged
+   independently. */
+static void
+rbt_merge (struct rbt_node **a, size_t na, struct rbt_node **b, size_t nb,
+           struct rbt_node **out, rbt_compare_t cmp, unsigned nthreads)
+{
+  size_t i = 0, j = 0;
+
+#ifdef RBT_THREADS
+  if (nthreads > 1 && na + nb >= RBT_PARALLEL_BUILD_CUTOFF)
+    {
+      struct rbt_merge_task task;
+      pthread_t thread;
+      size_t lo, hi, mid;
+      if (na >= nb)
+        {
+          /* Nodes of `b` equal to `a[i]` go after it. */
+          i = na / 2;
+          for (lo = 0, hi = nb; lo < hi;)
+            {
+              mid = lo + (hi - lo) / 2;
+              if (cmp (b[mid], a[i]) < 0)
+                lo = mid + 1;
+              else
+                hi = mid;
+            }
+          j = lo;
+          out[i + j] = a[i];
+          task.a = a + i + 1;
+          task.b = b + j;
+        }
+      else
+        {
+          /* Nodes of `a` equal to `b[j]` go before it. */
+          j = nb / 2;
+          for (lo = 0, hi = na; lo < hi;)
+            {
+              mid = lo + (hi - lo) / 2;
+              if (cmp (b[j], a[mid]) < 0)
+                hi = mid;
+              else
+                lo = mid + 1;
+            }
+          i = lo;
+          out[i + j] = b[j];
+          task.a = a + i;
+          task.b = b + j + 1;
+        }
+      task.na = na - (task.a - a);
+      task.nb = nb - (task.b - b);
+      task.out = out + i + j + 1;
+      task.cmp = cmp;
+      task.nthreads = nthreads / 2;
+      if (pthread_create (&thread, NULL, rbt_merge_task_run, &task) == 0)
+        {
+          rbt_merge (a, i, b, j, out, cmp, nthreads - nthreads / 2);
+          pthread_join (thread, NULL);
+          return;
+        }
+      i = j = 0;
+    }
+#else
+  (void)nthreads;
+#endif
+  while (i < na && j < nb)
+    *out++ = cmp (b[j], a[i]) < 0 ? b[j++] : a[i++];
+  memcpy (out, a + i, (na - i) * sizeof (*a));
+  memcpy (out + (na - i), b + j, (nb - j) * sizeof (*b));
+}
+
+/* Stably sorts `a` into `b` if `into_b` is set or in place otherwise, using
+   the other array as scratch space.  The halves are sorted into the array
+   that is not the destination, so that merging them puts the result in
+   place without copying. */
+static void
+rbt_merge_sort (struct rbt_node **a, struct rbt_node **b, size_t n,
+                bool into_b, rbt_compare_t cmp, unsigned nthreads)
+{
+  struct rbt_node **src, *node;
+  size_t i, j, mid;
+
+  if (n <= 16)
+    {
+      for (i = 1; i < n; ++i)
+        {
+          node = a[i];
+          for (j = i; j && cmp (node, a[j - 1]) < 0; --j)
+            a[j] = a[j - 1];
+          a[j] = node;
+        }
+      if (into_b)
+        memcpy (b, a, n * sizeof (*a));
+      return;
+    }
+  mid = n / 2;
+#ifdef RBT_THREADS
+  if (nthreads > 1 && n >= RBT_PARALLEL_BUILD_CUTOFF)
+    {
+      struct rbt_merge_task task;
+      pthread_t thread;
+      task.a = a;
+      task.b = b;
+      task.na = mid;
+      task.into_b = !into_b;
+      task.cmp = cmp;
+      task.nthreads = nthreads / 2;
+      if (pthread_create (&thread, NULL, rbt_merge_sort_task_run, &task)
+          == 0)
+        {
+          rbt_merge_sort (a + mid, b + mid, n - mid, !into_b, cmp,
+                          nthreads - nthreads / 2);
+          pthread_join (thread, NULL);
+          goto rbt_merge_sort_halves_done;
+        }
+    }
+#endif
+  rbt_merge_sort (a, b, mid, !into_b, cmp, nthreads);
+  rbt_merge_sort (a + mid, b + mid, n - mid, !into_b, cmp, nthreads);
+#ifdef RBT_THREADS
+rbt_merge_sort_halves_done:
+#endif
+  src = into_b ? a : b;
+  rbt_merge (src, mid, src + mid, n - mid, into_b ? b : a, cmp, nthreads);
+}
+
+bool
+rbt_build_parallel (struct rbtree *self, struct rbt_node **nodes, size_t n,
+                    rbt_compare_t cmp, enum rbt_duplicates duplicates,
+                    rbt_free_node_t free_node, unsigned nthreads)
+{
+  struct rbt_node **scratch;
+  size_t i, kept;
+
+  if (n > 1)
+    {
+      scratch = (struct rbt_node **)malloc (n * sizeof (*nodes));
+      if (!scratch)
+        return false;
+      rbt_merge_sort (nodes, scratch, n, false, cmp, nthreads);
+      free (scratch);
+    }
+  if (duplicates != RBT_DUPLICATES_KEEP)
+    {
+      for (i = kept = 0; i < n; ++i)
+        if (kept && cmp (nodes[kept - 1], nodes[i]) == 0)
+          {
+            if (duplicates == RBT_DUPLICATES_FIRST)
+              {
+                if (free_node)
+                  free_node (nodes[i]);
+              }
+            else
+              {
+                if (free_node)
+                  free_node (nodes[kept - 1]);
+                nodes[kept - 1] = nodes[i];
+              }
+          }
+        else
+          nodes[kept++] = nodes[i];
+      n = kept;
+    }
+  rbt_build_sorted_threads (self, nodes, n, nthreads);
+  return true;
+}
+
+
+/* Gets the number of black nodes on the path from `node` to a leaf,
+   including `node` itself. */
+static inline unsigned
+rbt_black_height (const struct rbt_node *node)
+{
+  unsigned height = 0;
+  for (; node; node = node->left)
+    height += RBT_COLOR (node) == RBT_BLACK;
+  return height;
+}
+
+#ifdef RBT_THREADED
+/* Links `pivot` between the last node of `left` and the first node of
+   `right`, before they are joined.  The joins done by a split do not need
+   this as they restore the original order. */
+static inline void
+rbt_thread_join (struct rbt_node *left, struct rbt_node *pivot,
+                 struct rbt_node *right)
+{
+  if (left)
+    {
+      while (left->right)
+        left = left->right;
+      left->next = pivot;
+    }
+  if (right)
+    {
+      while (right->left)
+        right = right->left;
+      right->prev = pivot;
+    }
+  pivot->prev = left;
+  pivot->next = right;
+}
+
+/* Clears the outer links of the first and last node of a tree put together
+   from parts of other trees. */
+static inline void
+rbt_thread_ends (struct rbt_node *root)
+{
+  struct rbt_node *node;
+  if (!root)
+    return;
+  for (node = root; node->left; node = node->left)
+    ;
+  node->prev = NULL;
+  for (node = root; node->right; node = node->right)
+    ;
+  node->next = NULL;
+}
+#endif
+
+/* Joins two detached subtrees with their black heights `lbh` and `rbh` and a
+   pivot node.  Returns the new root and sets `bh` to its black height.  The
+   rebalancing is counted in the statistics of `owner`. */
+static struct rbt_node *
+rbt_join_impl (struct rbt_node *left, unsigned lbh, struct rbt_node *pivot,
+               struct rbt_node *right, unsigned rbh, unsigned *bh,
+               struct rbtree *owner)
+{
+  struct rbtree tree;
+  struct rbt_node *node, *parent, *shorter;
+  enum rbt_direction dir;
+  unsigned height, target;
+
+#ifdef RBT_STATS
+  memset (&tree.stats, 0, sizeof (tree.stats));
+#else
+  (void)owner;
+#endif
+
+  /* Blackening the roots is always valid and leaves only the red `pivot` as
+     a possible violation. */
+  if (left && RBT_COLOR (left) == RBT_RED)
+    {
+      RBT_SET_COLOR (left, RBT_BLACK);
+      ++lbh;
+    }
+  if (right && RBT_COLOR (right) == RBT_RED)
+    {
+      RBT_SET_COLOR (right, RBT_BLACK);
+      ++rbh;
+    }
+
+  if (lbh == rbh)
+    {
+      RBT_SET_PARENT_COLOR (pivot, NULL, RBT_BLACK);
+      pivot->left = left;
+      pivot->right = right;
+      if (left)
+        RBT_SET_PARENT (left, pivot);
+      if (right)
+        RBT_SET_PARENT (right, pivot);
+#ifdef RBT_ORDER_STATISTICS
+      pivot->count = 1 + rbt_count (left) + rbt_count (right);
+#endif
+      *bh = lbh + 1;
+      return pivot;
+    }
+
+  /* Walk down the inner spine of the taller tree until reaching a black node
+     with the same black height as the shorter tree, which becomes the child
+     of `pivot` in place of it. */
+  if (lbh > rbh)
+    {
+      tree.root = left;
+      dir = RBT_RIGHT;
+      height = lbh;
+      target = rbh;
+      shorter = right;
+    }
+  else
+    {
+      tree.root = right;
+      dir = RBT_LEFT;
+      height = rbh;
+      target = lbh;
+      shorter = left;
+    }
+  parent = NULL;
+  node = tree.root;
+  while (node && (height > target || RBT_COLOR (node) == RBT_RED))
+    {
+      if (RBT_COLOR (node) == RBT_BLACK)
+        --height;
+      parent = node;
+      node = node->child[dir];
+    }
+
+  RBT_SET_PARENT_COLOR (pivot, parent, RBT_RED);
+  pivot->child[RBT_OPPOSITE (dir)] = node;
+  pivot->child[dir] = shorter;
+  parent->child[dir] = pivot;
+  if (node)
+    RBT_SET_PARENT (node, pivot);
+  if (shorter)
+    RBT_SET_PARENT (shorter, pivot);
+#ifdef RBT_ORDER_STATISTICS
+  pivot->count = 1 + rbt_count (node) + rbt_count (shorter);
+  rbt_count_add (parent, 1 + rbt_count (shorter));
+#endif
+
+  /* Recoloring during the rebalance never changes the black height as the
+     root was black. */
+  rbt_insert_rebalance (&tree, pivot, parent, NULL);
+  RBT_STATS_ADD (owner, rotations, tree.stats.rotations);
+  RBT_STATS_ADD (owner, insert_fixups, tree.stats.insert_fixups);
+  *bh = lbh > rbh ? lbh : rbh;
+  return tree.root;
+}
+
+void
+rbt_join (struct rbtree *left, struct rbt_node *pivot, struct rbtree *right)
+{
+  unsigned bh;
+#ifdef RBT_THREADED
+  rbt_thread_join (left->root, pivot, right->root);
+#endif
+  left->root = rbt_join_impl (left->root, rbt_black_height (left->root),
+                              pivot, right->root,
+                              rbt_black_height (right->root), &bh, left);
+  right->root = NULL;
+}
+
+/* Detached subtree together with its black height. */
+struct rbt_subtree
+{
+  struct rbt_node *root;
+  unsigned bh;
+};
+
+static void
+rbt_split_impl (struct rbt_node *pivot, struct rbt_subtree *less,
+                struct rbt_subtree *greater, struct rbtree *owner)
+{
+  struct rbt_node *node, *parent, *next, *sibling, *left, *right;
+  unsigned height, lbh, rbh, parent_height;
+
+  /* Black height of the subtrees of the current node. */
+  height = rbt_black_height (pivot) - (RBT_COLOR (pivot) == RBT_BLACK);
+  left = pivot->left;
+  right = pivot->right;
+  lbh = rbh = height;
+  if (left)
+    RBT_SET_PARENT (left, NULL);
+  if (right)
+    RBT_SET_PARENT (right, NULL);
+
+  /* Going up from `pivot` each ancestor and its other subtree belong to the
+     same side, so they are joined onto that sides tree.  Since the black
+     heights grow along the way this takes O(log n) in total. */
+  height += RBT_COLOR (pivot) == RBT_BLACK;
+  node = pivot;
+  parent = RBT_PARENT (pivot);
+  while (parent)
+    {
+      next = RBT_PARENT (parent);
+      parent_height = height + (RBT_COLOR (parent) == RBT_BLACK);
+      if (node == parent->right)
+        {
+          sibling = parent->left;
+          if (sibling)
+            RBT_SET_PARENT (sibling, NULL);
+          left = rbt_join_impl (sibling, height, parent, left, lbh, &lbh,
+                                owner);
+        }
+      else
+        {
+          sibling = parent->right;
+          if (sibling)
+            RBT_SET_PARENT (sibling, NULL);
+          right = rbt_join_impl (right, rbh, parent, sibling, height, &rbh,
+                                 owner);
+        }
+      node = parent;
+      parent = next;
+      height = parent_height;
+    }
+
+  less->root = left;
+  less->bh = lbh;
+  greater->root = right;
+  greater->bh = rbh;
+}
+
+void
+rbt_split (struct rbtree *self, struct rbt_node *pivot, struct rbtree *less,
+           struct rbtree *greater)
+{
+  struct rbt_subtree l, r;
+#ifdef RBT_THREADED
+  if (pivot->prev)
+    pivot->prev->next = NULL;
+  if (pivot->next)
+    pivot->next->prev = NULL;
+#endif
+  rbt_split_impl (pivot, &l, &r, self);
+  self->root = NULL;
+  less->root = l.root;
+  greater->root = r.root;
+}
+
+static inline struct rbt_subtree
+rbt_subtree_join (struct rbt_subtree left, struct rbt_node *pivot,
+                  struct rbt_subtree right, struct rbtree *owner)
+{
+  struct rbt_subtree result;
+#ifdef RBT_THREADED
+  rbt_thread_join (left.root, pivot, right.root);
+#endif
+  result.root = rbt_join_impl (left.root, left.bh, pivot, right.root,
+                               right.bh, &result.bh, owner);
+  return result;
+}
+
+/* Joins two subtrees without a pivot by taking the last node of `left`. */
+static struct rbt_subtree
+rbt_subtree_concat (struct rbt_subtree left, struct rbt_subtree right,
+                    struct rbtree *owner)
+{
+  struct rbt_subtree rest, empty;
+  struct rbt_node *last;
+  if (!left.root)
+    return right;
+  if (!right.root)
+    return left;
+  for (last = left.root; last->right; last = last->right)
+    ;
+  rbt_split_impl (last, &rest, &empty, owner);
+  return rbt_subtree_join (rest, last, right, owner);
+}
+
+/* Splits a subtree by the key of `key`, which is not part of it.  Returns the
+   node equal to `key`, which is removed from the subtree, or NULL. */
+static struct rbt_node *
+rbt_subtree_split_key (struct rbt_subtree tree, const struct rbt_node *key,
+                       rbt_compare_t cmp, struct rbt_subtree *less,
+                       struct rbt_subtree *greater, struct rbtree *owner)
+{
+  struct rbt_subtree left, right, rest;
+  struct rbt_node *root = tree.root, *found;
+  int c;
+
+  if (!root)
+    {
+      less->root = greater->root = NULL;
+      less->bh = greater->bh = 0;
+      return NULL;
+    }
+
+  left.root = root->left;
+  right.root = root->right;
+  left.bh = right.bh = tree.bh - (RBT_COLOR (root) == RBT_BLACK);
+  if (left.root)
+    RBT_SET_PARENT (left.root, NULL);
+  if (right.root)
+    RBT_SET_PARENT (right.root, NULL);
+
+  c = cmp (key, root);
+  if (c == 0)
+    {
+      *less = left;
+      *greater = right;
+      return root;
+    }
+  if (c < 0)
+    {
+      found = rbt_subtree_split_key (left, key, cmp, less, &rest, owner);
+      *greater = rbt_subtree_join (rest, root, right, owner);
+    }
+  else
+    {
+      found = rbt_subtree_split_key (right, key, cmp, &rest, greater, owner);
+      *less = rbt_subtree_join (left, root, rest, owner);
+    }
+  return found;
+}
+
+static void
+rbt_free_subtree (struct rbt_node *node, rbt_free_node_t free_node)
+{
+  if (!node || !free_node)
+    return;
+  rbt_free_subtree (node->left, free_node);
+  rbt_free_subtree (node->right, free_node);
+  free_node (node);
+}
+
+enum rbt_set_operation
+{
+  RBT_SET_UNION,
+  RBT_SET_INTERSECT,
+  RBT_SET_DIFFERENCE
+};
+
+struct rbt_set_context
+{
+  enum rbt_set_operation operation;
+  rbt_compare_t cmp;
+  rbt_free_node_t free_node;
+  /* The tree receiving the result, for the statistics. */
+  struct rbtree *owner;
+};
+
+static struct rbt_subtree rbt_set_operation_impl (
+  const struct rbt_set_context *ctx, struct rbt_subtree a,
+  struct rbt_subtree b, unsigned nthreads);
+
+#ifdef RBT_THREADS
+struct rbt_set_task
+{
+  const struct rbt_set_context *ctx;
+  struct rbt_subtree a, b, result;
+  unsigned nthreads;
+};
+
+static void *
+rbt_set_task_run (void *arg)
+{
+  struct rbt_set_task *task = (struct rbt_set_task *)arg;
+  task->result = rbt_set_operation_impl (task->ctx, task->a, task->b,
+                                         task->nthreads);
+  return NULL;
+}
+#endif
+
+/* Divide and conquer over the root of `b`: split `a` by it, solve both sides
+   (possibly in parallel) and join the results back together. */
+static struct rbt_subtree
+rbt_set_operation_impl (const struct rbt_set_context *ctx,
+                        struct rbt_subtree a, struct rbt_subtree b,
+                        unsigned nthreads)
+{
+  struct rbt_subtree a_less, a_greater, b_less, b_greater, less, greater;
+  struct rbt_node *pivot, *found;
+
+  if (!a.root || !b.root)
+    {
+      switch (ctx->operation)
+        {
+        case RBT_SET_UNION:
+          return a.root ? a : b;
+        case RBT_SET_INTERSECT:
+          rbt_free_subtree (a.root, ctx->free_node);
+          rbt_free_subtree (b.root, ctx->free_node);
+          a.root = NULL;
+          a.bh = 0;
+          return a;
+        case RBT_SET_DIFFERENCE:
+          rbt_free_subtree (b.root, ctx->free_node);
+          return a;
+        }
+    }
+
+  pivot = b.root;
+  b_less.root = pivot->left;
+  b_greater.root = pivot->right;
+  b_less.bh = b_greater.bh = b.bh - (RBT_COLOR (pivot) == RBT_BLACK);
+  if (b_less.root)
+    RBT_SET_PARENT (b_less.root, NULL);
+  if (b_greater.root)
+    RBT_SET_PARENT (b_greater.root, NULL);
+  found = rbt_subtree_split_key (a, pivot, ctx->cmp, &a_less, &a_greater,
+                                 ctx->owner);
+
+#ifdef RBT_THREADS
+  if (nthreads > 1 && a.bh >= RBT_PARALLEL_CUTOFF
+      && b.bh >= RBT_PARALLEL_CUTOFF)
+    {
+      struct rbt_set_task task;
+      pthread_t thread;
+      task.ctx = ctx;
+      task.a = a_less;
+      task.b = b_less;
+      task.nthreads = nthreads / 2;
+      if (pthread_create (&thread, NULL, rbt_set_task_run, &task) == 0)
+        {
+          greater = rbt_set_operation_impl (ctx, a_greater, b_greater,
+                                            nthreads - nthreads / 2);
+          pthread_join (thread, NULL);
+          less = task.result;
+          goto rbt_set_combine;
+        }
+    }
+#endif
+  less = rbt_set_operation_impl (ctx, a_less, b_less, nthreads);
+  greater = rbt_set_operation_impl (ctx, a_greater, b_greater, nthreads);
+
+#ifdef RBT_THREADS
+rbt_set_combine:
+#endif
+  switch (ctx->operation)
+    {
+    case RBT_SET_UNION:
+      if (found && ctx->free_node)
+        ctx->free_node (pivot);
+      return rbt_subtree_join (less, found ? found : pivot, greater,
+                               ctx->owner);
+    case RBT_SET_INTERSECT:
+      if (ctx->free_node)
+        ctx->free_node (pivot);
+      if (found)
+        return rbt_subtree_join (less, found, greater, ctx->owner);
+      return rbt_subtree_concat (less, greater, ctx->owner);
+    case RBT_SET_DIFFERENCE:
+      if (ctx->free_node)
+        {
+          ctx->free_node (pivot);
+          if (found)
+            ctx->free_node (found);
+        }
+      return rbt_subtree_concat (less, greater, ctx->owner);
+    }
+  __builtin_unreachable ();
+}
+
+static void
+rbt_set_operation (struct rbtree *self, struct rbtree *other,
+                   enum rbt_set_operation operation, rbt_compare_t cmp,
+                   rbt_free_node_t free_node, unsigned nthreads)
+{
+  struct rbt_set_context ctx;
+  struct rbt_subtree a, b;
+  ctx.operation = operation;
+  ctx.cmp = cmp;
+  ctx.free_node = free_node;
+  ctx.owner = self;
+  a.root = self->root;
+  a.bh = rbt_black_height (a.root);
+  b.root = other->root;
+  b.bh = rbt_black_height (b.root);
+  self->root = rbt_set_operation_impl (&ctx, a, b, nthreads).root;
+  other->root = NULL;
+#ifdef RBT_THREADED
+  rbt_thread_ends (self->root);
+#endif
+}
+
+void
+rbt_union (struct rbtree *self, struct rbtree *other, rbt_compare_t cmp,
+           rbt_free_node_t free_node, unsigned nthreads)
+{
+  rbt_set_operation (self, other, RBT_SET_UNION, cmp, free_node, nthreads);
+}
+
+void
+rbt_intersect (struct rbtree *self, struct rbtree *other, rbt_compare_t cmp,
+               rbt_free_node_t free_node, unsigned nthreads)
+{
+  rbt_set_operation (self, other, RBT_SET_INTERSECT, cmp, free_node,
+                     nthreads);
+}
+
+void
+rbt_difference (struct rbtree *self, struct rbtree *other, rbt_compare_t cmp,
+                rbt_free_node_t free_node, unsigned nthreads)
+{
+  rbt_set_operation (self, other, RBT_SET_DIFFERENCE, cmp, free_node,
+                     nthreads);
+}
+
+void
+rbt_erase_range (struct rbtree *self, struct rbt_node *first,
+                 struct rbt_node *last, rbt_free_node_t free_node)
+{
+  struct rbt_subtree less, middle, greater;
+
+  rbt_split_impl (first, &less, &greater, self);
+  if (last != first)
+    {
+      rbt_split_impl (last, &middle, &greater, self);
+      rbt_free_subtree (middle.root, free_node);
+      if (free_node)
+        free_node (last);
+    }
+  if (free_node)
+    free_node (first);
+  self->root = rbt_subtree_concat (less, greater, self).root;
+  if (self->root)
+    RBT_SET_PARENT (self->root, NULL);
+#ifdef RBT_THREADED
+  rbt_thread_ends (self->root);
+#endif
+}
+
+
+static unsigned
+rbt_height_impl (const struct rbt_node *node)
+{
+  if (!node)
+    return 0;
+  const unsigned left = rbt_height_impl (node->left);
+  const unsigned right = rbt_height_impl (node->right);
+  return 1 + (left > right ? left : right);
+}
+
+unsigned
+rbt_height (const struct rbtree *tree)
+{
+  return rbt_height_impl (tree->root);
+}
+
+
+#ifndef RBT_ORDER_STATISTICS
+static unsigned
+rbt_size_impl (const struct rbt_node *node)
+{
+  return (node
+          ? 1 + rbt_size_impl (node->left) + rbt_size_impl (node->right)
+          : 0);
+}
+#endif
+
+unsigned
+rbt_size (const struct rbtree *tree)
+{
+#ifdef RBT_ORDER_STATISTICS
+  return rbt_count (tree->root);
+#else
+  return rbt_size_impl (tree->root);
+#endif
+}
+
+
+#ifdef RBT_STATS
+void
+rbt_stats_dump (const struct rbtree *self, const char *name, FILE *stream)
+{
+  const struct rbt_stats *stats = &self->stats;
+  unsigned i, used = RBT_STATS_DEPTHS;
+
+  while (used && stats->depth[used - 1] == 0)
+    --used;
+  fprintf (stream,
+           "{\"name\":\"%s\",\"inserts\":%llu,\"erases\":%llu,"
+           "\"rotations\":%llu,\"insert_fixups\":%llu,"
+           "\"erase_fixups\":%llu,\"swaps\":%llu,\"searches\":%llu,"
+           "\"search_depth\":[",
+           name, stats->inserts, stats->erases, stats->rotations,
+           stats->insert_fixups, stats->erase_fixups, stats->swaps,
+           stats->searches);
+  for (i = 0; i < used; ++i)
+    fprintf (stream, i ? ",%llu" : "%llu", stats->depth[i]);
+  fputs ("]}\n", stream);
+}
+
+
+void
+rbt_stats_reset (struct rbtree *self)
+{
+  memset (&self->stats, 0, sizeof (self->stats));
+}
+#endif
+
+
+#ifdef RBT_ORDER_STATISTICS
+struct rbt_node *
+rbt_select (const struct rbtree *self, unsigned k)
+{
+  struct rbt_node *node = self->root;
+  unsigned left;
+  while (node)
+    {
+      left = rbt_count (node->left);
+      if (k < left)
+        node = node->left;
+      else if (k > left)
+        {
+          k -= left + 1;
+          node = node->right;
+        }
+      else
+        break;
+    }
+  return node;
+}
+
+
+unsigned
+rbt_rank (const struct rbt_node *node)
 {
+  struct rbt_node *parent;
+  unsigned rank = rbt_count (node->left);
+  while ((parent = RBT_PARENT (node)))
+    {
+      if (node == parent->right)
+        rank += rbt_count (parent->left) + 1;
+      node = parent;
+    }
+  return rank;
+}
+#endif
+
+
+struct rbt_node *
+rbt_next (const struct rbt_node *node)
+{
+#ifdef RBT_THREADED
+  return node->next;
+#else
   struct rbt_node *parent;
   if (node->right)
     {
@@ -417,15 +2162,19 @@ rbt_next (const struct rbt_node *node)
         node = node->left;
       return (struct rbt_node *)node;
     }
-  while ((parent = node->parent) && node == parent->right)
+  while ((parent = RBT_PARENT (node)) && node == parent->right)
     node = parent;
   return parent;
+#endif
 }
 
 
 struct rbt_node *
 rbt_prev (const struct rbt_node *node)
 {
+#ifdef RBT_THREADED
+  return node->prev;
+#else
   struct rbt_node *parent;
   if (node->left)
     {
@@ -434,9 +2183,49 @@ rbt_prev (const struct rbt_node *node)
         node = node->right;
       return (struct rbt_node *)node;
     }
-  while ((parent = node->parent) && node == parent->left)
+  while ((parent = RBT_PARENT (node)) && node == parent->left)
     node = parent;
   return parent;
+#endif
+}
+
+
+/* The successor of `node` is found through its right child or its parent,
+   or is linked directly with `RBT_THREADED`.  Fetch it while the caller is
+   busy with `node`. */
+static inline void
+rbt_range_prefetch (const struct rbt_node *node)
+{
+#ifdef RBT_THREADED
+  if (node)
+    __builtin_prefetch (node->next);
+#else
+  if (node)
+    __builtin_prefetch (node->right ? node->right : RBT_PARENT (node));
+#endif
+}
+
+struct rbt_node *
+rbt_range_begin (struct rbt_range *range, struct rbt_node *first,
+                 const struct rbt_node *last)
+{
+  range->node = first;
+  range->last = last;
+  rbt_range_prefetch (first);
+  return first;
+}
+
+struct rbt_node *
+rbt_range_next (struct rbt_range *range)
+{
+  struct rbt_node *node = range->node;
+  if (!node || node == range->last)
+    node = NULL;
+  else
+    node = rbt_next (node);
+  range->node = node;
+  rbt_range_prefetch (node);
+  return node;
 }
 
 
@@ -536,6 +2325,331 @@ rbt_print (const struct rbtree *tree, rbt_print_node_t print_node,
   free (buf);
 }
 
+
+#define rbt_index_child_direction(self, n) \
+  ((n) == RBT_INODE (self, RBT_INDEX_PARENT (RBT_INODE (self, n)))->left \
+   ? RBT_LEFT : RBT_RIGHT)
+
+static inline bool
+rbt_index_is_red (const struct rbtree_index *self, uint32_t node)
+{
+  return (node != RBT_NIL
+          && RBT_INDEX_COLOR (RBT_INODE (self, node)) == RBT_RED);
+}
+
+static inline void
+rbt_index_rotate (struct rbtree_index *self, uint32_t parent,
+                  enum rbt_direction dir)
+{
+  struct rbt_inode *p = RBT_INODE (self, parent), *s, *g;
+  uint32_t gparent, sibling, close;
+  gparent = RBT_INDEX_PARENT (p);
+  sibling = p->child[RBT_OPPOSITE (dir)];
+  assert (sibling != RBT_NIL);
+  s = RBT_INODE (self, sibling);
+  close = s->child[dir];
+
+  p->child[RBT_OPPOSITE (dir)] = close;
+  if (close != RBT_NIL)
+    RBT_INDEX_SET_PARENT (RBT_INODE (self, close), parent);
+
+  s->child[dir] = parent;
+  RBT_INDEX_SET_PARENT (p, sibling);
+
+  RBT_INDEX_SET_PARENT (s, gparent);
+  if (gparent != RBT_NIL)
+    {
+      g = RBT_INODE (self, gparent);
+      g->child[parent == g->right ? RBT_RIGHT : RBT_LEFT] = sibling;
+    }
+  else
+    self->root = sibling;
+}
+
+void
+rbt_index_insert (struct rbtree_index *self, uint32_t node, uint32_t parent,
+                  enum rbt_direction dir)
+{
+  struct rbt_inode *n = RBT_INODE (self, node), *p, *g;
+  uint32_t gparent, uncle;
+
+  RBT_INDEX_SET_PARENT_COLOR (n, parent, RBT_RED);
+  n->left = RBT_NIL;
+  n->right = RBT_NIL;
+  if (parent == RBT_NIL)
+    {
+      self->root = node;
+      return;
+    }
+  RBT_INODE (self, parent)->child[dir] = node;
+
+  /* Same cases as `rbt_insert_rebalance`. */
+  do
+    {
+      p = RBT_INODE (self, parent);
+      if (RBT_INDEX_COLOR (p) == RBT_BLACK)
+        return;
+      if ((gparent = RBT_INDEX_PARENT (p)) == RBT_NIL)
+        {
+          RBT_INDEX_SET_COLOR (p, RBT_BLACK);
+          return;
+        }
+      g = RBT_INODE (self, gparent);
+      dir = parent == g->left ? RBT_LEFT : RBT_RIGHT;
+      uncle = g->child[RBT_OPPOSITE (dir)];
+      if (!rbt_index_is_red (self, uncle))
+        {
+          if (node == p->child[RBT_OPPOSITE (dir)])
+            {
+              rbt_index_rotate (self, parent, dir);
+              parent = g->child[dir];
+              p = RBT_INODE (self, parent);
+            }
+          rbt_index_rotate (self, gparent, RBT_OPPOSITE (dir));
+          RBT_INDEX_SET_COLOR (p, RBT_BLACK);
+          RBT_INDEX_SET_COLOR (g, RBT_RED);
+          return;
+        }
+      RBT_INDEX_SET_COLOR (p, RBT_BLACK);
+      RBT_INDEX_SET_COLOR (RBT_INODE (self, uncle), RBT_BLACK);
+      RBT_INDEX_SET_COLOR (g, RBT_RED);
+      node = gparent;
+    }
+  while ((parent = RBT_INDEX_PARENT (RBT_INODE (self, node))) != RBT_NIL);
+}
+
+/* Like `rbt_swap_nodes`. */
+static void
+rbt_index_swap_nodes (struct rbtree_index *self, uint32_t a, uint32_t b)
+{
+  struct rbt_inode *na = RBT_INODE (self, a), *nb = RBT_INODE (self, b);
+  struct rbt_inode *p, swap;
+
+  if (RBT_INDEX_PARENT (na) != RBT_NIL)
+    {
+      p = RBT_INODE (self, RBT_INDEX_PARENT (na));
+      if (a == p->left)
+        p->left = b;
+      else
+        p->right = b;
+    }
+
+  if (nb->left != RBT_NIL)
+    RBT_INDEX_SET_PARENT (RBT_INODE (self, nb->left), a);
+  if (nb->right != RBT_NIL)
+    RBT_INDEX_SET_PARENT (RBT_INODE (self, nb->right), a);
+
+  if (a == RBT_INDEX_PARENT (nb))
+    {
+      swap = *nb;
+      if (b == na->left)
+        {
+          nb->right = na->right;
+          nb->left = a;
+        }
+      else
+        {
+          nb->left = na->left;
+          nb->right = a;
+        }
+      RBT_INDEX_SET_PARENT_COLOR (nb, RBT_INDEX_PARENT (na),
+                                  RBT_INDEX_COLOR (na));
+
+      RBT_INDEX_SET_PARENT_COLOR (na, b, RBT_INDEX_COLOR (&swap));
+      na->left = swap.left;
+      na->right = swap.right;
+    }
+  else
+    {
+      p = RBT_INODE (self, RBT_INDEX_PARENT (nb));
+      if (b == p->left)
+        p->left = a;
+      else
+        p->right = a;
+
+      swap = *nb;
+      *nb = *na;
+      *na = swap;
+    }
+
+  if (nb->left != RBT_NIL)
+    RBT_INDEX_SET_PARENT (RBT_INODE (self, nb->left), b);
+  if (nb->right != RBT_NIL)
+    RBT_INDEX_SET_PARENT (RBT_INODE (self, nb->right), b);
+}
+
+/* Like `rbt_erase_rebalance`. */
+static inline void
+rbt_index_erase_rebalance (struct rbtree_index *self, uint32_t parent,
+                           enum rbt_direction dir)
+{
+  struct rbt_inode *p, *s;
+  uint32_t node, sibling, close, distant;
+
+  goto rbt_index_erase_skip_direction_update;
+  do
+    {
+      dir = rbt_index_child_direction (self, node);
+rbt_index_erase_skip_direction_update:
+      p = RBT_INODE (self, parent);
+      sibling = p->child[RBT_OPPOSITE (dir)];
+      s = RBT_INODE (self, sibling);
+      distant = s->child[RBT_OPPOSITE (dir)];
+      close = s->child[dir];
+
+      if (RBT_INDEX_COLOR (s) == RBT_RED)
+        {
+          rbt_index_rotate (self, parent, dir);
+          RBT_INDEX_SET_COLOR (p, RBT_RED);
+          RBT_INDEX_SET_COLOR (s, RBT_BLACK);
+          sibling = close;
+          s = RBT_INODE (self, sibling);
+          distant = s->child[RBT_OPPOSITE (dir)];
+          if (rbt_index_is_red (self, distant))
+            goto rbt_index_delete_1;
+          close = s->child[dir];
+          if (rbt_index_is_red (self, close))
+            goto rbt_index_delete_2;
+          goto rbt_index_delete_3;
+        }
+      if (rbt_index_is_red (self, distant))
+        {
+rbt_index_delete_1:
+          rbt_index_rotate (self, parent, dir);
+          RBT_INDEX_SET_COLOR (s, RBT_INDEX_COLOR (p));
+          RBT_INDEX_SET_COLOR (p, RBT_BLACK);
+          RBT_INDEX_SET_COLOR (RBT_INODE (self, distant), RBT_BLACK);
+          return;
+        }
+      if (rbt_index_is_red (self, close))
+        {
+rbt_index_delete_2:
+          rbt_index_rotate (self, sibling, RBT_OPPOSITE (dir));
+          RBT_INDEX_SET_COLOR (s, RBT_RED);
+          RBT_INDEX_SET_COLOR (RBT_INODE (self, close), RBT_BLACK);
+          distant = sibling;
+          sibling = close;
+          s = RBT_INODE (self, sibling);
+          goto rbt_index_delete_1;
+        }
+      if (RBT_INDEX_COLOR (p) == RBT_RED)
+        {
+rbt_index_delete_3:
+          RBT_INDEX_SET_COLOR (s, RBT_RED);
+          RBT_INDEX_SET_COLOR (p, RBT_BLACK);
+          return;
+        }
+      RBT_INDEX_SET_COLOR (s, RBT_RED);
+      node = parent;
+    }
+  while ((parent = RBT_INDEX_PARENT (RBT_INODE (self, node))) != RBT_NIL);
+}
+
+void
+rbt_index_erase (struct rbtree_index *self, uint32_t victim)
+{
+  struct rbt_inode *v = RBT_INODE (self, victim), *r;
+  uint32_t replacement, parent;
+  enum rbt_direction dir;
+
+  if (victim == self->root && v->left == v->right)
+    {
+      self->root = RBT_NIL;
+      return;
+    }
+  if (v->left != RBT_NIL && v->right != RBT_NIL)
+    {
+      replacement = rbt_index_prev (self, victim);
+      if (victim == self->root)
+        self->root = replacement;
+      rbt_index_swap_nodes (self, victim, replacement);
+    }
+
+  parent = RBT_INDEX_PARENT (v);
+  dir = (parent != RBT_NIL
+         ? rbt_index_child_direction (self, victim) : RBT_LEFT);
+
+  if (RBT_INDEX_COLOR (v) == RBT_RED)
+    {
+      RBT_INODE (self, parent)->child[dir] = RBT_NIL;
+      return;
+    }
+
+  if (v->left == v->right)
+    {
+      RBT_INODE (self, parent)->child[dir] = RBT_NIL;
+      rbt_index_erase_rebalance (self, parent, dir);
+    }
+  else
+    {
+      replacement = v->left != RBT_NIL ? v->left : v->right;
+      r = RBT_INODE (self, replacement);
+      RBT_INDEX_SET_PARENT_COLOR (r, parent, RBT_BLACK);
+      if (parent != RBT_NIL)
+        RBT_INODE (self, parent)->child[dir] = replacement;
+      else
+        self->root = replacement;
+    }
+}
+
+
+uint32_t
+rbt_index_first (const struct rbtree_index *self)
+{
+  uint32_t node = self->root;
+  if (node != RBT_NIL)
+    while (RBT_INODE (self, node)->left != RBT_NIL)
+      node = RBT_INODE (self, node)->left;
+  return node;
+}
+
+
+uint32_t
+rbt_index_last (const struct rbtree_index *self)
+{
+  uint32_t node = self->root;
+  if (node != RBT_NIL)
+    while (RBT_INODE (self, node)->right != RBT_NIL)
+      node = RBT_INODE (self, node)->right;
+  return node;
+}
+
+
+uint32_t
+rbt_index_next (const struct rbtree_index *self, uint32_t node)
+{
+  uint32_t parent;
+  if (RBT_INODE (self, node)->right != RBT_NIL)
+    {
+      node = RBT_INODE (self, node)->right;
+      while (RBT_INODE (self, node)->left != RBT_NIL)
+        node = RBT_INODE (self, node)->left;
+      return node;
+    }
+  while ((parent = RBT_INDEX_PARENT (RBT_INODE (self, node))) != RBT_NIL
+         && node == RBT_INODE (self, parent)->right)
+    node = parent;
+  return parent;
+}
+
+
+uint32_t
+rbt_index_prev (const struct rbtree_index *self, uint32_t node)
+{
+  uint32_t parent;
+  if (RBT_INODE (self, node)->left != RBT_NIL)
+    {
+      node = RBT_INODE (self, node)->left;
+      while (RBT_INODE (self, node)->right != RBT_NIL)
+        node = RBT_INODE (self, node)->right;
+      return node;
+    }
+  while ((parent = RBT_INDEX_PARENT (RBT_INODE (self, node))) != RBT_NIL
+         && node == RBT_INODE (self, parent)->left)
+    node = parent;
+  return parent;
+}
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,444 @@
+/* github.com/JaMo42/rb-tree */
+#ifndef RB_TREE_HPP
+#define RB_TREE_HPP
+
+/* The anonymous struct inside `struct rbt_node` is an extension in C++. */
+#if defined(__GNUC__)
+#  pragma GCC diagnostic push
+#  pragma GCC diagnostic ignored "-Wpedantic"
+#endif
+#include "rb_tree.h"
+#if defined(__GNUC__)
+#  pragma GCC diagnostic pop
+#endif
+
+#include <cstddef>
+#include <functional>
+#include <iterator>
+#include <type_traits>
+#include <utility>
+
+namespace rbt
+{
+
+/* Intrusive ordered set of `T` objects, linked through the `struct rbt_node`
+   member `Member` and ordered by `Compare`, which like for `std::set` is a
+   strict weak ordering.  The set never allocates or owns its elements.
+
+   Heterogeneous lookup is available if `Compare` has an `is_transparent`
+   member type, like the default `std::less<>`.
+
+   For the C functions to be inlined include this header after defining
+   `RBT_STATIC` and `RBT_IMPLEMENTATION`; otherwise the implementation has to
+   be compiled in one translation unit as for C. */
+template <class T, rbt_node T::*Member, class Compare = std::less<>>
+class intrusive_set
+{
+  template <bool Const>
+  class basic_iterator;
+
+  /* Any type can be looked up with a transparent comparator, otherwise only
+     `T` itself. */
+  template <class K, class C = Compare, class = void>
+  struct is_key : std::is_same<K, T>
+  {
+  };
+
+  template <class K, class C>
+  struct is_key<K, C, std::void_t<typename C::is_transparent>>
+    : std::true_type
+  {
+  };
+
+public:
+  using value_type = T;
+  using key_type = T;
+  using key_compare = Compare;
+  using size_type = std::size_t;
+  using difference_type = std::ptrdiff_t;
+  using reference = T &;
+  using const_reference = const T &;
+  using pointer = T *;
+  using const_pointer = const T *;
+  using iterator = basic_iterator<false>;
+  using const_iterator = basic_iterator<true>;
+  using reverse_iterator = std::reverse_iterator<iterator>;
+  using const_reverse_iterator = std::reverse_iterator<const_iterator>;
+
+  intrusive_set () noexcept : m_tree (), m_compare () {}
+
+  explicit intrusive_set (const Compare &compare) noexcept
+    : m_tree (), m_compare (compare)
+  {
+  }
+
+  /* An element can only be linked into one set at a time, so the set can be
+     moved but not copied. */
+  intrusive_set (const intrusive_set &) = delete;
+  intrusive_set &operator= (const intrusive_set &) = delete;
+
+  intrusive_set (intrusive_set &&other) noexcept
+    : m_tree (other.m_tree), m_compare (std::move (other.m_compare))
+  {
+    other.m_tree.root = nullptr;
+  }
+
+  intrusive_set &
+  operator= (intrusive_set &&other) noexcept
+  {
+    m_tree = other.m_tree;
+    m_compare = std::move (other.m_compare);
+    other.m_tree.root = nullptr;
+    return *this;
+  }
+
+  iterator begin () noexcept { return iterator (first (), &m_tree); }
+  const_iterator begin () const noexcept
+  {
+    return const_iterator (first (), &m_tree);
+  }
+  const_iterator cbegin () const noexcept { return begin (); }
+  iterator end () noexcept { return iterator (nullptr, &m_tree); }
+  const_iterator end () const noexcept
+  {
+    return const_iterator (nullptr, &m_tree);
+  }
+  const_iterator cend () const noexcept { return end (); }
+  reverse_iterator rbegin () noexcept { return reverse_iterator (end ()); }
+  const_reverse_iterator rbegin () const noexcept
+  {
+    return const_reverse_iterator (end ());
+  }
+  reverse_iterator rend () noexcept { return reverse_iterator (begin ()); }
+  const_reverse_iterator rend () const noexcept
+  {
+    return const_reverse_iterator (begin ());
+  }
+
+  bool empty () const noexcept { return m_tree.root == nullptr; }
+
+  /* O(n) unless `RBT_ORDER_STATISTICS` is defined. */
+  size_type size () const noexcept { return rbt_size (&m_tree); }
+
+  /* Unlinks all elements without touching them. */
+  void clear () noexcept { m_tree.root = nullptr; }
+
+  /* Inserts `value` unless an equal element exists.  Returns an iterator to
+     the element with the key of `value` and whether `value` was inserted. */
+  std::pair<iterator, bool>
+  insert (T &value)
+  {
+    rbt_node *node = m_tree.root, *parent = nullptr;
+    rbt_direction dir = RBT_LEFT;
+    while (node)
+      {
+        T &test = to_value (node);
+        parent = node;
+        if (m_compare (value, test))
+          dir = RBT_LEFT;
+        else if (m_compare (test, value))
+          dir = RBT_RIGHT;
+        else
+          return { iterator (node, &m_tree), false };
+        node = node->child[dir];
+      }
+    rbt_insert (&m_tree, &(value.*Member), parent, dir);
+    return { iterator (&(value.*Member), &m_tree), true };
+  }
+
+  /* Inserts `value` after all elements equal to it. */
+  iterator
+  insert_multi (T &value)
+  {
+    rbt_node *node = m_tree.root, *parent = nullptr;
+    rbt_direction dir = RBT_LEFT;
+    while (node)
+      {
+        parent = node;
+        dir = m_compare (value, to_value (node)) ? RBT_LEFT : RBT_RIGHT;
+        node = node->child[dir];
+      }
+    rbt_insert (&m_tree, &(value.*Member), parent, dir);
+    return iterator (&(value.*Member), &m_tree);
+  }
+
+  /* Unlinks the element and returns an iterator to its successor. */
+  iterator
+  erase (iterator pos) noexcept
+  {
+    rbt_node *next = rbt_next (pos.m_node);
+    rbt_erase (&m_tree, pos.m_node);
+    return iterator (next, &m_tree);
+  }
+
+  iterator
+  erase (const_iterator pos) noexcept
+  {
+    return erase (iterator (pos.m_node, &m_tree));
+  }
+
+  /* Unlinks `value`, which must be an element of this set. */
+  void erase (T &value) noexcept { rbt_erase (&m_tree, &(value.*Member)); }
+
+  template <class K, class = std::enable_if_t<is_key<K>::value>>
+  iterator
+  find (const K &key)
+  {
+    return iterator (find_node (key), &m_tree);
+  }
+
+  template <class K, class = std::enable_if_t<is_key<K>::value>>
+  const_iterator
+  find (const K &key) const
+  {
+    return const_iterator (find_node (key), &m_tree);
+  }
+
+  template <class K, class = std::enable_if_t<is_key<K>::value>>
+  bool
+  contains (const K &key) const
+  {
+    return find_node (key) != nullptr;
+  }
+
+  /* First element not ordered before `key`. */
+  template <class K, class = std::enable_if_t<is_key<K>::value>>
+  iterator
+  lower_bound (const K &key)
+  {
+    return iterator (lower_bound_node (key), &m_tree);
+  }
+
+  template <class K, class = std::enable_if_t<is_key<K>::value>>
+  const_iterator
+  lower_bound (const K &key) const
+  {
+    return const_iterator (lower_bound_node (key), &m_tree);
+  }
+
+  /* First element ordered after `key`. */
+  template <class K, class = std::enable_if_t<is_key<K>::value>>
+  iterator
+  upper_bound (const K &key)
+  {
+    return iterator (upper_bound_node (key), &m_tree);
+  }
+
+  template <class K, class = std::enable_if_t<is_key<K>::value>>
+  const_iterator
+  upper_bound (const K &key) const
+  {
+    return const_iterator (upper_bound_node (key), &m_tree);
+  }
+
+  /* Iterator to an element which is known to be part of this set. */
+  iterator
+  iterator_to (T &value) noexcept
+  {
+    return iterator (&(value.*Member), &m_tree);
+  }
+
+  const_iterator
+  iterator_to (const T &value) const noexcept
+  {
+    return const_iterator (const_cast<rbt_node *> (&(value.*Member)),
+                           &m_tree);
+  }
+
+  key_compare key_comp () const { return m_compare; }
+
+  /* The underlying C tree, for use with the `rbt_` functions. */
+  rbtree &native_handle () noexcept { return m_tree; }
+  const rbtree &native_handle () const noexcept { return m_tree; }
+
+  static T &
+  to_value (rbt_node *node) noexcept
+  {
+    return *reinterpret_cast<T *> (reinterpret_cast<char *> (node)
+                                   - member_offset ());
+  }
+
+  static const T &
+  to_value (const rbt_node *node) noexcept
+  {
+    return *reinterpret_cast<const T *> (
+      reinterpret_cast<const char *> (node) - member_offset ());
+  }
+
+private:
+  static std::ptrdiff_t
+  member_offset () noexcept
+  {
+    static const std::ptrdiff_t offset = compute_member_offset ();
+    return offset;
+  }
+
+  static std::ptrdiff_t
+  compute_member_offset () noexcept
+  {
+    static_assert (std::is_standard_layout_v<T>,
+                   "the element type must be standard-layout");
+    /* Pointers to members cannot be used with `offsetof`, so the member is
+       named in a union member that is never constructed or read.  That is
+       member access on an object whose lifetime has not begun, which the
+       language leaves undefined; this relies on the compiler only computing
+       the address, as GCC, Clang and MSVC do.  It runs once per set type. */
+    union holder
+    {
+      holder () noexcept {}
+      ~holder () {}
+      unsigned char none;
+      T object;
+    } storage;
+    return (reinterpret_cast<const char *> (&(storage.object.*Member))
+            - reinterpret_cast<const char *> (&storage.object));
+  }
+
+  rbt_node *
+  first () const noexcept
+  {
+    return m_tree.root ? rbt_first (&m_tree) : nullptr;
+  }
+
+  template <class K>
+  rbt_node *
+  find_node (const K &key) const
+  {
+    rbt_node *node = m_tree.root;
+    while (node)
+      {
+        const T &test = to_value (node);
+        if (m_compare (key, test))
+          node = node->left;
+        else if (m_compare (test, key))
+          node = node->right;
+        else
+          return node;
+      }
+    return nullptr;
+  }
+
+  template <class K>
+  rbt_node *
+  lower_bound_node (const K &key) const
+  {
+    rbt_node *node = m_tree.root, *result = nullptr;
+    while (node)
+      {
+        if (m_compare (to_value (node), key))
+          node = node->right;
+        else
+          {
+            result = node;
+            node = node->left;
+          }
+      }
+    return result;
+  }
+
+  template <class K>
+  rbt_node *
+  upper_bound_node (const K &key) const
+  {
+    rbt_node *node = m_tree.root, *result = nullptr;
+    while (node)
+      {
+        if (m_compare (key, to_value (node)))
+          {
+            result = node;
+            node = node->left;
+          }
+        else
+          node = node->right;
+      }
+    return result;
+  }
+
+  rbtree m_tree;
+  Compare m_compare;
+};
+
+/* Bidirectional iterator.  The end iterator keeps a pointer to the tree so
+   it can be decremented. */
+template <class T, rbt_node T::*Member, class Compare>
+template <bool Const>
+class intrusive_set<T, Member, Compare>::basic_iterator
+{
+  friend class intrusive_set;
+
+public:
+  using iterator_category = std::bidirectional_iterator_tag;
+  using value_type = T;
+  using difference_type = std::ptrdiff_t;
+  using pointer = std::conditional_t<Const, const T *, T *>;
+  using reference = std::conditional_t<Const, const T &, T &>;
+
+  basic_iterator () noexcept : m_node (nullptr), m_tree (nullptr) {}
+
+  /* Mutable iterators convert to const ones. */
+  template <bool C = Const, class = std::enable_if_t<C>>
+  basic_iterator (const basic_iterator<false> &other) noexcept
+    : m_node (other.m_node), m_tree (other.m_tree)
+  {
+  }
+
+  reference operator* () const noexcept { return to_value (m_node); }
+  pointer operator-> () const noexcept { return &to_value (m_node); }
+
+  basic_iterator &
+  operator++ () noexcept
+  {
+    m_node = rbt_next (m_node);
+    return *this;
+  }
+
+  basic_iterator
+  operator++ (int) noexcept
+  {
+    basic_iterator old = *this;
+    ++*this;
+    return old;
+  }
+
+  basic_iterator &
+  operator-- () noexcept
+  {
+    m_node = m_node ? rbt_prev (m_node) : rbt_last (m_tree);
+    return *this;
+  }
+
+  basic_iterator
+  operator-- (int) noexcept
+  {
+    basic_iterator old = *this;
+    --*this;
+    return old;
+  }
+
+  friend bool
+  operator== (const basic_iterator &a, const basic_iterator &b) noexcept
+  {
+    return a.m_node == b.m_node;
+  }
+
+  friend bool
+  operator!= (const basic_iterator &a, const basic_iterator &b) noexcept
+  {
+    return a.m_node != b.m_node;
+  }
+
+private:
+  basic_iterator (rbt_node *node, const rbtree *tree) noexcept
+    : m_node (node), m_tree (tree)
+  {
+  }
+
+  friend class basic_iterator<!Const>;
+
+  rbt_node *m_node;
+  const rbtree *m_tree;
+};
+
+} // namespace rbt
+
+#endif /* RB_TREE_HPP */
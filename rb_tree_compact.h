@@ -0,0 +1,422 @@
+/* github.com/JaMo42/rb-tree */
+#ifndef RB_TREE_COMPACT_H
+#define RB_TREE_COMPACT_H
+#include "rb_tree.h"
+
+/* Compact trees: nodes with only their two child links, 16 bytes on 64-bit
+   targets instead of 32.  The color is kept in the lowest bit of the left
+   link.  Without parent pointers insertion and erasure record the search
+   path on the stack and rebalance along it, and iteration uses a cursor
+   holding the path to the current node.  There is no way to get from a node
+   to its neighbors or to erase a node without searching for it first.
+
+   The implementation is compiled together with the one of `rb_tree.h` by
+   `RBT_IMPLEMENTATION`. */
+
+/* Maximum height of a tree with less than 2^64 nodes. */
+#define RBT_COMPACT_MAX_HEIGHT 128
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct rbt_cnode
+{
+  /* Use `RBT_CNODE_CHILD` to read these. */
+  uintptr_t child[2];
+};
+
+#define RBT_CNODE_CHILD(n, dir) \
+  ((struct rbt_cnode *)((n)->child[dir] & ~(uintptr_t)1))
+#define RBT_CNODE_LEFT(n) RBT_CNODE_CHILD (n, RBT_LEFT)
+#define RBT_CNODE_RIGHT(n) RBT_CNODE_CHILD (n, RBT_RIGHT)
+#define RBT_CNODE_COLOR(n) ((enum rbt_color)((n)->child[RBT_LEFT] & 1))
+
+struct rbtree_compact
+{
+  struct rbt_cnode *root;
+};
+
+#define RBT_COMPACT_EMPTY (struct rbtree_compact) { NULL }
+
+/* Compares a search key to a node like `strcmp`. */
+typedef int (*rbt_compact_compare_t) (const void *key,
+                                      const struct rbt_cnode *node);
+
+/* In-order cursor, the stack holds the current node and the ancestors it is
+   in the left subtree of. */
+struct rbt_compact_cursor
+{
+  struct rbt_cnode *stack[RBT_COMPACT_MAX_HEIGHT];
+  unsigned depth;
+};
+
+/* Returns the node matching `key` or NULL. */
+RBT_DEF struct rbt_cnode *rbt_compact_find (const struct rbtree_compact *self,
+                                            const void *key,
+                                            rbt_compact_compare_t cmp);
+
+/* Inserts `node`, whose key is `key`, unless there already is a node with
+   an equal key.  Returns that node, or NULL if `node` was inserted. */
+RBT_DEF struct rbt_cnode *rbt_compact_insert (struct rbtree_compact *self,
+                                              struct rbt_cnode *node,
+                                              const void *key,
+                                              rbt_compact_compare_t cmp);
+
+/* Erases the node matching `key` and returns it, or NULL if there is
+   none. */
+RBT_DEF struct rbt_cnode *rbt_compact_erase (struct rbtree_compact *self,
+                                             const void *key,
+                                             rbt_compact_compare_t cmp);
+
+/* Positions the cursor at the first node and returns it, or NULL if the
+   tree is empty. */
+RBT_DEF struct rbt_cnode *rbt_compact_first (
+  struct rbt_compact_cursor *cursor, const struct rbtree_compact *self);
+
+/* Positions the cursor at the first node not ordered before `key` and
+   returns it, or NULL if there is none. */
+RBT_DEF struct rbt_cnode *rbt_compact_lower_bound (
+  struct rbt_compact_cursor *cursor, const struct rbtree_compact *self,
+  const void *key, rbt_compact_compare_t cmp);
+
+/* Advances the cursor and returns the next node, or NULL at the end.  The
+   tree must not be modified while a cursor is used. */
+RBT_DEF struct rbt_cnode *rbt_compact_next (
+  struct rbt_compact_cursor *cursor);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* RB_TREE_COMPACT_H */
+
+#if defined(RBT_IMPLEMENTATION) && !defined(RBT_COMPACT_IMPLEMENTED)
+#define RBT_COMPACT_IMPLEMENTED
+
+#include <assert.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Path to a position in the tree.  `path[i]` is the node at depth `i` and
+   `dirs[i]` the direction from it to the next node.  The root is kept as a
+   link like the children so that all links can be updated the same way. */
+struct rbt_compact_path
+{
+  uintptr_t root;
+  struct rbt_cnode *path[RBT_COMPACT_MAX_HEIGHT];
+  enum rbt_direction dirs[RBT_COMPACT_MAX_HEIGHT];
+  unsigned depth;
+};
+
+static inline void
+rbt_compact_push (struct rbt_compact_path *p, struct rbt_cnode *node,
+                  enum rbt_direction dir)
+{
+  assert (p->depth < RBT_COMPACT_MAX_HEIGHT);
+  p->path[p->depth] = node;
+  p->dirs[p->depth++] = dir;
+}
+
+/* The link referencing the node at depth `i` of the path. */
+static inline uintptr_t *
+rbt_compact_slot (struct rbt_compact_path *p, unsigned i)
+{
+  return i ? &p->path[i - 1]->child[p->dirs[i - 1]] : &p->root;
+}
+
+static inline struct rbt_cnode *
+rbt_compact_get (const uintptr_t *slot)
+{
+  return (struct rbt_cnode *)(*slot & ~(uintptr_t)1);
+}
+
+/* Points a link at `node`, keeping the color bit of the link's owner. */
+static inline void
+rbt_compact_set (uintptr_t *slot, struct rbt_cnode *node)
+{
+  *slot = (uintptr_t)node | (*slot & 1);
+}
+
+static inline void
+rbt_compact_set_color (struct rbt_cnode *node, enum rbt_color color)
+{
+  node->child[RBT_LEFT] = ((node->child[RBT_LEFT] & ~(uintptr_t)1)
+                           | (uintptr_t)color);
+}
+
+static inline bool
+rbt_cnode_is_red (const struct rbt_cnode *node)
+{
+  return node && RBT_CNODE_COLOR (node) == RBT_RED;
+}
+
+/* Rotates the node in `*slot` in direction `dir`, its child in the opposite
+   direction takes its place. */
+static inline void
+rbt_compact_rotate (uintptr_t *slot, enum rbt_direction dir)
+{
+  struct rbt_cnode *node = rbt_compact_get (slot);
+  struct rbt_cnode *child = RBT_CNODE_CHILD (node, RBT_OPPOSITE (dir));
+  rbt_compact_set (&node->child[RBT_OPPOSITE (dir)],
+                   RBT_CNODE_CHILD (child, dir));
+  rbt_compact_set (&child->child[dir], node);
+  rbt_compact_set (slot, child);
+}
+
+struct rbt_cnode *
+rbt_compact_find (const struct rbtree_compact *self, const void *key,
+                  rbt_compact_compare_t cmp)
+{
+  struct rbt_cnode *node = self->root;
+  int c;
+  while (node)
+    {
+      c = cmp (key, node);
+      if (c == 0)
+        break;
+      node = RBT_CNODE_CHILD (node, c > 0);
+    }
+  return node;
+}
+
+struct rbt_cnode *
+rbt_compact_insert (struct rbtree_compact *self, struct rbt_cnode *new_node,
+                    const void *key, rbt_compact_compare_t cmp)
+{
+  struct rbt_compact_path p;
+  struct rbt_cnode *node, *parent, *gparent, *uncle;
+  enum rbt_direction dir;
+  unsigned i;
+  int c;
+
+  p.root = (uintptr_t)self->root;
+  p.depth = 0;
+  for (node = self->root; node; node = RBT_CNODE_CHILD (node, dir))
+    {
+      c = cmp (key, node);
+      if (c == 0)
+        return node;
+      dir = c < 0 ? RBT_LEFT : RBT_RIGHT;
+      rbt_compact_push (&p, node, dir);
+    }
+  new_node->child[RBT_LEFT] = RBT_RED;
+  new_node->child[RBT_RIGHT] = 0;
+  rbt_compact_set (rbt_compact_slot (&p, p.depth), new_node);
+
+  /* Same cases as `rbt_insert_rebalance`, `node` is at depth `i`. */
+  node = new_node;
+  for (i = p.depth; i > 0; i -= 2)
+    {
+      parent = p.path[i - 1];
+      if (RBT_CNODE_COLOR (parent) == RBT_BLACK)
+        break;
+      if (i == 1)
+        {
+          rbt_compact_set_color (parent, RBT_BLACK);
+          break;
+        }
+      gparent = p.path[i - 2];
+      dir = p.dirs[i - 2];
+      uncle = RBT_CNODE_CHILD (gparent, RBT_OPPOSITE (dir));
+      if (rbt_cnode_is_red (uncle))
+        {
+          rbt_compact_set_color (parent, RBT_BLACK);
+          rbt_compact_set_color (uncle, RBT_BLACK);
+          rbt_compact_set_color (gparent, RBT_RED);
+          node = gparent;
+          continue;
+        }
+      if (p.dirs[i - 1] != dir)
+        {
+          rbt_compact_rotate (&gparent->child[dir], dir);
+          parent = node;
+        }
+      rbt_compact_rotate (rbt_compact_slot (&p, i - 2), RBT_OPPOSITE (dir));
+      rbt_compact_set_color (parent, RBT_BLACK);
+      rbt_compact_set_color (gparent, RBT_RED);
+      break;
+    }
+  self->root = rbt_compact_get (&p.root);
+  return NULL;
+}
+
+/* Same cases as `rbt_erase_rebalance` for a black leaf removed below the end
+   of the path. */
+static void
+rbt_compact_erase_rebalance (struct rbt_compact_path *p)
+{
+  struct rbt_cnode *parent, *sibling, *close, *distant;
+  enum rbt_direction dir;
+  uintptr_t *slot;
+  unsigned i;
+
+  for (i = p->depth; i > 0; --i)
+    {
+      parent = p->path[i - 1];
+      dir = p->dirs[i - 1];
+      slot = rbt_compact_slot (p, i - 1);
+      sibling = RBT_CNODE_CHILD (parent, RBT_OPPOSITE (dir));
+      if (RBT_CNODE_COLOR (sibling) == RBT_RED)
+        {
+          /* case 3 */
+          rbt_compact_rotate (slot, dir);
+          rbt_compact_set_color (sibling, RBT_BLACK);
+          rbt_compact_set_color (parent, RBT_RED);
+          slot = &sibling->child[dir];
+          sibling = RBT_CNODE_CHILD (parent, RBT_OPPOSITE (dir));
+        }
+      distant = RBT_CNODE_CHILD (sibling, RBT_OPPOSITE (dir));
+      if (rbt_cnode_is_red (distant))
+        goto rbt_compact_delete_1;
+      close = RBT_CNODE_CHILD (sibling, dir);
+      if (rbt_cnode_is_red (close))
+        {
+          /* case 5 */
+          rbt_compact_rotate (&parent->child[RBT_OPPOSITE (dir)],
+                              RBT_OPPOSITE (dir));
+          rbt_compact_set_color (sibling, RBT_RED);
+          rbt_compact_set_color (close, RBT_BLACK);
+          distant = sibling;
+          sibling = close;
+          goto rbt_compact_delete_1;
+        }
+      if (RBT_CNODE_COLOR (parent) == RBT_RED)
+        {
+          /* case 4 */
+          rbt_compact_set_color (sibling, RBT_RED);
+          rbt_compact_set_color (parent, RBT_BLACK);
+          return;
+        }
+      /* case 1 */
+      rbt_compact_set_color (sibling, RBT_RED);
+    }
+  /* case 2 */
+  return;
+
+rbt_compact_delete_1: /* case 6 */
+  rbt_compact_rotate (slot, dir);
+  rbt_compact_set_color (sibling, RBT_CNODE_COLOR (parent));
+  rbt_compact_set_color (parent, RBT_BLACK);
+  rbt_compact_set_color (distant, RBT_BLACK);
+}
+
+struct rbt_cnode *
+rbt_compact_erase (struct rbtree_compact *self, const void *key,
+                   rbt_compact_compare_t cmp)
+{
+  struct rbt_compact_path p;
+  struct rbt_cnode *victim, *pred, *child;
+  enum rbt_color removed_color;
+  uintptr_t *slot, *pred_slot;
+  unsigned victim_depth;
+  int c;
+
+  p.root = (uintptr_t)self->root;
+  p.depth = 0;
+  slot = &p.root;
+  for (;;)
+    {
+      victim = rbt_compact_get (slot);
+      if (!victim)
+        return NULL;
+      c = cmp (key, victim);
+      if (c == 0)
+        break;
+      rbt_compact_push (&p, victim, c < 0 ? RBT_LEFT : RBT_RIGHT);
+      slot = &victim->child[c > 0];
+    }
+
+  if (RBT_CNODE_LEFT (victim) && RBT_CNODE_RIGHT (victim))
+    {
+      /* The predecessor takes the place of the victim. */
+      victim_depth = p.depth;
+      rbt_compact_push (&p, victim, RBT_LEFT);
+      pred_slot = &victim->child[RBT_LEFT];
+      pred = RBT_CNODE_LEFT (victim);
+      while (RBT_CNODE_RIGHT (pred))
+        {
+          rbt_compact_push (&p, pred, RBT_RIGHT);
+          pred_slot = &pred->child[RBT_RIGHT];
+          pred = RBT_CNODE_RIGHT (pred);
+        }
+      child = RBT_CNODE_LEFT (pred);
+      removed_color = RBT_CNODE_COLOR (pred);
+      rbt_compact_set (pred_slot, child);
+      /* Takes over the links and the color of the victim at once. */
+      pred->child[RBT_LEFT] = victim->child[RBT_LEFT];
+      pred->child[RBT_RIGHT] = victim->child[RBT_RIGHT];
+      rbt_compact_set (slot, pred);
+      p.path[victim_depth] = pred;
+    }
+  else
+    {
+      child = RBT_CNODE_LEFT (victim);
+      if (!child)
+        child = RBT_CNODE_RIGHT (victim);
+      removed_color = RBT_CNODE_COLOR (victim);
+      rbt_compact_set (slot, child);
+    }
+
+  if (removed_color == RBT_BLACK)
+    {
+      /* A single child is always red. */
+      if (child)
+        rbt_compact_set_color (child, RBT_BLACK);
+      else
+        rbt_compact_erase_rebalance (&p);
+    }
+  self->root = rbt_compact_get (&p.root);
+  return victim;
+}
+
+static inline void
+rbt_compact_push_left (struct rbt_compact_cursor *cursor,
+                       struct rbt_cnode *node)
+{
+  for (; node; node = RBT_CNODE_LEFT (node))
+    cursor->stack[cursor->depth++] = node;
+}
+
+struct rbt_cnode *
+rbt_compact_first (struct rbt_compact_cursor *cursor,
+                   const struct rbtree_compact *self)
+{
+  cursor->depth = 0;
+  rbt_compact_push_left (cursor, self->root);
+  return cursor->depth ? cursor->stack[cursor->depth - 1] : NULL;
+}
+
+struct rbt_cnode *
+rbt_compact_lower_bound (struct rbt_compact_cursor *cursor,
+                         const struct rbtree_compact *self, const void *key,
+                         rbt_compact_compare_t cmp)
+{
+  struct rbt_cnode *node = self->root;
+
+  /* Only the nodes the search goes left at are ordered after the result. */
+  cursor->depth = 0;
+  while (node)
+    if (cmp (key, node) <= 0)
+      {
+        cursor->stack[cursor->depth++] = node;
+        node = RBT_CNODE_LEFT (node);
+      }
+    else
+      node = RBT_CNODE_RIGHT (node);
+  return cursor->depth ? cursor->stack[cursor->depth - 1] : NULL;
+}
+
+struct rbt_cnode *
+rbt_compact_next (struct rbt_compact_cursor *cursor)
+{
+  struct rbt_cnode *node = cursor->stack[--cursor->depth];
+  rbt_compact_push_left (cursor, RBT_CNODE_RIGHT (node));
+  return cursor->depth ? cursor->stack[cursor->depth - 1] : NULL;
+}
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* RBT_IMPLEMENTATION */
@@ -0,0 +1,155 @@
+/* github.com/JaMo42/rb-tree */
+#ifndef RB_TREE_FROZEN_H
+#define RB_TREE_FROZEN_H
+#include <stdbool.h>
+#include "rb_tree.h"
+
+/* Frozen trees: a read-only copy of the integer keys of a tree stored in
+   Eytzinger (breadth-first) order in a cache line aligned array.  The first
+   levels of the implicit tree share a few cache lines, lookups compile to a
+   branch-free loop and prefetch the cache line holding the descendants three
+   levels down, so a search waits on far fewer misses than chasing node
+   pointers.  Every key maps back to its node.
+
+   A frozen tree is a snapshot, it does not see later modifications of the
+   tree.  The implementation is compiled together with the one of `rb_tree.h`
+   by `RBT_IMPLEMENTATION`. */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct rbt_frozen
+{
+  /* Keys in Eytzinger order starting at index 1. */
+  int64_t *keys;
+  /* The node of each key, at the same index. */
+  struct rbt_node **nodes;
+  size_t size;
+};
+
+/* Copies the keys of the tree, `key` returns the key of a node.  The order
+   of the keys must match the order of the tree.  Returns false if out of
+   memory. */
+RBT_DEF bool rbt_freeze (struct rbt_frozen *self, const struct rbtree *tree,
+                         int64_t (*key) (const struct rbt_node *node));
+
+/* Returns the first node whose key is not less than `key` or NULL. */
+RBT_DEF struct rbt_node *rbt_frozen_lower_bound (
+  const struct rbt_frozen *self, int64_t key);
+
+/* Returns a node with the given key or NULL. */
+RBT_DEF struct rbt_node *rbt_frozen_find (const struct rbt_frozen *self,
+                                          int64_t key);
+
+/* Frees the arrays of a frozen tree. */
+RBT_DEF void rbt_frozen_free (struct rbt_frozen *self);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* RB_TREE_FROZEN_H */
+
+#if defined(RBT_IMPLEMENTATION) && !defined(RBT_FROZEN_IMPLEMENTED)
+#define RBT_FROZEN_IMPLEMENTED
+
+#define RBT_FROZEN_CACHE_LINE 64
+/* Keys per cache line. */
+#define RBT_FROZEN_LINE_KEYS (RBT_FROZEN_CACHE_LINE / sizeof (int64_t))
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Fills the subtree rooted at index `k` in order. */
+static struct rbt_node *
+rbt_frozen_fill (struct rbt_frozen *self, size_t k, struct rbt_node *node,
+                 int64_t (*key) (const struct rbt_node *node))
+{
+  if (k > self->size)
+    return node;
+  node = rbt_frozen_fill (self, 2 * k, node, key);
+  self->keys[k] = key (node);
+  self->nodes[k] = node;
+  return rbt_frozen_fill (self, 2 * k + 1, rbt_next (node), key);
+}
+
+bool
+rbt_freeze (struct rbt_frozen *self, const struct rbtree *tree,
+            int64_t (*key) (const struct rbt_node *node))
+{
+  const size_t n = rbt_size (tree);
+  /* Index 0 is unused, aligning it puts the children of a node `k` at
+     `2k` and `2k + 1` in the same cache line. */
+  const size_t bytes = (((n + 1) * sizeof (int64_t) + RBT_FROZEN_CACHE_LINE
+                         - 1) & ~(size_t)(RBT_FROZEN_CACHE_LINE - 1));
+
+#ifdef _WIN32
+  self->keys = (int64_t *)_aligned_malloc (bytes, RBT_FROZEN_CACHE_LINE);
+#else
+  self->keys = (int64_t *)aligned_alloc (RBT_FROZEN_CACHE_LINE, bytes);
+#endif
+  self->nodes = (struct rbt_node **)malloc ((n + 1)
+                                            * sizeof (struct rbt_node *));
+  self->size = n;
+  if (!self->keys || !self->nodes)
+    {
+      rbt_frozen_free (self);
+      return false;
+    }
+  self->nodes[0] = NULL;
+  if (n)
+    rbt_frozen_fill (self, 1, rbt_first (tree), key);
+  return true;
+}
+
+/* Returns the index of the first key not less than `key`, or 0. */
+static inline size_t
+rbt_frozen_search (const struct rbt_frozen *self, int64_t key)
+{
+  const int64_t *const keys = self->keys;
+  const size_t n = self->size;
+  size_t k = 1;
+
+  while (k <= n)
+    {
+      __builtin_prefetch ((const char *)keys
+                          + k * RBT_FROZEN_LINE_KEYS * sizeof (int64_t));
+      k = 2 * k + (keys[k] < key);
+    }
+  /* Every right turn went past a smaller key, the answer is where the last
+     left turn was taken. */
+  return k >> (__builtin_ctzll (~(unsigned long long)k) + 1);
+}
+
+struct rbt_node *
+rbt_frozen_lower_bound (const struct rbt_frozen *self, int64_t key)
+{
+  return self->nodes[rbt_frozen_search (self, key)];
+}
+
+struct rbt_node *
+rbt_frozen_find (const struct rbt_frozen *self, int64_t key)
+{
+  const size_t k = rbt_frozen_search (self, key);
+  return k && self->keys[k] == key ? self->nodes[k] : NULL;
+}
+
+void
+rbt_frozen_free (struct rbt_frozen *self)
+{
+#ifdef _WIN32
+  _aligned_free (self->keys);
+#else
+  free (self->keys);
+#endif
+  free (self->nodes);
+  self->keys = NULL;
+  self->nodes = NULL;
+  self->size = 0;
+}
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* RBT_IMPLEMENTATION */
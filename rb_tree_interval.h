@@ -0,0 +1,198 @@
+/* github.com/JaMo42/rb-tree */
+#ifndef RB_TREE_INTERVAL_H
+#define RB_TREE_INTERVAL_H
+#include "rb_tree.h"
+
+/* Interval trees: augmented trees of closed integer intervals ordered by
+   their start, where every node also stores the largest end in its subtree.
+   Subtrees that end before a query interval starts are skipped, so finding
+   the intervals overlapping it does not scan the whole tree.  Like all other
+   trees they are intrusive, the `rbt_interval` is embedded in the element
+   and no memory is allocated.
+
+   Other functions that do not modify the tree, such as `rbt_first` and
+   `rbt_next`, can be used on `rbt_interval.node`.  The implementation is
+   compiled together with the one of `rb_tree.h` by `RBT_IMPLEMENTATION`. */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The interval `[start, last]`, both ends included. */
+struct rbt_interval
+{
+  struct rbt_node node;
+  int64_t start;
+  int64_t last;
+  /* Largest `last` in the subtree, maintained by the tree. */
+  int64_t subtree_last;
+};
+
+#define RBT_INTERVAL(n) RBT_CONTAINER_OF (n, struct rbt_interval, node)
+
+/* Inserts an interval after any intervals with the same start.  `start` and
+   `last` must not be changed while it is in the tree. */
+RBT_DEF void rbt_interval_insert (struct rbtree *tree,
+                                  struct rbt_interval *interval);
+
+/* Erases an interval from the tree. */
+RBT_DEF void rbt_interval_erase (struct rbtree *tree,
+                                 struct rbt_interval *interval);
+
+/* Returns the interval with the lowest start that overlaps `[start, last]`,
+   or NULL if there is none.  Runs in O(log n). */
+RBT_DEF struct rbt_interval *rbt_interval_first (const struct rbtree *tree,
+                                                 int64_t start, int64_t last);
+
+/* Returns the next interval after `interval` in start order that overlaps
+   `[start, last]`, or NULL.  Each call visits O(log n) nodes at most and
+   enumerating all k overlaps usually visits O(log n + k), as subtrees without
+   an overlap are skipped whole. */
+RBT_DEF struct rbt_interval *rbt_interval_next (
+  const struct rbt_interval *interval, int64_t start, int64_t last);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* RB_TREE_INTERVAL_H */
+
+#if defined(RBT_IMPLEMENTATION) && !defined(RBT_INTERVAL_IMPLEMENTED)
+#define RBT_INTERVAL_IMPLEMENTED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+static inline int64_t
+rbt_interval_compute (const struct rbt_node *node)
+{
+  int64_t last = RBT_INTERVAL (node)->last;
+  if (node->left && RBT_INTERVAL (node->left)->subtree_last > last)
+    last = RBT_INTERVAL (node->left)->subtree_last;
+  if (node->right && RBT_INTERVAL (node->right)->subtree_last > last)
+    last = RBT_INTERVAL (node->right)->subtree_last;
+  return last;
+}
+
+static void
+rbt_interval_propagate (struct rbt_node *node, struct rbt_node *stop)
+{
+  int64_t last;
+  while (node != stop)
+    {
+      last = rbt_interval_compute (node);
+      if (last == RBT_INTERVAL (node)->subtree_last)
+        break;
+      RBT_INTERVAL (node)->subtree_last = last;
+      node = RBT_PARENT (node);
+    }
+}
+
+static void
+rbt_interval_copy (struct rbt_node *from, struct rbt_node *to)
+{
+  RBT_INTERVAL (to)->subtree_last = RBT_INTERVAL (from)->subtree_last;
+}
+
+static void
+rbt_interval_rotate (struct rbt_node *from, struct rbt_node *to)
+{
+  RBT_INTERVAL (to)->subtree_last = RBT_INTERVAL (from)->subtree_last;
+  RBT_INTERVAL (from)->subtree_last = rbt_interval_compute (from);
+}
+
+static const struct rbt_augment_callbacks rbt_interval_callbacks = {
+  rbt_interval_propagate, rbt_interval_copy, rbt_interval_rotate
+};
+
+void
+rbt_interval_insert (struct rbtree *tree, struct rbt_interval *interval)
+{
+  struct rbt_node *node = tree->root, *parent = NULL;
+  enum rbt_direction dir = RBT_LEFT;
+
+  /* Raising the maximums on the way down leaves nothing to propagate. */
+  while (node)
+    {
+      if (RBT_INTERVAL (node)->subtree_last < interval->last)
+        RBT_INTERVAL (node)->subtree_last = interval->last;
+      parent = node;
+      dir = (interval->start < RBT_INTERVAL (node)->start
+             ? RBT_LEFT : RBT_RIGHT);
+      node = node->child[dir];
+    }
+  interval->subtree_last = interval->last;
+  rbt_insert_augmented (tree, &interval->node, parent, dir,
+                        &rbt_interval_callbacks);
+}
+
+void
+rbt_interval_erase (struct rbtree *tree, struct rbt_interval *interval)
+{
+  rbt_erase_augmented (tree, &interval->node, &rbt_interval_callbacks);
+}
+
+/* Returns the overlapping interval with the lowest start in the subtree of
+   `node`, which must contain an interval ending at or after `start`. */
+static struct rbt_interval *
+rbt_interval_search (const struct rbt_node *node, int64_t start, int64_t last)
+{
+  for (;;)
+    {
+      /* With a long enough interval on the left, either one of them overlaps
+         or none in the whole subtree starts early enough. */
+      if (node->left && RBT_INTERVAL (node->left)->subtree_last >= start)
+        {
+          node = node->left;
+          continue;
+        }
+      if (RBT_INTERVAL (node)->start > last)
+        return NULL;
+      if (RBT_INTERVAL (node)->last >= start)
+        return RBT_INTERVAL (node);
+      node = node->right;
+      if (!node || RBT_INTERVAL (node)->subtree_last < start)
+        return NULL;
+    }
+}
+
+struct rbt_interval *
+rbt_interval_first (const struct rbtree *tree, int64_t start, int64_t last)
+{
+  const struct rbt_node *root = tree->root;
+  if (!root || RBT_INTERVAL (root)->subtree_last < start)
+    return NULL;
+  return rbt_interval_search (root, start, last);
+}
+
+struct rbt_interval *
+rbt_interval_next (const struct rbt_interval *interval, int64_t start,
+                   int64_t last)
+{
+  const struct rbt_node *node = &interval->node, *prev, *right;
+
+  for (;;)
+    {
+      /* Everything after `node` is in its right subtree or above it. */
+      right = node->right;
+      if (right && RBT_INTERVAL (right)->subtree_last >= start)
+        return rbt_interval_search (right, start, last);
+      do
+        {
+          prev = node;
+          node = RBT_PARENT (node);
+          if (!node)
+            return NULL;
+        }
+      while (prev == node->right);
+      if (RBT_INTERVAL (node)->start > last)
+        return NULL;
+      if (RBT_INTERVAL (node)->last >= start)
+        return RBT_INTERVAL (node);
+    }
+}
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* RBT_IMPLEMENTATION */
@@ -0,0 +1,176 @@
+/* github.com/JaMo42/rb-tree */
+#ifndef RB_TREE_LATCH_H
+#define RB_TREE_LATCH_H
+#include <stdbool.h>
+#include "rb_tree.h"
+
+/* Latched trees, modeled on the Linux kernel's `latch_tree`.  Every node is
+   linked into two copies of the tree and a sequence counter selects the copy
+   readers use, so lookups run without locks concurrently with a writer: the
+   writer moves readers to one copy while it modifies the other and lookups
+   retry if the counter changed while they were searching.
+
+   Writers must be serialized by the caller.  An erased node may still be
+   visited by readers that started before the erasure, so it must not be freed
+   or reused until all of them finished, for example using RCU or epochs.
+   The implementation is compiled together with the one of `rb_tree.h` by
+   `RBT_IMPLEMENTATION`, it needs the GCC `__atomic` builtins. */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct rbt_latch_node
+{
+  struct rbt_node node[2];
+};
+
+struct rbt_latch_tree
+{
+  unsigned seq;
+  struct rbtree tree[2];
+};
+
+#define RBT_LATCH_EMPTY (struct rbt_latch_tree) { 0, { { NULL }, { NULL } } }
+
+struct rbt_latch_ops
+{
+  /* Whether `a` is ordered before `b`, used for insertion. */
+  bool (*less) (const struct rbt_latch_node *a,
+                const struct rbt_latch_node *b);
+  /* Compares a search key to a node like `strcmp`, used for lookups. */
+  int (*comp) (const void *key, const struct rbt_latch_node *node);
+};
+
+/* Inserts the node into both copies of the tree, after any equal nodes. */
+RBT_DEF void rbt_latch_insert (struct rbt_latch_tree *self,
+                               struct rbt_latch_node *node,
+                               const struct rbt_latch_ops *ops);
+
+/* Erases the node from both copies of the tree. */
+RBT_DEF void rbt_latch_erase (struct rbt_latch_tree *self,
+                              struct rbt_latch_node *node);
+
+/* Returns a node matching `key` or NULL.  Can be called concurrently with a
+   writer and does not take any locks. */
+RBT_DEF struct rbt_latch_node *rbt_latch_find (
+  const struct rbt_latch_tree *self, const void *key,
+  const struct rbt_latch_ops *ops);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* RB_TREE_LATCH_H */
+
+#if defined(RBT_IMPLEMENTATION) && !defined(RBT_LATCH_IMPLEMENTED)
+#define RBT_LATCH_IMPLEMENTED
+
+/* Maximum height of a tree with less than 2^32 nodes.  A lookup that
+   descends further is racing with a writer and has to retry anyway. */
+#define RBT_LATCH_MAX_DEPTH 64
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+static inline struct rbt_latch_node *
+rbt_latch_node_of (const struct rbt_node *node, unsigned idx)
+{
+  return (struct rbt_latch_node *)(node - idx);
+}
+
+/* Moves readers to the other copy of the tree. */
+static inline void
+rbt_latch_advance (struct rbt_latch_tree *self)
+{
+  __atomic_thread_fence (__ATOMIC_RELEASE);
+  __atomic_store_n (&self->seq, self->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence (__ATOMIC_RELEASE);
+}
+
+static inline void
+rbt_latch_insert_one (struct rbt_latch_tree *self,
+                      struct rbt_latch_node *latch, unsigned idx,
+                      const struct rbt_latch_ops *ops)
+{
+  struct rbtree *tree = &self->tree[idx];
+  struct rbt_node *node = tree->root, *parent = NULL;
+  struct rbt_node *new_node = &latch->node[idx];
+  enum rbt_direction dir = RBT_LEFT;
+
+  while (node)
+    {
+      parent = node;
+      dir = (ops->less (latch, rbt_latch_node_of (node, idx))
+             ? RBT_LEFT : RBT_RIGHT);
+      node = node->child[dir];
+    }
+  /* Readers may find the node as soon as it is linked, its own links have to
+     be visible before that.  `rbt_insert` stores the same values again. */
+  RBT_SET_PARENT_COLOR (new_node, parent, RBT_RED);
+  new_node->left = NULL;
+  new_node->right = NULL;
+  __atomic_thread_fence (__ATOMIC_RELEASE);
+  rbt_insert (tree, new_node, parent, dir);
+}
+
+void
+rbt_latch_insert (struct rbt_latch_tree *self, struct rbt_latch_node *node,
+                  const struct rbt_latch_ops *ops)
+{
+  rbt_latch_advance (self);
+  rbt_latch_insert_one (self, node, 0, ops);
+  rbt_latch_advance (self);
+  rbt_latch_insert_one (self, node, 1, ops);
+}
+
+void
+rbt_latch_erase (struct rbt_latch_tree *self, struct rbt_latch_node *node)
+{
+  rbt_latch_advance (self);
+  rbt_erase (&self->tree[0], &node->node[0]);
+  rbt_latch_advance (self);
+  rbt_erase (&self->tree[1], &node->node[1]);
+}
+
+static inline struct rbt_latch_node *
+rbt_latch_find_one (const struct rbt_latch_tree *self, unsigned idx,
+                    const void *key, const struct rbt_latch_ops *ops)
+{
+  struct rbt_node *node = __atomic_load_n (&self->tree[idx].root,
+                                           __ATOMIC_RELAXED);
+  struct rbt_latch_node *latch;
+  unsigned depth;
+  int c;
+
+  for (depth = 0; node && depth < RBT_LATCH_MAX_DEPTH; ++depth)
+    {
+      latch = rbt_latch_node_of (node, idx);
+      c = ops->comp (key, latch);
+      if (c == 0)
+        return latch;
+      node = __atomic_load_n (&node->child[c > 0], __ATOMIC_RELAXED);
+    }
+  return NULL;
+}
+
+struct rbt_latch_node *
+rbt_latch_find (const struct rbt_latch_tree *self, const void *key,
+                const struct rbt_latch_ops *ops)
+{
+  struct rbt_latch_node *result;
+  unsigned seq;
+  do
+    {
+      seq = __atomic_load_n (&self->seq, __ATOMIC_ACQUIRE);
+      result = rbt_latch_find_one (self, seq & 1, key, ops);
+      __atomic_thread_fence (__ATOMIC_ACQUIRE);
+    }
+  while (__atomic_load_n (&self->seq, __ATOMIC_RELAXED) != seq);
+  return result;
+}
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* RBT_IMPLEMENTATION */
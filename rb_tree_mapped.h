@@ -0,0 +1,244 @@
+/* github.com/JaMo42/rb-tree */
+#ifndef RB_TREE_MAPPED_H
+#define RB_TREE_MAPPED_H
+#include <stdbool.h>
+#include "rb_tree.h"
+
+/* File-backed index-based trees.  The elements of an index-based tree only
+   link to each other by their index in the arena, so an arena stored in a
+   file is valid wherever the file is mapped.  Opening an existing file maps
+   it and the tree can be searched and modified right away, without loading
+   or rebuilding anything.
+
+   The file starts with a header holding the root, the element layout and a
+   free list of erased elements, followed by the arena.  The arena grows by
+   doubling the file, which may move the mapping: element pointers must be
+   recomputed from indices after `rbt_mapped_alloc`.  The file is only
+   guaranteed to be consistent on disk after `rbt_mapped_sync` or
+   `rbt_mapped_close`.  The element layout must not contain pointers and the
+   file is not portable across byte orders.
+
+   Requires POSIX `mmap`.  The implementation is compiled together with the
+   one of `rb_tree.h` by `RBT_IMPLEMENTATION`. */
+
+/* Number of elements a new file has room for. */
+#ifndef RBT_MAPPED_INITIAL_CAPACITY
+#  define RBT_MAPPED_INITIAL_CAPACITY 1024
+#endif
+
+/* Size of the file header, the arena starts after it. */
+#define RBT_MAPPED_HEADER_SIZE 64
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct rbt_mapped_header
+{
+  char magic[8];
+  uint32_t stride;
+  uint32_t offset;
+  uint32_t root;
+  /* Elements ever allocated, the end of the used part of the arena. */
+  uint32_t count;
+  /* Elements the file has room for. */
+  uint32_t capacity;
+  /* First erased element, linked through their `left` fields. */
+  uint32_t free_list;
+};
+
+struct rbt_mapped
+{
+  int fd;
+  struct rbt_mapped_header *header;
+  size_t map_size;
+  /* The tree, use the `rbt_index_*` functions on it. */
+  struct rbtree_index tree;
+};
+
+/* Opens or creates a tree file for elements of type `type` with the
+   `rbt_inode` in `member`. */
+#define RBT_MAPPED_OPEN(self, path, type, member) \
+  rbt_mapped_open (self, path, sizeof (type), offsetof (type, member))
+
+/* Maps the tree file at `path`, creating an empty one if it does not exist.
+   Returns false and sets `errno` on failure, `EINVAL` if the file was
+   created for a different element layout. */
+RBT_DEF bool rbt_mapped_open (struct rbt_mapped *self, const char *path,
+                              size_t stride, size_t offset);
+
+/* Returns an unused element, growing the file if needed, or `RBT_NIL` on
+   failure.  The element is not linked into the tree. */
+RBT_DEF uint32_t rbt_mapped_alloc (struct rbt_mapped *self);
+
+/* Makes an element that is not in the tree available for reuse. */
+RBT_DEF void rbt_mapped_free (struct rbt_mapped *self, uint32_t element);
+
+/* Writes the tree to the file and waits for it to reach the disk.  Returns
+   false and sets `errno` on failure. */
+RBT_DEF bool rbt_mapped_sync (struct rbt_mapped *self);
+
+/* Writes back the root and unmaps the file, without waiting for the disk. */
+RBT_DEF void rbt_mapped_close (struct rbt_mapped *self);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* RB_TREE_MAPPED_H */
+
+#if defined(RBT_IMPLEMENTATION) && !defined(RBT_MAPPED_IMPLEMENTED)
+#define RBT_MAPPED_IMPLEMENTED
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define RBT_MAPPED_MAGIC "rbtmap1"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+static inline size_t
+rbt_mapped_file_size (size_t stride, uint32_t capacity)
+{
+  return RBT_MAPPED_HEADER_SIZE + stride * capacity;
+}
+
+/* Maps the first `size` bytes of the file, replacing the old mapping only on
+   success. */
+static bool
+rbt_mapped_map (struct rbt_mapped *self, size_t size)
+{
+  void *map = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, self->fd,
+                    0);
+  if (map == MAP_FAILED)
+    return false;
+  if (self->header)
+    munmap (self->header, self->map_size);
+  self->header = (struct rbt_mapped_header *)map;
+  self->map_size = size;
+  self->tree.base = (char *)map + RBT_MAPPED_HEADER_SIZE;
+  return true;
+}
+
+bool
+rbt_mapped_open (struct rbt_mapped *self, const char *path, size_t stride,
+                 size_t offset)
+{
+  struct rbt_mapped_header *header;
+  struct stat st;
+  int saved_errno;
+
+  assert (stride >= sizeof (struct rbt_inode) && stride <= UINT32_MAX);
+  self->header = NULL;
+  self->fd = open (path, O_RDWR | O_CREAT, 0644);
+  if (self->fd < 0)
+    return false;
+  if (fstat (self->fd, &st) != 0)
+    goto fail;
+  if (st.st_size == 0)
+    {
+      if (ftruncate (self->fd, (off_t)rbt_mapped_file_size (
+                       stride, RBT_MAPPED_INITIAL_CAPACITY)) != 0
+          || !rbt_mapped_map (self, rbt_mapped_file_size (
+                                stride, RBT_MAPPED_INITIAL_CAPACITY)))
+        goto fail;
+      header = self->header;
+      memcpy (header->magic, RBT_MAPPED_MAGIC, sizeof (header->magic));
+      header->stride = (uint32_t)stride;
+      header->offset = (uint32_t)offset;
+      header->root = RBT_NIL;
+      header->count = 0;
+      header->capacity = RBT_MAPPED_INITIAL_CAPACITY;
+      header->free_list = RBT_NIL;
+    }
+  else
+    {
+      if ((size_t)st.st_size < RBT_MAPPED_HEADER_SIZE)
+        {
+          errno = EINVAL;
+          goto fail;
+        }
+      if (!rbt_mapped_map (self, (size_t)st.st_size))
+        goto fail;
+      header = self->header;
+      if (memcmp (header->magic, RBT_MAPPED_MAGIC, sizeof (header->magic))
+          || header->stride != stride || header->offset != offset
+          || rbt_mapped_file_size (stride, header->capacity) > self->map_size)
+        {
+          munmap (self->header, self->map_size);
+          errno = EINVAL;
+          goto fail;
+        }
+    }
+  self->tree.stride = stride;
+  self->tree.offset = offset;
+  self->tree.root = header->root;
+  return true;
+
+fail:
+  saved_errno = errno;
+  close (self->fd);
+  errno = saved_errno;
+  return false;
+}
+
+uint32_t
+rbt_mapped_alloc (struct rbt_mapped *self)
+{
+  struct rbt_mapped_header *header = self->header;
+  uint32_t element, capacity;
+  size_t size;
+
+  if (header->free_list != RBT_NIL)
+    {
+      element = header->free_list;
+      header->free_list = RBT_INODE (&self->tree, element)->left;
+      return element;
+    }
+  if (header->count == header->capacity)
+    {
+      if (header->capacity >= RBT_NIL / 2)
+        return RBT_NIL;
+      capacity = 2 * header->capacity;
+      size = rbt_mapped_file_size (self->tree.stride, capacity);
+      if (ftruncate (self->fd, (off_t)size) != 0
+          || !rbt_mapped_map (self, size))
+        return RBT_NIL;
+      header = self->header;
+      header->capacity = capacity;
+    }
+  return header->count++;
+}
+
+void
+rbt_mapped_free (struct rbt_mapped *self, uint32_t element)
+{
+  RBT_INODE (&self->tree, element)->left = self->header->free_list;
+  self->header->free_list = element;
+}
+
+bool
+rbt_mapped_sync (struct rbt_mapped *self)
+{
+  self->header->root = self->tree.root;
+  return (msync (self->header, self->map_size, MS_SYNC) == 0
+          && fsync (self->fd) == 0);
+}
+
+void
+rbt_mapped_close (struct rbt_mapped *self)
+{
+  self->header->root = self->tree.root;
+  munmap (self->header, self->map_size);
+  close (self->fd);
+  self->header = NULL;
+}
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* RBT_IMPLEMENTATION */
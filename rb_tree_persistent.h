@@ -0,0 +1,493 @@
+/* github.com/JaMo42/rb-tree */
+#ifndef RB_TREE_PERSISTENT_H
+#define RB_TREE_PERSISTENT_H
+#include "rb_tree.h"
+
+/* Persistent trees.  Insertion and erasure never modify a tree, instead they
+   copy the nodes they would change (the search path and the siblings touched
+   by rebalancing, O(log n) nodes) and return the root of a new version which
+   shares all other nodes with the old one.  Every version stays valid until
+   it is released, so a snapshot is just another reference to a root.
+
+   Nodes are shared between versions and have no parent pointers.  They are
+   reference counted: a node is freed once no version contains it anymore.
+   The reference counts are atomic so versions can be searched and released
+   from any thread, but each operation must only be given versions it holds a
+   reference to.
+
+   The implementation is compiled together with the one of `rb_tree.h` by
+   `RBT_IMPLEMENTATION`, it needs the GCC `__atomic` builtins. */
+
+/* Maximum height of a tree with less than 2^64 nodes. */
+#define RBT_PERSISTENT_MAX_HEIGHT 128
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct rbt_pnode
+{
+  union
+  {
+    struct rbt_pnode *child[2];
+    struct
+    {
+      struct rbt_pnode *left;
+      struct rbt_pnode *right;
+    };
+  };
+  /* Number of parents and versions referencing the node. */
+  unsigned refs;
+  unsigned char color;
+  /* Whether the node was copied by the running operation. */
+  unsigned char fresh;
+};
+
+struct rbt_persistent_ops
+{
+  /* Compares two nodes like `strcmp`. */
+  int (*compare) (const struct rbt_pnode *a, const struct rbt_pnode *b);
+  /* Compares a search key to a node like `strcmp`. */
+  int (*compare_key) (const void *key, const struct rbt_pnode *node);
+  /* Returns a new object holding a copy of the data of the node's object.
+     The links of the new node are set by the tree. */
+  struct rbt_pnode *(*clone) (const struct rbt_pnode *node);
+  /* Frees the object of a node that is no longer referenced. */
+  void (*free) (struct rbt_pnode *node);
+};
+
+/* In-order iterator over one version. */
+struct rbt_persistent_iter
+{
+  const struct rbt_pnode *stack[RBT_PERSISTENT_MAX_HEIGHT];
+  unsigned depth;
+};
+
+/* Returns a new version of the tree with `node` inserted, replacing a node
+   with an equal key.  `root` is NULL for an empty tree.  The caller owns a
+   reference to the new version and still owns its reference to `root`. */
+RBT_DEF struct rbt_pnode *rbt_persistent_insert (
+  struct rbt_pnode *root, struct rbt_pnode *node,
+  const struct rbt_persistent_ops *ops);
+
+/* Returns a new version of the tree without the node matching `key`, or
+   another reference to `root` if there is no such node. */
+RBT_DEF struct rbt_pnode *rbt_persistent_erase (
+  struct rbt_pnode *root, const void *key,
+  const struct rbt_persistent_ops *ops);
+
+/* Returns the node matching `key` or NULL. */
+RBT_DEF struct rbt_pnode *rbt_persistent_find (
+  const struct rbt_pnode *root, const void *key,
+  const struct rbt_persistent_ops *ops);
+
+/* Adds a reference to a version, for example to keep it as a snapshot. */
+RBT_DEF struct rbt_pnode *rbt_persistent_retain (struct rbt_pnode *root);
+
+/* Drops a reference to a version, freeing the nodes only it contains. */
+RBT_DEF void rbt_persistent_release (struct rbt_pnode *root,
+                                     const struct rbt_persistent_ops *ops);
+
+/* Starts iterating over a version, returns its first node or NULL. */
+RBT_DEF struct rbt_pnode *rbt_persistent_first (
+  struct rbt_persistent_iter *iter, const struct rbt_pnode *root);
+
+/* Returns the next node or NULL. */
+RBT_DEF struct rbt_pnode *rbt_persistent_next (
+  struct rbt_persistent_iter *iter);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* RB_TREE_PERSISTENT_H */
+
+#if defined(RBT_IMPLEMENTATION) && !defined(RBT_PERSISTENT_IMPLEMENTED)
+#define RBT_PERSISTENT_IMPLEMENTED
+
+#include <assert.h>
+
+/* Bound for the nodes copied by one operation: the search path and at most
+   two more per level for rebalancing. */
+#define RBT_PERSISTENT_MAX_FRESH (3 * RBT_PERSISTENT_MAX_HEIGHT)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* State of one modifying operation.  `path[i]` is the node at depth `i` on
+   the path to the modified position and `dirs[i]` the direction from it to
+   the next node.  All nodes on the path are fresh. */
+struct rbt_persistent_op
+{
+  const struct rbt_persistent_ops *ops;
+  struct rbt_pnode *root;
+  struct rbt_pnode *path[RBT_PERSISTENT_MAX_HEIGHT];
+  enum rbt_direction dirs[RBT_PERSISTENT_MAX_HEIGHT];
+  unsigned depth;
+  struct rbt_pnode *fresh[RBT_PERSISTENT_MAX_FRESH];
+  unsigned nfresh;
+};
+
+static inline void
+rbt_pnode_ref (struct rbt_pnode *node)
+{
+  if (node)
+    __atomic_add_fetch (&node->refs, 1, __ATOMIC_RELAXED);
+}
+
+static inline void
+rbt_persistent_begin (struct rbt_persistent_op *op, struct rbt_pnode *root,
+                      const struct rbt_persistent_ops *ops)
+{
+  op->ops = ops;
+  op->root = root;
+  rbt_pnode_ref (root);
+  op->depth = 0;
+  op->nfresh = 0;
+}
+
+/* Returns the new root.  `garbage` is a fresh node that was unlinked. */
+static inline struct rbt_pnode *
+rbt_persistent_end (struct rbt_persistent_op *op, struct rbt_pnode *garbage)
+{
+  unsigned i;
+  for (i = 0; i < op->nfresh; ++i)
+    op->fresh[i]->fresh = 0;
+  if (garbage)
+    op->ops->free (garbage);
+  return op->root;
+}
+
+static inline void
+rbt_persistent_push (struct rbt_persistent_op *op, struct rbt_pnode *node,
+                     enum rbt_direction dir)
+{
+  assert (op->depth < RBT_PERSISTENT_MAX_HEIGHT);
+  op->path[op->depth] = node;
+  op->dirs[op->depth++] = dir;
+}
+
+/* The link referencing the node at depth `i` of the path. */
+static inline struct rbt_pnode **
+rbt_persistent_slot (struct rbt_persistent_op *op, unsigned i)
+{
+  return i ? &op->path[i - 1]->child[op->dirs[i - 1]] : &op->root;
+}
+
+/* Makes the node referenced by `*slot`, which must be in a fresh node or be
+   the root, private to the new version. */
+static struct rbt_pnode *
+rbt_persistent_copy (struct rbt_persistent_op *op, struct rbt_pnode **slot)
+{
+  struct rbt_pnode *node = *slot, *copy;
+  if (node->fresh)
+    return node;
+  copy = op->ops->clone (node);
+  copy->left = node->left;
+  copy->right = node->right;
+  rbt_pnode_ref (node->left);
+  rbt_pnode_ref (node->right);
+  copy->refs = 1;
+  copy->color = node->color;
+  copy->fresh = 1;
+  assert (op->nfresh < RBT_PERSISTENT_MAX_FRESH);
+  op->fresh[op->nfresh++] = copy;
+  /* The old version still references `node`, so this never frees it. */
+  __atomic_sub_fetch (&node->refs, 1, __ATOMIC_RELAXED);
+  *slot = copy;
+  return copy;
+}
+
+/* Rotates the fresh node in `*slot` in direction `dir`.  Its child in the
+   opposite direction must be fresh too and takes its place. */
+static inline void
+rbt_persistent_rotate (struct rbt_pnode **slot, enum rbt_direction dir)
+{
+  struct rbt_pnode *node = *slot, *child = node->child[RBT_OPPOSITE (dir)];
+  node->child[RBT_OPPOSITE (dir)] = child->child[dir];
+  child->child[dir] = node;
+  *slot = child;
+}
+
+static inline bool
+rbt_pnode_is_red (const struct rbt_pnode *node)
+{
+  return node && node->color == RBT_RED;
+}
+
+struct rbt_pnode *
+rbt_persistent_insert (struct rbt_pnode *root, struct rbt_pnode *new_node,
+                       const struct rbt_persistent_ops *ops)
+{
+  struct rbt_persistent_op op;
+  struct rbt_pnode **slot, *node, *parent, *gparent, *uncle;
+  enum rbt_direction dir;
+  unsigned i;
+  int c;
+
+  rbt_persistent_begin (&op, root, ops);
+  slot = &op.root;
+  while (*slot)
+    {
+      node = rbt_persistent_copy (&op, slot);
+      c = ops->compare (new_node, node);
+      if (c == 0)
+        {
+          new_node->left = node->left;
+          new_node->right = node->right;
+          new_node->refs = 1;
+          new_node->color = node->color;
+          new_node->fresh = 0;
+          *slot = new_node;
+          node->left = NULL;
+          node->right = NULL;
+          return rbt_persistent_end (&op, node);
+        }
+      dir = c < 0 ? RBT_LEFT : RBT_RIGHT;
+      rbt_persistent_push (&op, node, dir);
+      slot = &node->child[dir];
+    }
+  new_node->left = NULL;
+  new_node->right = NULL;
+  new_node->refs = 1;
+  new_node->color = RBT_RED;
+  new_node->fresh = 0;
+  *slot = new_node;
+
+  /* Same cases as `rbt_insert_rebalance`, `node` is at depth `i`. */
+  node = new_node;
+  for (i = op.depth; i > 0; i -= 2)
+    {
+      parent = op.path[i - 1];
+      if (parent->color == RBT_BLACK)
+        break;
+      if (i == 1)
+        {
+          parent->color = RBT_BLACK;
+          break;
+        }
+      gparent = op.path[i - 2];
+      dir = op.dirs[i - 2];
+      if (rbt_pnode_is_red (gparent->child[RBT_OPPOSITE (dir)]))
+        {
+          uncle = rbt_persistent_copy (&op,
+                                       &gparent->child[RBT_OPPOSITE (dir)]);
+          parent->color = RBT_BLACK;
+          uncle->color = RBT_BLACK;
+          gparent->color = RBT_RED;
+          node = gparent;
+          continue;
+        }
+      if (op.dirs[i - 1] != dir)
+        {
+          rbt_persistent_rotate (&gparent->child[dir], dir);
+          parent = node;
+        }
+      rbt_persistent_rotate (rbt_persistent_slot (&op, i - 2),
+                             RBT_OPPOSITE (dir));
+      parent->color = RBT_BLACK;
+      gparent->color = RBT_RED;
+      break;
+    }
+  return rbt_persistent_end (&op, NULL);
+}
+
+/* Same cases as `rbt_erase_rebalance` for a black leaf removed below the end
+   of the path. */
+static void
+rbt_persistent_erase_rebalance (struct rbt_persistent_op *op)
+{
+  struct rbt_pnode **slot, *parent, *sibling, *close, *distant;
+  enum rbt_direction dir;
+  unsigned i;
+
+  for (i = op->depth; i > 0; --i)
+    {
+      parent = op->path[i - 1];
+      dir = op->dirs[i - 1];
+      slot = rbt_persistent_slot (op, i - 1);
+      sibling = rbt_persistent_copy (op, &parent->child[RBT_OPPOSITE (dir)]);
+      if (sibling->color == RBT_RED)
+        {
+          /* case 3 */
+          rbt_persistent_rotate (slot, dir);
+          sibling->color = RBT_BLACK;
+          parent->color = RBT_RED;
+          slot = &sibling->child[dir];
+          sibling = rbt_persistent_copy (op,
+                                         &parent->child[RBT_OPPOSITE (dir)]);
+        }
+      if (rbt_pnode_is_red (sibling->child[RBT_OPPOSITE (dir)]))
+        {
+          distant = rbt_persistent_copy (
+            op, &sibling->child[RBT_OPPOSITE (dir)]);
+          goto rbt_persistent_delete_1;
+        }
+      if (rbt_pnode_is_red (sibling->child[dir]))
+        {
+          /* case 5 */
+          close = rbt_persistent_copy (op, &sibling->child[dir]);
+          rbt_persistent_rotate (&parent->child[RBT_OPPOSITE (dir)],
+                                 RBT_OPPOSITE (dir));
+          sibling->color = RBT_RED;
+          close->color = RBT_BLACK;
+          distant = sibling;
+          sibling = close;
+          goto rbt_persistent_delete_1;
+        }
+      if (parent->color == RBT_RED)
+        {
+          /* case 4 */
+          sibling->color = RBT_RED;
+          parent->color = RBT_BLACK;
+          return;
+        }
+      /* case 1 */
+      sibling->color = RBT_RED;
+    }
+  /* case 2 */
+  return;
+
+rbt_persistent_delete_1: /* case 6 */
+  rbt_persistent_rotate (slot, dir);
+  sibling->color = parent->color;
+  parent->color = RBT_BLACK;
+  distant->color = RBT_BLACK;
+}
+
+struct rbt_pnode *
+rbt_persistent_erase (struct rbt_pnode *root, const void *key,
+                      const struct rbt_persistent_ops *ops)
+{
+  struct rbt_persistent_op op;
+  struct rbt_pnode **slot, **pred_slot, *victim, *pred, *child;
+  enum rbt_color removed_color;
+  unsigned victim_depth;
+  int c;
+
+  if (!rbt_persistent_find (root, key, ops))
+    return rbt_persistent_retain (root);
+
+  rbt_persistent_begin (&op, root, ops);
+  slot = &op.root;
+  for (;;)
+    {
+      victim = rbt_persistent_copy (&op, slot);
+      c = ops->compare_key (key, victim);
+      if (c == 0)
+        break;
+      rbt_persistent_push (&op, victim, c < 0 ? RBT_LEFT : RBT_RIGHT);
+      slot = &victim->child[c < 0 ? RBT_LEFT : RBT_RIGHT];
+    }
+
+  if (victim->left && victim->right)
+    {
+      /* The predecessor takes the place of the victim. */
+      victim_depth = op.depth;
+      rbt_persistent_push (&op, victim, RBT_LEFT);
+      pred_slot = &victim->left;
+      pred = rbt_persistent_copy (&op, pred_slot);
+      while (pred->right)
+        {
+          rbt_persistent_push (&op, pred, RBT_RIGHT);
+          pred_slot = &pred->right;
+          pred = rbt_persistent_copy (&op, pred_slot);
+        }
+      child = pred->left;
+      removed_color = (enum rbt_color)pred->color;
+      *pred_slot = child;
+      pred->left = victim->left;
+      pred->right = victim->right;
+      pred->color = victim->color;
+      *slot = pred;
+      op.path[victim_depth] = pred;
+    }
+  else
+    {
+      child = victim->left ? victim->left : victim->right;
+      removed_color = (enum rbt_color)victim->color;
+      *slot = child;
+    }
+  victim->left = NULL;
+  victim->right = NULL;
+
+  if (removed_color == RBT_BLACK)
+    {
+      /* A single child is always red. */
+      if (child)
+        rbt_persistent_copy (&op, rbt_persistent_slot (&op, op.depth))->color
+          = RBT_BLACK;
+      else
+        rbt_persistent_erase_rebalance (&op);
+    }
+  return rbt_persistent_end (&op, victim);
+}
+
+struct rbt_pnode *
+rbt_persistent_find (const struct rbt_pnode *root, const void *key,
+                     const struct rbt_persistent_ops *ops)
+{
+  int c;
+  while (root)
+    {
+      c = ops->compare_key (key, root);
+      if (c == 0)
+        break;
+      root = root->child[c > 0];
+    }
+  return (struct rbt_pnode *)root;
+}
+
+struct rbt_pnode *
+rbt_persistent_retain (struct rbt_pnode *root)
+{
+  rbt_pnode_ref (root);
+  return root;
+}
+
+void
+rbt_persistent_release (struct rbt_pnode *root,
+                        const struct rbt_persistent_ops *ops)
+{
+  struct rbt_pnode *left, *right;
+  while (root && __atomic_sub_fetch (&root->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+      left = root->left;
+      right = root->right;
+      ops->free (root);
+      rbt_persistent_release (left, ops);
+      root = right;
+    }
+}
+
+static inline void
+rbt_persistent_push_left (struct rbt_persistent_iter *iter,
+                          const struct rbt_pnode *node)
+{
+  for (; node; node = node->left)
+    iter->stack[iter->depth++] = node;
+}
+
+struct rbt_pnode *
+rbt_persistent_first (struct rbt_persistent_iter *iter,
+                      const struct rbt_pnode *root)
+{
+  iter->depth = 0;
+  rbt_persistent_push_left (iter, root);
+  return (iter->depth ? (struct rbt_pnode *)iter->stack[iter->depth - 1]
+          : NULL);
+}
+
+struct rbt_pnode *
+rbt_persistent_next (struct rbt_persistent_iter *iter)
+{
+  const struct rbt_pnode *node = iter->stack[--iter->depth];
+  rbt_persistent_push_left (iter, node->right);
+  return (iter->depth ? (struct rbt_pnode *)iter->stack[iter->depth - 1]
+          : NULL);
+}
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* RBT_IMPLEMENTATION */
@@ -0,0 +1,163 @@
+/* github.com/JaMo42/rb-tree */
+#ifndef RB_TREE_POOL_H
+#define RB_TREE_POOL_H
+#include <stddef.h>
+
+/* Fixed-size object allocator for tree nodes.  Objects are handed out from
+   cache line aligned slabs, freed objects are kept on a free list for reuse
+   and all objects of a pool are released at once by dropping its slabs, so a
+   tree whose nodes come from a pool does not need to be walked to be freed.
+
+   A pool is not thread-safe.  The implementation is compiled together with
+   the one of `rb_tree.h` by `RBT_IMPLEMENTATION`. */
+
+/* Size of one slab including its header, a multiple of
+   `RBT_POOL_CACHE_LINE`. */
+#ifndef RBT_POOL_SLAB_SIZE
+#  define RBT_POOL_SLAB_SIZE 65536
+#endif
+
+#define RBT_POOL_CACHE_LINE 64
+
+#ifndef RBT_DEF
+#  ifdef RBT_STATIC
+#    define RBT_DEF static inline
+#  else
+#    define RBT_DEF extern
+#  endif
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct rbt_pool
+{
+  /* Object size rounded up to the alignment. */
+  size_t object_size;
+  /* Slabs in allocation order, newest first. */
+  void *slabs;
+  /* Freed objects. */
+  void *free_list;
+  /* Never used part of the newest slab. */
+  char *unused;
+  char *unused_end;
+};
+
+/* Initializes an empty pool for objects of the given size and alignment,
+   which must be a power of two no greater than `RBT_POOL_CACHE_LINE`.  No
+   memory is allocated until the first object is. */
+RBT_DEF void rbt_pool_init (struct rbt_pool *self, size_t size, size_t align);
+
+/* Returns an uninitialized object, or NULL if out of memory. */
+RBT_DEF void *rbt_pool_alloc (struct rbt_pool *self);
+
+/* Returns an object to the pool it was allocated from. */
+RBT_DEF void rbt_pool_free (struct rbt_pool *self, void *object);
+
+/* Frees all objects of the pool at once.  The pool stays usable. */
+RBT_DEF void rbt_pool_release (struct rbt_pool *self);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* RB_TREE_POOL_H */
+
+#if defined(RBT_IMPLEMENTATION) && !defined(RBT_POOL_IMPLEMENTED)
+#define RBT_POOL_IMPLEMENTED
+
+#include <stdlib.h>
+#include <assert.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Slab header, the objects start at the next cache line. */
+struct rbt_pool_slab
+{
+  struct rbt_pool_slab *next;
+};
+
+void
+rbt_pool_init (struct rbt_pool *self, size_t size, size_t align)
+{
+  assert (align && (align & (align - 1)) == 0
+          && align <= RBT_POOL_CACHE_LINE);
+  /* Free objects hold the free list link. */
+  if (align < sizeof (void *))
+    align = sizeof (void *);
+  if (size < sizeof (void *))
+    size = sizeof (void *);
+  self->object_size = (size + align - 1) & ~(align - 1);
+  assert (self->object_size <= RBT_POOL_SLAB_SIZE - RBT_POOL_CACHE_LINE);
+  self->slabs = NULL;
+  self->free_list = NULL;
+  self->unused = NULL;
+  self->unused_end = NULL;
+}
+
+void *
+rbt_pool_alloc (struct rbt_pool *self)
+{
+  struct rbt_pool_slab *slab;
+  void *object;
+
+  if (self->free_list)
+    {
+      object = self->free_list;
+      self->free_list = *(void **)object;
+      return object;
+    }
+  if ((size_t)(self->unused_end - self->unused) < self->object_size)
+    {
+#ifdef _WIN32
+      slab = (struct rbt_pool_slab *)_aligned_malloc (RBT_POOL_SLAB_SIZE,
+                                                      RBT_POOL_CACHE_LINE);
+#else
+      slab = (struct rbt_pool_slab *)aligned_alloc (RBT_POOL_CACHE_LINE,
+                                                    RBT_POOL_SLAB_SIZE);
+#endif
+      if (!slab)
+        return NULL;
+      slab->next = (struct rbt_pool_slab *)self->slabs;
+      self->slabs = slab;
+      self->unused = (char *)slab + RBT_POOL_CACHE_LINE;
+      self->unused_end = (char *)slab + RBT_POOL_SLAB_SIZE;
+    }
+  object = self->unused;
+  self->unused += self->object_size;
+  return object;
+}
+
+void
+rbt_pool_free (struct rbt_pool *self, void *object)
+{
+  *(void **)object = self->free_list;
+  self->free_list = object;
+}
+
+void
+rbt_pool_release (struct rbt_pool *self)
+{
+  struct rbt_pool_slab *slab = (struct rbt_pool_slab *)self->slabs, *next;
+  while (slab)
+    {
+      next = slab->next;
+#ifdef _WIN32
+      _aligned_free (slab);
+#else
+      free (slab);
+#endif
+      slab = next;
+    }
+  self->slabs = NULL;
+  self->free_list = NULL;
+  self->unused = NULL;
+  self->unused_end = NULL;
+}
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* RBT_IMPLEMENTATION */
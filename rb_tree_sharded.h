@@ -0,0 +1,523 @@
+/* github.com/JaMo42/rb-tree */
+#ifndef RB_TREE_SHARDED_H
+#define RB_TREE_SHARDED_H
+#include <stdbool.h>
+#include <pthread.h>
+#include "rb_tree.h"
+
+/* Range-partitioned trees for concurrent writers.  The key space is split
+   into a fixed number of shards, each an independent tree with its own lock
+   that also caches its first and last node.  Point operations only lock the
+   shard the key belongs to, so writers on different shards run in parallel.
+
+   Keys must be unique and are compared through `struct rbt_sharded_ops`.  The
+   boundaries between shards are copies of keys made with `memcpy`.  When a
+   shard holds more than twice its share of the nodes (and at least
+   `RBT_SHARDED_REBALANCE_MIN`) its nodes are redistributed evenly over it
+   and as few neighbouring shards as needed using join and split, which
+   briefly blocks all operations.  Without `RBT_ORDER_STATISTICS` finding
+   the split points walks the shards that contain them, otherwise it takes
+   O(log n).
+
+   The implementation is compiled together with the one of `rb_tree.h` by
+   `RBT_IMPLEMENTATION`, it needs pthreads and the GCC `__atomic` builtins. */
+
+#ifndef RBT_SHARDED_REBALANCE_MIN
+#  define RBT_SHARDED_REBALANCE_MIN 4096
+#endif
+
+#define RBT_SHARDED_CACHE_LINE 64
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct rbt_sharded_ops
+{
+  /* Compares two keys like `strcmp`. */
+  int (*compare) (const void *a, const void *b);
+  /* Returns a pointer to the key of a node. */
+  const void *(*key) (const struct rbt_node *node);
+  /* Size of a key in bytes. */
+  size_t key_size;
+};
+
+/* Each shard is on its own cache lines so the locks do not share them. */
+struct rbt_shard
+{
+  pthread_mutex_t lock;
+  struct rbtree_cached tree;
+  size_t size;
+} __attribute__ ((aligned (RBT_SHARDED_CACHE_LINE)));
+
+struct rbt_sharded
+{
+  /* Taken shared by all operations and exclusively for rebalancing. */
+  pthread_rwlock_t layout;
+  struct rbt_shard *shards;
+  unsigned nshards;
+  /* Shard `i` holds the keys in [`bounds[i - 1]`, `bounds[i]`).  Only the
+     first `nbounds` bounds are set, the others are infinite. */
+  unsigned nbounds;
+  char *bounds;
+  size_t size;
+  int rebalancing;
+  const struct rbt_sharded_ops *ops;
+};
+
+/* Initializes an empty container with `nshards` shards.  All keys go to the
+   first shard until the first rebalancing.  Returns false if out of
+   memory. */
+RBT_DEF bool rbt_sharded_init (struct rbt_sharded *self, unsigned nshards,
+                               const struct rbt_sharded_ops *ops);
+
+/* Frees the shards, the nodes are not touched. */
+RBT_DEF void rbt_sharded_destroy (struct rbt_sharded *self);
+
+/* Inserts the node unless a node with the same key exists, which is then
+   returned.  Returns NULL if the node was inserted. */
+RBT_DEF struct rbt_node *rbt_sharded_insert (struct rbt_sharded *self,
+                                             struct rbt_node *node);
+
+/* Returns the node with the given key or NULL. */
+RBT_DEF struct rbt_node *rbt_sharded_find (struct rbt_sharded *self,
+                                           const void *key);
+
+/* Erases and returns the node with the given key, or returns NULL. */
+RBT_DEF struct rbt_node *rbt_sharded_erase_key (struct rbt_sharded *self,
+                                                const void *key);
+
+/* Gets the total number of nodes. */
+RBT_DEF size_t rbt_sharded_size (const struct rbt_sharded *self);
+
+/* Calls `visit` for every node in order, locking one shard at a time, until
+   it returns false.  `visit` must not modify the container.  Returns false if
+   the iteration was stopped. */
+RBT_DEF bool rbt_sharded_for_each (struct rbt_sharded *self,
+                                   bool (*visit) (struct rbt_node *node,
+                                                  void *arg),
+                                   void *arg);
+
+/* Returns the first node or NULL.  This and `rbt_sharded_next` do not lock
+   anything and must not run concurrently with modifications. */
+RBT_DEF struct rbt_node *rbt_sharded_first (const struct rbt_sharded *self);
+
+/* Returns the in-order successor of the node across shards or NULL. */
+RBT_DEF struct rbt_node *rbt_sharded_next (const struct rbt_sharded *self,
+                                           const struct rbt_node *node);
+
+/* Redistributes the nodes evenly over all shards.  Without
+   `RBT_ORDER_STATISTICS` this takes linear time. */
+RBT_DEF void rbt_sharded_rebalance (struct rbt_sharded *self);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* RB_TREE_SHARDED_H */
+
+#if defined(RBT_IMPLEMENTATION) && !defined(RBT_SHARDED_IMPLEMENTED)
+#define RBT_SHARDED_IMPLEMENTED
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+static inline void *
+rbt_sharded_bound (const struct rbt_sharded *self, unsigned i)
+{
+  return self->bounds + (size_t)i * self->ops->key_size;
+}
+
+/* Index of the shard for `key`, the number of bounds not greater than it. */
+static inline unsigned
+rbt_sharded_route (const struct rbt_sharded *self, const void *key)
+{
+  unsigned lo = 0, hi = self->nbounds, mid;
+  while (lo < hi)
+    {
+      mid = lo + (hi - lo) / 2;
+      if (self->ops->compare (key, rbt_sharded_bound (self, mid)) < 0)
+        hi = mid;
+      else
+        lo = mid + 1;
+    }
+  return lo;
+}
+
+/* Returns the node with the key in `shard`, or NULL and the position for
+   inserting it in `parent` and `dir`. */
+static inline struct rbt_node *
+rbt_sharded_search (const struct rbt_sharded *self,
+                    const struct rbt_shard *shard, const void *key,
+                    struct rbt_node **parent, enum rbt_direction *dir)
+{
+  struct rbt_node *node = shard->tree.tree.root;
+  int c;
+  *parent = NULL;
+  *dir = RBT_LEFT;
+  while (node)
+    {
+      c = self->ops->compare (key, self->ops->key (node));
+      if (c == 0)
+        return node;
+      *parent = node;
+      *dir = c < 0 ? RBT_LEFT : RBT_RIGHT;
+      node = node->child[*dir];
+    }
+  return NULL;
+}
+
+static inline bool
+rbt_sharded_is_hot (const struct rbt_sharded *self, size_t shard_size,
+                    size_t total)
+{
+  return (self->nshards > 1 && shard_size > RBT_SHARDED_REBALANCE_MIN
+          && shard_size > 2 * (total / self->nshards));
+}
+
+bool
+rbt_sharded_init (struct rbt_sharded *self, unsigned nshards,
+                  const struct rbt_sharded_ops *ops)
+{
+  pthread_rwlockattr_t attr;
+  unsigned i;
+
+  assert (nshards > 0);
+  self->shards = (struct rbt_shard *)aligned_alloc (
+    RBT_SHARDED_CACHE_LINE, nshards * sizeof (struct rbt_shard));
+  self->bounds = (char *)malloc (nshards * ops->key_size);
+  if (!self->shards || !self->bounds)
+    {
+      free (self->shards);
+      free (self->bounds);
+      return false;
+    }
+  pthread_rwlockattr_init (&attr);
+#ifdef __GLIBC__
+  /* Otherwise a steady stream of operations starves rebalancing. */
+  pthread_rwlockattr_setkind_np (&attr,
+                                 PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+  pthread_rwlock_init (&self->layout, &attr);
+  pthread_rwlockattr_destroy (&attr);
+  for (i = 0; i < nshards; ++i)
+    {
+      pthread_mutex_init (&self->shards[i].lock, NULL);
+      self->shards[i].tree = RBT_CACHED_EMPTY;
+      self->shards[i].size = 0;
+    }
+  self->nshards = nshards;
+  self->nbounds = 0;
+  self->size = 0;
+  self->rebalancing = 0;
+  self->ops = ops;
+  return true;
+}
+
+void
+rbt_sharded_destroy (struct rbt_sharded *self)
+{
+  unsigned i;
+  for (i = 0; i < self->nshards; ++i)
+    pthread_mutex_destroy (&self->shards[i].lock);
+  pthread_rwlock_destroy (&self->layout);
+  free (self->shards);
+  free (self->bounds);
+}
+
+/* Sets the cached first and last node of a shard whose tree was replaced.
+   Only the root is taken from `tree`, the shard keeps its statistics. */
+static inline void
+rbt_sharded_set_tree (struct rbt_shard *shard, struct rbtree tree,
+                      size_t size)
+{
+  shard->tree.tree.root = tree.root;
+  shard->tree.leftmost = tree.root ? rbt_first (&tree) : NULL;
+  shard->tree.rightmost = tree.root ? rbt_last (&tree) : NULL;
+  shard->size = size;
+}
+
+/* Returns the node at `rank` in the shard.  `from` is NULL or a node of the
+   same shard at `from_rank`, which must not be greater than `rank`. */
+static struct rbt_node *
+rbt_sharded_select (const struct rbt_shard *shard, size_t rank,
+                    struct rbt_node *from, size_t from_rank)
+{
+#ifdef RBT_ORDER_STATISTICS
+  (void)from;
+  (void)from_rank;
+  return rbt_select (&shard->tree.tree, rank);
+#else
+  struct rbt_node *node;
+  size_t steps;
+
+  /* Walk from whichever of `from`, the first and the last node is closest,
+     so finding several pivots in a shard walks it at most once. */
+  if (rank > shard->size - 1 - rank
+      && (!from || rank - from_rank > shard->size - 1 - rank))
+    {
+      node = shard->tree.rightmost;
+      for (steps = shard->size - 1 - rank; steps; --steps)
+        node = rbt_prev (node);
+      return node;
+    }
+  node = from ? from : shard->tree.leftmost;
+  for (steps = rank - (from ? from_rank : 0); steps; --steps)
+    node = rbt_next (node);
+  return node;
+#endif
+}
+
+/* Joins the shards in [`lo`, `hi`) and splits the result at evenly spaced
+   ranks.  The pivots are searched before joining, only in the shards that
+   contain them.  The layout lock must be held exclusively. */
+static void
+rbt_sharded_rebalance_locked (struct rbt_sharded *self, unsigned lo,
+                              unsigned hi)
+{
+  const unsigned n = hi - lo;
+  struct rbtree all = RBT_EMPTY, part, less, greater;
+  struct rbt_node **pivots, *min, *prev = NULL;
+  size_t total = 0, start = 0, rank, prev_rank = 0;
+  unsigned i, k, shard = lo;
+
+  for (i = lo; i < hi; ++i)
+    total += self->shards[i].size;
+  if (n == 1 || total < n)
+    return;
+  pivots = (struct rbt_node **)malloc ((n - 1) * sizeof (*pivots));
+  if (!pivots)
+    return;
+
+  /* Shard `lo + k` starts at rank `k * total / n` of the joined shards. */
+  for (k = 1; k < n; ++k)
+    {
+      rank = k * total / n;
+      while (rank >= start + self->shards[shard].size)
+        {
+          start += self->shards[shard++].size;
+          prev = NULL;
+        }
+      prev = rbt_sharded_select (&self->shards[shard], rank - start, prev,
+                                 prev_rank);
+      prev_rank = rank - start;
+      pivots[k - 1] = prev;
+    }
+
+  /* The shards are ordered by their ranges, so each one can be joined to
+     the previous ones using its first node as the pivot.  Only the roots
+     are taken out, the work of rebalancing is not counted in the shards'
+     statistics. */
+  for (i = lo; i < hi; ++i)
+    {
+      part = RBT_EMPTY;
+      part.root = self->shards[i].tree.tree.root;
+      if (!part.root)
+        continue;
+      if (!all.root)
+        {
+          all = part;
+          continue;
+        }
+      min = self->shards[i].tree.leftmost;
+      rbt_erase (&part, min);
+      rbt_join (&all, min, &part);
+    }
+
+  for (k = n - 1; k > 0; --k)
+    {
+      rbt_split (&all, pivots[k - 1], &less, &greater);
+      part = RBT_EMPTY;
+      rbt_join (&part, pivots[k - 1], &greater);
+      rbt_sharded_set_tree (&self->shards[lo + k], part,
+                            (k + 1) * total / n - k * total / n);
+      memcpy (rbt_sharded_bound (self, lo + k - 1),
+              self->ops->key (pivots[k - 1]), self->ops->key_size);
+      all = less;
+    }
+  rbt_sharded_set_tree (&self->shards[lo], all, total / n);
+  /* Bounds after the last set one are infinite, so the last shard of the
+     range keeps the keys above it even if the range ended past them. */
+  if (hi - 1 > self->nbounds)
+    self->nbounds = hi - 1;
+  free (pivots);
+}
+
+void
+rbt_sharded_rebalance (struct rbt_sharded *self)
+{
+  pthread_rwlock_wrlock (&self->layout);
+  rbt_sharded_rebalance_locked (self, 0, self->nshards);
+  pthread_rwlock_unlock (&self->layout);
+}
+
+/* Rebalances the hot shard `i` together with as few of its neighbours as
+   needed for them to hold at most 1.5 times their share afterwards, taking
+   the smaller neighbour first. */
+static void
+rbt_sharded_rebalance_around (struct rbt_sharded *self, unsigned i)
+{
+  const struct rbt_shard *shards = self->shards;
+  const size_t share = self->size / self->nshards;
+  size_t sum = shards[i].size;
+  unsigned lo = i, hi = i + 1;
+
+  while (hi - lo < self->nshards && 2 * sum > 3 * (hi - lo) * share)
+    {
+      if (lo > 0 && (hi == self->nshards
+                     || shards[lo - 1].size <= shards[hi].size))
+        sum += shards[--lo].size;
+      else
+        sum += shards[hi++].size;
+    }
+  rbt_sharded_rebalance_locked (self, lo, hi);
+}
+
+/* Rebalances if no other thread is already about to and some shard is still
+   hot once all other operations finished. */
+static void
+rbt_sharded_rebalance_hot (struct rbt_sharded *self)
+{
+  unsigned i;
+  if (__atomic_exchange_n (&self->rebalancing, 1, __ATOMIC_ACQUIRE))
+    return;
+  pthread_rwlock_wrlock (&self->layout);
+  for (i = 0; i < self->nshards; ++i)
+    if (rbt_sharded_is_hot (self, self->shards[i].size, self->size))
+      {
+        rbt_sharded_rebalance_around (self, i);
+        break;
+      }
+  pthread_rwlock_unlock (&self->layout);
+  __atomic_store_n (&self->rebalancing, 0, __ATOMIC_RELEASE);
+}
+
+struct rbt_node *
+rbt_sharded_insert (struct rbt_sharded *self, struct rbt_node *node)
+{
+  struct rbt_shard *shard;
+  struct rbt_node *found, *parent;
+  enum rbt_direction dir;
+  size_t total = 0;
+  bool hot;
+
+  pthread_rwlock_rdlock (&self->layout);
+  shard = &self->shards[rbt_sharded_route (self, self->ops->key (node))];
+  pthread_mutex_lock (&shard->lock);
+  found = rbt_sharded_search (self, shard, self->ops->key (node), &parent,
+                              &dir);
+  if (!found)
+    {
+      rbt_insert_cached (&shard->tree, node, parent, dir);
+      ++shard->size;
+      total = __atomic_add_fetch (&self->size, 1, __ATOMIC_RELAXED);
+    }
+  hot = !found && rbt_sharded_is_hot (self, shard->size, total);
+  pthread_mutex_unlock (&shard->lock);
+  pthread_rwlock_unlock (&self->layout);
+  if (hot)
+    rbt_sharded_rebalance_hot (self);
+  return found;
+}
+
+struct rbt_node *
+rbt_sharded_find (struct rbt_sharded *self, const void *key)
+{
+  struct rbt_shard *shard;
+  struct rbt_node *found, *parent;
+  enum rbt_direction dir;
+
+  pthread_rwlock_rdlock (&self->layout);
+  shard = &self->shards[rbt_sharded_route (self, key)];
+  pthread_mutex_lock (&shard->lock);
+  found = rbt_sharded_search (self, shard, key, &parent, &dir);
+  pthread_mutex_unlock (&shard->lock);
+  pthread_rwlock_unlock (&self->layout);
+  return found;
+}
+
+struct rbt_node *
+rbt_sharded_erase_key (struct rbt_sharded *self, const void *key)
+{
+  struct rbt_shard *shard;
+  struct rbt_node *found, *parent;
+  enum rbt_direction dir;
+
+  pthread_rwlock_rdlock (&self->layout);
+  shard = &self->shards[rbt_sharded_route (self, key)];
+  pthread_mutex_lock (&shard->lock);
+  found = rbt_sharded_search (self, shard, key, &parent, &dir);
+  if (found)
+    {
+      rbt_erase_cached (&shard->tree, found);
+      --shard->size;
+      __atomic_sub_fetch (&self->size, 1, __ATOMIC_RELAXED);
+    }
+  pthread_mutex_unlock (&shard->lock);
+  pthread_rwlock_unlock (&self->layout);
+  return found;
+}
+
+size_t
+rbt_sharded_size (const struct rbt_sharded *self)
+{
+  return __atomic_load_n (&self->size, __ATOMIC_RELAXED);
+}
+
+bool
+rbt_sharded_for_each (struct rbt_sharded *self,
+                      bool (*visit) (struct rbt_node *node, void *arg),
+                      void *arg)
+{
+  struct rbt_shard *shard;
+  struct rbt_node *node;
+  bool result = true;
+  unsigned i;
+
+  pthread_rwlock_rdlock (&self->layout);
+  for (i = 0; i < self->nshards && result; ++i)
+    {
+      shard = &self->shards[i];
+      pthread_mutex_lock (&shard->lock);
+      for (node = shard->tree.leftmost; node && result; node = rbt_next (node))
+        result = visit (node, arg);
+      pthread_mutex_unlock (&shard->lock);
+    }
+  pthread_rwlock_unlock (&self->layout);
+  return result;
+}
+
+/* First node of the first non-empty shard starting at `i`. */
+static inline struct rbt_node *
+rbt_sharded_first_from (const struct rbt_sharded *self, unsigned i)
+{
+  for (; i < self->nshards; ++i)
+    if (self->shards[i].tree.leftmost)
+      return self->shards[i].tree.leftmost;
+  return NULL;
+}
+
+struct rbt_node *
+rbt_sharded_first (const struct rbt_sharded *self)
+{
+  return rbt_sharded_first_from (self, 0);
+}
+
+struct rbt_node *
+rbt_sharded_next (const struct rbt_sharded *self, const struct rbt_node *node)
+{
+  struct rbt_node *next = rbt_next (node);
+  if (next)
+    return next;
+  return rbt_sharded_first_from (
+    self, rbt_sharded_route (self, self->ops->key (node)) + 1);
+}
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* RBT_IMPLEMENTATION */
@@ -0,0 +1,217 @@
+/* github.com/JaMo42/rb-tree */
+#ifndef RB_TREE_SMALL_H
+#define RB_TREE_SMALL_H
+#include <string.h>
+#include "rb_tree.h"
+
+/* Small sets: containers that keep up to `RBT_SMALL_CAPACITY` elements in a
+   sorted array of keys and element pointers, and move them into a tree when
+   they grow past it.  Searching a few keys in an array is a short linear
+   scan without branches, which compilers vectorize for integer keys at
+   `-O3`, and insertion and erasure need no rebalancing.  A set moves back
+   into the array once it shrinks to `RBT_SMALL_DEMOTE` elements; the gap
+   between the two limits keeps a set near the threshold from converting on
+   every operation.
+
+   `RBT_DEFINE_SMALL` generates the set type and its functions, it must be
+   used after `RBT_DEFINE` with the same arguments.  Keys are unique.  All
+   functions are static inline, so there is no implementation part. */
+
+/* Maximum number of elements in the array. */
+#ifndef RBT_SMALL_CAPACITY
+#  define RBT_SMALL_CAPACITY 16
+#endif
+
+/* Size at which a tree moves back into the array. */
+#ifndef RBT_SMALL_DEMOTE
+#  define RBT_SMALL_DEMOTE (RBT_SMALL_CAPACITY / 2)
+#endif
+
+/* Iteration state, valid until the set is modified. */
+struct rbt_small_cursor
+{
+  struct rbt_node *node;
+  unsigned index;
+};
+
+/* Defines `struct prefix_small` and the following functions:
+
+   void prefix_small_init (struct prefix_small *set)
+     Initializes an empty set.
+   type *prefix_small_find (const struct prefix_small *set, key)
+     Returns the element with the given key or NULL.
+   type *prefix_small_insert (struct prefix_small *set, type *data)
+     Inserts `data` unless an element with the same key exists, which is
+     returned instead.  Returns NULL if `data` was inserted.
+   type *prefix_small_erase_key (struct prefix_small *set, key)
+     Erases and returns the element with the given key, NULL if there is
+     none.
+   type *prefix_small_first (const struct prefix_small *set,
+                             struct rbt_small_cursor *cursor)
+     Returns the first element or NULL and positions the cursor on it.
+   type *prefix_small_next (const struct prefix_small *set,
+                            struct rbt_small_cursor *cursor)
+     Advances the cursor and returns the next element or NULL.
+
+   The number of elements is in the `size` field. */
+#define RBT_DEFINE_SMALL(prefix, type, member, key_field, cmp)              \
+  struct prefix##_small                                                     \
+  {                                                                         \
+    unsigned size;                                                          \
+    /* Whether the elements are in `tree` instead of `array`. */            \
+    bool is_tree;                                                           \
+    union                                                                   \
+    {                                                                       \
+      struct                                                                \
+      {                                                                     \
+        RBT_KEY_TYPE (type, key_field) keys[RBT_SMALL_CAPACITY];            \
+        type *items[RBT_SMALL_CAPACITY];                                    \
+      } array;                                                              \
+      struct rbtree tree;                                                   \
+    };                                                                      \
+  };                                                                        \
+                                                                            \
+  static inline void                                                        \
+  prefix##_small_init (struct prefix##_small *set)                          \
+  {                                                                         \
+    set->size = 0;                                                          \
+    set->is_tree = false;                                                   \
+  }                                                                         \
+                                                                            \
+  /* Number of keys ordered before `key`, counted without branches. */      \
+  static inline unsigned                                                    \
+  prefix##_small_position (const struct prefix##_small *set,                \
+                           RBT_KEY_TYPE (type, key_field) key)              \
+  {                                                                         \
+    unsigned i, position = 0;                                               \
+    for (i = 0; i < set->size; ++i)                                         \
+      position += cmp (set->array.keys[i], key) < 0;                        \
+    return position;                                                        \
+  }                                                                         \
+                                                                            \
+  static inline type *                                                      \
+  prefix##_small_find (const struct prefix##_small *set,                    \
+                       RBT_KEY_TYPE (type, key_field) key)                  \
+  {                                                                         \
+    unsigned i;                                                             \
+    if (set->is_tree)                                                       \
+      return prefix##_find (&set->tree, key);                               \
+    i = prefix##_small_position (set, key);                                 \
+    return (i < set->size && cmp (set->array.keys[i], key) == 0             \
+            ? set->array.items[i] : NULL);                                  \
+  }                                                                         \
+                                                                            \
+  static inline void                                                        \
+  prefix##_small_promote (struct prefix##_small *set)                       \
+  {                                                                         \
+    struct rbt_node *nodes[RBT_SMALL_CAPACITY];                             \
+    unsigned i;                                                             \
+    for (i = 0; i < set->size; ++i)                                         \
+      nodes[i] = &set->array.items[i]->member;                              \
+    memset (&set->tree, 0, sizeof (set->tree));                             \
+    rbt_build_sorted (&set->tree, nodes, set->size);                        \
+    set->is_tree = true;                                                    \
+  }                                                                         \
+                                                                            \
+  static inline void                                                        \
+  prefix##_small_demote (struct prefix##_small *set)                        \
+  {                                                                         \
+    type *items[RBT_SMALL_DEMOTE];                                          \
+    struct rbt_node *node;                                                  \
+    unsigned i = 0;                                                         \
+    for (node = rbt_first (&set->tree); node; node = rbt_next (node))       \
+      items[i++] = RBT_CONTAINER_OF (node, type, member);                   \
+    for (i = 0; i < set->size; ++i)                                         \
+      {                                                                     \
+        set->array.keys[i] = items[i]->key_field;                           \
+        set->array.items[i] = items[i];                                     \
+      }                                                                     \
+    set->is_tree = false;                                                   \
+  }                                                                         \
+                                                                            \
+  static inline type *                                                      \
+  prefix##_small_insert (struct prefix##_small *set, type *data)            \
+  {                                                                         \
+    type *found;                                                            \
+    unsigned i;                                                             \
+    if (!set->is_tree)                                                      \
+      {                                                                     \
+        i = prefix##_small_position (set, data->key_field);                 \
+        if (i < set->size                                                   \
+            && cmp (set->array.keys[i], data->key_field) == 0)              \
+          return set->array.items[i];                                       \
+        if (set->size < RBT_SMALL_CAPACITY)                                 \
+          {                                                                 \
+            memmove (set->array.keys + i + 1, set->array.keys + i,          \
+                     (set->size - i) * sizeof (set->array.keys[0]));        \
+            memmove (set->array.items + i + 1, set->array.items + i,        \
+                     (set->size - i) * sizeof (set->array.items[0]));       \
+            set->array.keys[i] = data->key_field;                           \
+            set->array.items[i] = data;                                     \
+            ++set->size;                                                    \
+            return NULL;                                                    \
+          }                                                                 \
+        prefix##_small_promote (set);                                       \
+      }                                                                     \
+    found = prefix##_insert_unique (&set->tree, data);                      \
+    if (!found)                                                             \
+      ++set->size;                                                          \
+    return found;                                                           \
+  }                                                                         \
+                                                                            \
+  static inline type *                                                      \
+  prefix##_small_erase_key (struct prefix##_small *set,                     \
+                            RBT_KEY_TYPE (type, key_field) key)             \
+  {                                                                         \
+    type *found;                                                            \
+    unsigned i;                                                             \
+    if (set->is_tree)                                                       \
+      {                                                                     \
+        found = prefix##_erase_key (&set->tree, key);                       \
+        if (found && --set->size <= RBT_SMALL_DEMOTE)                       \
+          prefix##_small_demote (set);                                      \
+        return found;                                                       \
+      }                                                                     \
+    i = prefix##_small_position (set, key);                                 \
+    if (i == set->size || cmp (set->array.keys[i], key) != 0)               \
+      return NULL;                                                          \
+    found = set->array.items[i];                                            \
+    --set->size;                                                            \
+    memmove (set->array.keys + i, set->array.keys + i + 1,                  \
+             (set->size - i) * sizeof (set->array.keys[0]));                \
+    memmove (set->array.items + i, set->array.items + i + 1,                \
+             (set->size - i) * sizeof (set->array.items[0]));               \
+    return found;                                                           \
+  }                                                                         \
+                                                                            \
+  static inline type *                                                      \
+  prefix##_small_current (const struct prefix##_small *set,                 \
+                          const struct rbt_small_cursor *cursor)            \
+  {                                                                         \
+    if (set->is_tree)                                                       \
+      return (cursor->node ? RBT_CONTAINER_OF (cursor->node, type, member)  \
+              : NULL);                                                      \
+    return cursor->index < set->size ? set->array.items[cursor->index]      \
+                                     : NULL;                                \
+  }                                                                         \
+                                                                            \
+  static inline type *                                                      \
+  prefix##_small_first (const struct prefix##_small *set,                   \
+                        struct rbt_small_cursor *cursor)                    \
+  {                                                                         \
+    cursor->index = 0;                                                      \
+    cursor->node = set->is_tree ? rbt_first (&set->tree) : NULL;            \
+    return prefix##_small_current (set, cursor);                            \
+  }                                                                         \
+                                                                            \
+  static inline type *                                                      \
+  prefix##_small_next (const struct prefix##_small *set,                    \
+                       struct rbt_small_cursor *cursor)                     \
+  {                                                                         \
+    ++cursor->index;                                                        \
+    if (set->is_tree)                                                       \
+      cursor->node = rbt_next (cursor->node);                               \
+    return prefix##_small_current (set, cursor);                            \
+  }
+
+#endif /* RB_TREE_SMALL_H */
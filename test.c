@@ -9,7 +9,17 @@
 #include "vector.h"
 
 #define RBT_IMPLEMENTATION
+#define RBT_SHARDED_REBALANCE_MIN 64
 #include "rb_tree.h"
+#include "rb_tree_pool.h"
+#include "rb_tree_latch.h"
+#include "rb_tree_sharded.h"
+#include "rb_tree_persistent.h"
+#include "rb_tree_frozen.h"
+#include "rb_tree_mapped.h"
+#include "rb_tree_interval.h"
+#include "rb_tree_compact.h"
+#include "rb_tree_small.h"
 
 typedef struct
 {
@@ -21,6 +31,7 @@ typedef struct Int_Set
 {
   struct rbtree tree;
   size_t size;
+  struct rbt_pool pool;
 } Int_Set;
 
 static void
@@ -28,23 +39,15 @@ intset_construct (Int_Set *self)
 {
   self->tree = RBT_EMPTY;
   self->size = 0;
-}
-
-static void
-intset_destruct_impl (struct rbt_node *n)
-{
-  if (n->left)
-    intset_destruct_impl (n->left);
-  if (n->right)
-    intset_destruct_impl (n->right);
-  free (RBT_CONTAINER_OF (n, Int_Set_Node, rbt_node));
+  rbt_pool_init (&self->pool, sizeof (Int_Set_Node), _Alignof (Int_Set_Node));
 }
 
 static void
 intset_destruct (Int_Set *self)
 {
-  if (self->tree.root)
-    intset_destruct_impl (self->tree.root);
+  rbt_pool_release (&self->pool);
+  self->tree = RBT_EMPTY;
+  self->size = 0;
 }
 
 static bool
@@ -73,7 +76,7 @@ intset_insert (Int_Set *self, int i)
         }
     }
 
-  new_node = (Int_Set_Node *)malloc (sizeof (Int_Set_Node));
+  new_node = (Int_Set_Node *)rbt_pool_alloc (&self->pool);
   new_node->value = i;
 
   rbt_insert (&self->tree, &new_node->rbt_node, parent, direction);
@@ -108,7 +111,7 @@ intset_remove (Int_Set *self, int i)
     {
       rbt_erase (&self->tree, &victim->rbt_node);
       --self->size;
-      free (victim);
+      rbt_pool_free (&self->pool, victim);
       return true;
     }
   return false;
@@ -135,7 +138,7 @@ intset_print_impl (struct rbt_node *node)
     intset_print_impl (node->left);
   Int_Set_Node *self = RBT_CONTAINER_OF (node, Int_Set_Node, rbt_node);
   printf (" \x1b[3%cm%d\x1b[0m",
-          node->color == RBT_BLACK ? '8' : '1', self->value);
+          RBT_COLOR (node) == RBT_BLACK ? '8' : '1', self->value);
   if (node->right)
     intset_print_impl (node->right);
 }
@@ -172,6 +175,91 @@ verify_order (Int_Set *s)
   return true;
 }
 
+/* Returns the black height of the subtree or -1 if it violates any of the
+   red-black properties or has inconsistent parent links. */
+static int
+verify_structure_impl (const struct rbt_node *node,
+                       const struct rbt_node *parent)
+{
+  int left, right;
+  if (!node)
+    return 1;
+  if (RBT_PARENT (node) != parent)
+    return -1;
+  if (RBT_COLOR (node) == RBT_RED
+      && ((node->left && RBT_COLOR (node->left) == RBT_RED)
+          || (node->right && RBT_COLOR (node->right) == RBT_RED)))
+    return -1;
+#ifdef RBT_ORDER_STATISTICS
+  if (node->count != (1 + (node->left ? node->left->count : 0)
+                      + (node->right ? node->right->count : 0)))
+    return -1;
+#endif
+  left = verify_structure_impl (node->left, node);
+  right = verify_structure_impl (node->right, node);
+  if (left < 0 || left != right)
+    return -1;
+  return left + (RBT_COLOR (node) == RBT_BLACK);
+}
+
+#ifdef RBT_THREADED
+/* Checks the in-order links against an in-order traversal. */
+static bool
+verify_threads_impl (const struct rbt_node *node,
+                     const struct rbt_node **prev)
+{
+  if (!node)
+    return true;
+  if (!verify_threads_impl (node->left, prev))
+    return false;
+  if (node->prev != *prev || (*prev && (*prev)->next != node))
+    return false;
+  *prev = node;
+  return verify_threads_impl (node->right, prev);
+}
+#endif
+
+static bool
+verify_tree (const struct rbtree *tree)
+{
+#ifdef RBT_THREADED
+  const struct rbt_node *last = NULL;
+  if (!verify_threads_impl (tree->root, &last) || (last && last->next))
+    return false;
+#endif
+  return verify_structure_impl (tree->root, NULL) >= 0;
+}
+
+static bool
+verify_structure (Int_Set *s)
+{
+  return verify_tree (&s->tree);
+}
+
+#ifdef RBT_ORDER_STATISTICS
+static bool
+verify_ranks (Int_Set *s)
+{
+  struct rbt_node *n;
+  unsigned i = 0;
+  if (rbt_size (&s->tree) != s->size)
+    return false;
+  for (n = s->size ? rbt_first (&s->tree) : NULL; n; n = rbt_next (n), ++i)
+    if (rbt_rank (n) != i || rbt_select (&s->tree, i) != n)
+      return false;
+  return rbt_select (&s->tree, i) == NULL;
+}
+#endif
+
+static struct rbt_node *
+nth_node (struct rbtree *tree, unsigned k)
+{
+  struct rbt_node *n = rbt_first (tree);
+  while (k--)
+    n = rbt_next (n);
+  return n;
+}
+
 static unsigned my_rand_state = 0;
 static unsigned
 my_rand ()
@@ -229,12 +317,1490 @@ random_test (unsigned seed, bool verbose)
   intset_print (&s);
   if (!verify_order (&s))
     puts ("\x1b[31mOut of order :(\x1b[0m");
+  else if (!verify_structure (&s))
+    puts ("\x1b[31mNot a valid red-black tree :(\x1b[0m");
+#ifdef RBT_ORDER_STATISTICS
+  else if (!verify_ranks (&s))
+    puts ("\x1b[31mWrong ranks :(\x1b[0m");
+#endif
   else
     puts ("\x1b[32mIn order :)\x1b[0m");
   intset_destruct (&s);
   vector_free (values);
 }
 
+typedef struct
+{
+  struct rbt_node rbt_node;
+  int key;
+  int weight;
+  int max_weight;
+} Aug_Node;
+
+#define AUG_NODE(n) RBT_CONTAINER_OF (n, Aug_Node, rbt_node)
+
+static int
+aug_compute (struct rbt_node *node)
+{
+  int max = AUG_NODE (node)->weight;
+  if (node->left && AUG_NODE (node->left)->max_weight > max)
+    max = AUG_NODE (node->left)->max_weight;
+  if (node->right && AUG_NODE (node->right)->max_weight > max)
+    max = AUG_NODE (node->right)->max_weight;
+  return max;
+}
+
+static void
+aug_propagate (struct rbt_node *node, struct rbt_node *stop)
+{
+  int max;
+  while (node != stop)
+    {
+      max = aug_compute (node);
+      if (max == AUG_NODE (node)->max_weight)
+        break;
+      AUG_NODE (node)->max_weight = max;
+      node = RBT_PARENT (node);
+    }
+}
+
+static void
+aug_copy (struct rbt_node *from, struct rbt_node *to)
+{
+  AUG_NODE (to)->max_weight = AUG_NODE (from)->max_weight;
+}
+
+static void
+aug_rotate (struct rbt_node *from, struct rbt_node *to)
+{
+  AUG_NODE (to)->max_weight = AUG_NODE (from)->max_weight;
+  AUG_NODE (from)->max_weight = aug_compute (from);
+}
+
+static const struct rbt_augment_callbacks aug_callbacks = {
+  aug_propagate, aug_copy, aug_rotate
+};
+
+static bool
+aug_verify (struct rbt_node *node)
+{
+  if (!node)
+    return true;
+  return (aug_verify (node->left) && aug_verify (node->right)
+          && AUG_NODE (node)->max_weight == aug_compute (node));
+}
+
+static void
+augmented_test (void)
+{
+  enum { N = 1000 };
+  static Aug_Node nodes[N];
+  static bool present[N];
+  struct rbtree tree = RBT_EMPTY;
+  struct rbt_node *node, *parent;
+  enum rbt_direction dir;
+  int i, k;
+
+  my_rand_state = 1;
+  for (i = 0; i < 100000; ++i)
+    {
+      k = my_rand () % N;
+      if (present[k])
+        {
+          rbt_erase_augmented (&tree, &nodes[k].rbt_node, &aug_callbacks);
+          present[k] = false;
+          continue;
+        }
+      nodes[k].key = k;
+      nodes[k].weight = my_rand () % 10000;
+      nodes[k].max_weight = nodes[k].weight;
+      node = tree.root;
+      parent = NULL;
+      dir = RBT_LEFT;
+      while (node)
+        {
+          parent = node;
+          dir = k < AUG_NODE (node)->key ? RBT_LEFT : RBT_RIGHT;
+          node = node->child[dir];
+        }
+      rbt_insert_augmented (&tree, &nodes[k].rbt_node, parent, dir,
+                            &aug_callbacks);
+      present[k] = true;
+      if (i % 1000 == 0)
+        assert (aug_verify (tree.root));
+    }
+  assert (aug_verify (tree.root));
+}
+
+static void
+cached_test (void)
+{
+  enum { N = 1000 };
+  static Int_Set_Node nodes[N];
+  struct rbtree_cached tree = RBT_CACHED_EMPTY;
+  struct rbt_node *node, *parent;
+  enum rbt_direction dir;
+  int i, prev = -1;
+
+  my_rand_state = 2;
+  for (i = 0; i < N; ++i)
+    {
+      nodes[i].value = my_rand () % 100;
+      node = tree.tree.root;
+      parent = NULL;
+      dir = RBT_LEFT;
+      while (node)
+        {
+          parent = node;
+          dir = (nodes[i].value
+                 < RBT_CONTAINER_OF (node, Int_Set_Node, rbt_node)->value
+                 ? RBT_LEFT : RBT_RIGHT);
+          node = node->child[dir];
+        }
+      rbt_insert_cached (&tree, &nodes[i].rbt_node, parent, dir);
+      assert (rbt_first_cached (&tree) == rbt_first (&tree.tree));
+      assert (rbt_last_cached (&tree) == rbt_last (&tree.tree));
+    }
+  rbt_erase_cached (&tree, rbt_last_cached (&tree));
+  assert (rbt_last_cached (&tree) == rbt_last (&tree.tree));
+  for (i = 0; i < N - 1; ++i)
+    {
+      node = rbt_pop_first (&tree);
+      assert (RBT_CONTAINER_OF (node, Int_Set_Node, rbt_node)->value >= prev);
+      prev = RBT_CONTAINER_OF (node, Int_Set_Node, rbt_node)->value;
+      if (tree.tree.root)
+        assert (rbt_first_cached (&tree) == rbt_first (&tree.tree));
+    }
+  assert (rbt_pop_first (&tree) == NULL);
+  assert (rbt_first_cached (&tree) == NULL && rbt_last_cached (&tree) == NULL);
+}
+
+static void
+build_sorted_test (void)
+{
+  enum { N = 300 };
+  static Int_Set_Node nodes[N];
+  struct rbt_node *array[N];
+  Int_Set s;
+  int i, n;
+
+  for (i = 0; i < N; ++i)
+    {
+      nodes[i].value = i;
+      array[i] = &nodes[i].rbt_node;
+    }
+  for (n = 0; n <= N; ++n)
+    {
+      intset_construct (&s);
+      rbt_build_sorted (&s.tree, array, n);
+      s.size = n;
+      assert (rbt_size (&s.tree) == (unsigned)n);
+      assert (verify_structure (&s));
+      assert (verify_order (&s));
+#ifdef RBT_ORDER_STATISTICS
+      assert (verify_ranks (&s));
+#endif
+      /* The result must be a normal tree that can be modified further. */
+      for (i = 0; i < n; i += 3, --s.size)
+        rbt_erase (&s.tree, &nodes[i].rbt_node);
+      assert (verify_structure (&s));
+    }
+}
+
+static void
+join_split_test (void)
+{
+  enum { N = 500 };
+  Int_Set s, less, greater;
+  Int_Set_Node *pivot;
+  int i, k;
+
+  my_rand_state = 3;
+  for (i = 0; i < 200; ++i)
+    {
+      intset_construct (&s);
+      while (s.size < (size_t)(my_rand () % N + 1))
+        intset_insert (&s, my_rand () % (2 * N));
+      pivot = RBT_CONTAINER_OF (nth_node (&s.tree, my_rand () % s.size),
+                                Int_Set_Node, rbt_node);
+      k = pivot->value;
+
+      intset_construct (&less);
+      intset_construct (&greater);
+      rbt_split (&s.tree, &pivot->rbt_node, &less.tree, &greater.tree);
+      assert (s.tree.root == NULL);
+      less.size = rbt_size (&less.tree);
+      greater.size = rbt_size (&greater.tree);
+      assert (less.size + greater.size + 1 == s.size);
+      assert (verify_structure (&less) && verify_order (&less));
+      assert (verify_structure (&greater) && verify_order (&greater));
+      assert (!less.size
+              || RBT_CONTAINER_OF (rbt_last (&less.tree), Int_Set_Node,
+                                   rbt_node)->value < k);
+      assert (!greater.size
+              || RBT_CONTAINER_OF (rbt_first (&greater.tree), Int_Set_Node,
+                                   rbt_node)->value > k);
+
+      rbt_join (&less.tree, &pivot->rbt_node, &greater.tree);
+      assert (greater.tree.root == NULL);
+      less.size = s.size;
+      assert (rbt_size (&less.tree) == less.size);
+      assert (verify_structure (&less) && verify_order (&less));
+#ifdef RBT_ORDER_STATISTICS
+      assert (verify_ranks (&less));
+#endif
+      assert (intset_contains (&less, k));
+      /* The nodes belong to the pool of `s`. */
+      intset_destruct (&s);
+    }
+}
+
+static int
+intset_compare (const struct rbt_node *a, const struct rbt_node *b)
+{
+  int x = RBT_CONTAINER_OF (a, Int_Set_Node, rbt_node)->value;
+  int y = RBT_CONTAINER_OF (b, Int_Set_Node, rbt_node)->value;
+  return (x > y) - (x < y);
+}
+
+/* The nodes are freed with their pool, only count them. */
+static unsigned intset_freed;
+
+static void
+intset_free_node (struct rbt_node *node)
+{
+  (void)node;
+  ++intset_freed;
+}
+
+static void
+set_operations_test (void)
+{
+  enum { N = 2000 };
+  static bool in_a[N], in_b[N];
+  Int_Set a, b;
+  int i, op, round;
+  size_t total;
+  bool expected;
+
+  my_rand_state = 4;
+  for (round = 0; round < 30; ++round)
+    for (op = 0; op < 3; ++op)
+      {
+        intset_construct (&a);
+        intset_construct (&b);
+        for (i = 0; i < N; ++i)
+          {
+            in_a[i] = my_rand () % 4 == 0;
+            in_b[i] = my_rand () % (round % 5 + 2) == 0;
+            if (in_a[i])
+              intset_insert (&a, i);
+            if (in_b[i])
+              intset_insert (&b, i);
+          }
+        total = a.size + b.size;
+        intset_freed = 0;
+        if (op == 0)
+          rbt_union (&a.tree, &b.tree, intset_compare, intset_free_node, 4);
+        else if (op == 1)
+          rbt_intersect (&a.tree, &b.tree, intset_compare, intset_free_node,
+                         4);
+        else
+          rbt_difference (&a.tree, &b.tree, intset_compare, intset_free_node,
+                          4);
+        assert (b.tree.root == NULL);
+        a.size = rbt_size (&a.tree);
+        assert (a.size + intset_freed == total);
+        assert (verify_structure (&a) && verify_order (&a));
+        for (i = 0; i < N; ++i)
+          {
+            expected = (op == 0 ? in_a[i] || in_b[i]
+                        : op == 1 ? in_a[i] && in_b[i]
+                        : in_a[i] && !in_b[i]);
+            assert (intset_contains (&a, i) == expected);
+          }
+        intset_destruct (&a);
+        intset_destruct (&b);
+      }
+}
+
+static void
+pool_test (void)
+{
+  enum { N = 5000 };
+  static void *objects[N];
+  struct rbt_pool pool;
+  int i;
+
+  rbt_pool_init (&pool, 1, 1);
+  assert (pool.object_size == sizeof (void *));
+  rbt_pool_init (&pool, 40, 32);
+  assert (pool.object_size == 64);
+  for (i = 0; i < N; ++i)
+    {
+      objects[i] = rbt_pool_alloc (&pool);
+      assert ((uintptr_t)objects[i] % 32 == 0);
+      memset (objects[i], 0xAB, 40);
+    }
+  rbt_pool_free (&pool, objects[7]);
+  rbt_pool_free (&pool, objects[3]);
+  assert (rbt_pool_alloc (&pool) == objects[3]);
+  assert (rbt_pool_alloc (&pool) == objects[7]);
+  rbt_pool_release (&pool);
+  assert (rbt_pool_alloc (&pool) != NULL);
+  rbt_pool_release (&pool);
+}
+
+typedef struct
+{
+  int key;
+  struct rbt_latch_node latch;
+} Latch_Node;
+
+static bool
+latch_less (const struct rbt_latch_node *a, const struct rbt_latch_node *b)
+{
+  return (RBT_CONTAINER_OF (a, Latch_Node, latch)->key
+          < RBT_CONTAINER_OF (b, Latch_Node, latch)->key);
+}
+
+static int
+latch_comp (const void *key, const struct rbt_latch_node *node)
+{
+  int k = *(const int *)key;
+  int test = RBT_CONTAINER_OF (node, Latch_Node, latch)->key;
+  return (k > test) - (k < test);
+}
+
+static void
+latch_test (void)
+{
+  enum { N = 500 };
+  static const struct rbt_latch_ops ops = { latch_less, latch_comp };
+  static Latch_Node nodes[N];
+  struct rbt_latch_tree tree = RBT_LATCH_EMPTY;
+  Int_Set copy;
+  struct rbt_latch_node *found;
+  int i, t;
+
+  for (i = 0; i < N; ++i)
+    {
+      nodes[i].key = (i * 7) % N;
+      rbt_latch_insert (&tree, &nodes[i].latch, &ops);
+    }
+  for (i = 0; i < N; i += 3)
+    rbt_latch_erase (&tree, &nodes[i].latch);
+  /* Every insertion and erasure moves readers twice. */
+  assert (tree.seq == 2 * (N + (N + 2) / 3));
+
+  for (t = 0; t < 2; ++t)
+    {
+      copy.tree = tree.tree[t];
+      assert (verify_structure (&copy));
+      assert (rbt_size (&copy.tree) == N - (N + 2) / 3);
+    }
+  for (i = 0; i < N; ++i)
+    {
+      found = rbt_latch_find (&tree, &nodes[i].key, &ops);
+      assert (i % 3 ? found == &nodes[i].latch : found == NULL);
+    }
+}
+
+static int
+sharded_compare (const void *a, const void *b)
+{
+  int x = *(const int *)a, y = *(const int *)b;
+  return (x > y) - (x < y);
+}
+
+static const void *
+sharded_key (const struct rbt_node *node)
+{
+  return &RBT_CONTAINER_OF (node, Int_Set_Node, rbt_node)->value;
+}
+
+static bool
+sharded_count (struct rbt_node *node, void *arg)
+{
+  int *expected = (int *)arg;
+  if (RBT_CONTAINER_OF (node, Int_Set_Node, rbt_node)->value != *expected)
+    return false;
+  *expected += 2;
+  return true;
+}
+
+static void
+sharded_test (void)
+{
+  enum { N = 5000, SHARDS = 8, EXTRA = 600 };
+  static const struct rbt_sharded_ops ops = {
+    sharded_compare, sharded_key, sizeof (int)
+  };
+  static Int_Set_Node nodes[N], extra[EXTRA];
+  struct rbt_sharded sharded;
+  Int_Set shard;
+  struct rbt_node *n, *roots[SHARDS];
+#ifdef RBT_STATS
+  struct rbt_stats stats[SHARDS];
+#endif
+  int i, expected;
+  unsigned s;
+
+  assert (rbt_sharded_init (&sharded, SHARDS, &ops));
+  /* Ascending keys all go to the last shard, which keeps it hot. */
+  for (i = 0; i < N; ++i)
+    {
+      nodes[i].value = i;
+      assert (rbt_sharded_insert (&sharded, &nodes[i].rbt_node) == NULL);
+    }
+  assert (rbt_sharded_insert (&sharded, &nodes[7].rbt_node)
+          == &nodes[7].rbt_node);
+  assert (rbt_sharded_size (&sharded) == N);
+  assert (sharded.nbounds == SHARDS - 1);
+  for (s = 0; s < SHARDS; ++s)
+    {
+      shard.tree = sharded.shards[s].tree.tree;
+      assert (verify_structure (&shard));
+      assert (rbt_size (&shard.tree) == sharded.shards[s].size);
+      assert (sharded.shards[s].size <= 2 * N / SHARDS + 64);
+    }
+
+  for (i = 1; i < N; i += 2)
+    assert (rbt_sharded_erase_key (&sharded, &i) == &nodes[i].rbt_node);
+  for (i = 0; i < N; ++i)
+    assert ((rbt_sharded_find (&sharded, &i) != NULL) == (i % 2 == 0));
+  expected = 0;
+  for (n = rbt_sharded_first (&sharded); n; n = rbt_sharded_next (&sharded, n))
+    assert (sharded_count (n, &expected));
+  assert (expected == N);
+
+#ifdef RBT_STATS
+  for (s = 0; s < SHARDS; ++s)
+    stats[s] = sharded.shards[s].tree.tree.stats;
+#endif
+  rbt_sharded_rebalance (&sharded);
+  for (s = 0; s < SHARDS; ++s)
+    assert (sharded.shards[s].size == N / 2 / SHARDS
+            || sharded.shards[s].size == N / 2 / SHARDS + 1);
+#ifdef RBT_STATS
+  /* Moving nodes between shards keeps each shard's counters. */
+  assert (stats[SHARDS - 1].inserts > 0);
+  for (s = 0; s < SHARDS; ++s)
+    assert (memcmp (&stats[s], &sharded.shards[s].tree.tree.stats,
+                    sizeof (stats[s])) == 0);
+#endif
+  expected = 0;
+  assert (rbt_sharded_for_each (&sharded, sharded_count, &expected));
+  assert (expected == N);
+
+  /* Keys below all others make the first shard hot, only it and its
+     neighbour need to be rebalanced. */
+  for (s = 2; s < SHARDS; ++s)
+    roots[s] = sharded.shards[s].tree.tree.root;
+  for (i = 0; i < EXTRA; ++i)
+    {
+      extra[i].value = -1 - i;
+      assert (rbt_sharded_insert (&sharded, &extra[i].rbt_node) == NULL);
+    }
+  assert (sharded.shards[1].size > N / 2 / SHARDS + 1);
+  for (s = 2; s < SHARDS; ++s)
+    assert (sharded.shards[s].tree.tree.root == roots[s]
+            && sharded.shards[s].size <= N / 2 / SHARDS + 1);
+  for (s = 0; s < 2; ++s)
+    {
+      shard.tree = sharded.shards[s].tree.tree;
+      assert (verify_structure (&shard));
+      assert (rbt_size (&shard.tree) == sharded.shards[s].size);
+    }
+  expected = -EXTRA;
+  for (n = rbt_sharded_first (&sharded); n; n = rbt_sharded_next (&sharded, n))
+    {
+      assert (*(const int *)sharded_key (n) == expected);
+      expected += expected < 0 ? 1 : 2;
+    }
+  assert (expected == N);
+  rbt_sharded_destroy (&sharded);
+}
+
+
+typedef struct
+{
+  struct rbt_pnode node;
+  int key;
+} Persistent_Node;
+
+#define PERSISTENT_NODE(n) RBT_CONTAINER_OF (n, Persistent_Node, node)
+
+static int persistent_live, persistent_clones;
+
+static int
+persistent_compare (const struct rbt_pnode *a, const struct rbt_pnode *b)
+{
+  int x = PERSISTENT_NODE (a)->key, y = PERSISTENT_NODE (b)->key;
+  return (x > y) - (x < y);
+}
+
+static int
+persistent_compare_key (const void *key, const struct rbt_pnode *node)
+{
+  int k = *(const int *)key, test = PERSISTENT_NODE (node)->key;
+  return (k > test) - (k < test);
+}
+
+static struct rbt_pnode *
+persistent_new (int key)
+{
+  Persistent_Node *node = (Persistent_Node *)malloc (sizeof (*node));
+  node->key = key;
+  ++persistent_live;
+  return &node->node;
+}
+
+static struct rbt_pnode *
+persistent_clone (const struct rbt_pnode *node)
+{
+  ++persistent_clones;
+  return persistent_new (PERSISTENT_NODE (node)->key);
+}
+
+static void
+persistent_free (struct rbt_pnode *node)
+{
+  --persistent_live;
+  free (PERSISTENT_NODE (node));
+}
+
+/* Returns the black height or -1 if the tree is invalid. */
+static int
+persistent_black_height (const struct rbt_pnode *node)
+{
+  int left, right;
+  if (!node)
+    return 1;
+  if (node->color == RBT_RED
+      && ((node->left && node->left->color == RBT_RED)
+          || (node->right && node->right->color == RBT_RED)))
+    return -1;
+  left = persistent_black_height (node->left);
+  right = persistent_black_height (node->right);
+  if (left < 0 || left != right)
+    return -1;
+  return left + (node->color == RBT_BLACK);
+}
+
+/* Checks that the version contains exactly the keys in `[0, n)` for which
+   `present` is set. */
+static bool
+persistent_verify (const struct rbt_pnode *root, const bool *present, int n)
+{
+  struct rbt_persistent_iter iter;
+  struct rbt_pnode *node;
+  int i = 0;
+
+  if (persistent_black_height (root) < 0)
+    return false;
+  for (node = rbt_persistent_first (&iter, root); node;
+       node = rbt_persistent_next (&iter))
+    {
+      while (i < n && !present[i])
+        ++i;
+      if (i == n || PERSISTENT_NODE (node)->key != i++)
+        return false;
+    }
+  while (i < n && !present[i])
+    ++i;
+  return i == n;
+}
+
+static void
+persistent_test (void)
+{
+  enum { N = 1000 };
+  static const struct rbt_persistent_ops ops = {
+    persistent_compare, persistent_compare_key, persistent_clone,
+    persistent_free
+  };
+  static struct rbt_pnode *versions[2 * N + 2];
+  static bool present[2 * N + 2][N];
+  struct rbt_pnode *node;
+  int v, key;
+
+  versions[0] = NULL;
+  for (v = 1; v <= N; ++v)
+    {
+      key = (v * 7) % N;
+      persistent_clones = 0;
+      versions[v] = rbt_persistent_insert (versions[v - 1],
+                                           persistent_new (key), &ops);
+      /* Only the path and a few siblings are copied, the height is at most
+         2 * log2 (N). */
+      assert (persistent_clones <= 3 * 2 * 10);
+      memcpy (present[v], present[v - 1], sizeof (present[v]));
+      present[v][key] = true;
+    }
+  for (v = N + 1; v <= 2 * N; ++v)
+    {
+      key = (v * 13) % N;
+      persistent_clones = 0;
+      versions[v] = rbt_persistent_erase (versions[v - 1], &key, &ops);
+      assert (persistent_clones <= 3 * 2 * 10);
+      memcpy (present[v], present[v - 1], sizeof (present[v]));
+      present[v][key] = false;
+    }
+  /* Every version is still intact. */
+  for (v = 0; v <= 2 * N; ++v)
+    assert (persistent_verify (versions[v], present[v], N));
+
+  key = 3;
+  node = rbt_persistent_find (versions[N], &key, &ops);
+  assert (node && PERSISTENT_NODE (node)->key == 3);
+  assert (rbt_persistent_find (versions[2 * N], &key, &ops) == NULL);
+  /* Erasing a missing key returns the same version. */
+  versions[2 * N + 1] = rbt_persistent_erase (versions[2 * N], &key, &ops);
+  assert (versions[2 * N + 1] == versions[2 * N]);
+  rbt_persistent_release (versions[2 * N + 1], &ops);
+  /* Inserting an equal key replaces the node in the new version only. */
+  node = persistent_new (5);
+  versions[2 * N + 1] = rbt_persistent_insert (versions[N], node, &ops);
+  key = 5;
+  assert (rbt_persistent_find (versions[2 * N + 1], &key, &ops) == node);
+  assert (rbt_persistent_find (versions[N], &key, &ops) != node);
+  assert (persistent_verify (versions[2 * N + 1], present[N], N));
+
+  rbt_persistent_release (rbt_persistent_retain (versions[N]), &ops);
+  for (v = 0; v <= 2 * N + 1; v += 2)
+    rbt_persistent_release (versions[v], &ops);
+  for (v = 1; v <= 2 * N + 1; v += 2)
+    rbt_persistent_release (versions[v], &ops);
+  assert (persistent_live == 0);
+}
+
+typedef struct
+{
+  struct rbt_cnode node;
+  int key;
+} Compact_Node;
+
+#define COMPACT_NODE(n) RBT_CONTAINER_OF (n, Compact_Node, node)
+
+static int
+compact_compare (const void *key, const struct rbt_cnode *node)
+{
+  int k = *(const int *)key, test = COMPACT_NODE (node)->key;
+  return (k > test) - (k < test);
+}
+
+/* Returns the black height or -1 if the tree is invalid. */
+static int
+compact_black_height (const struct rbt_cnode *node)
+{
+  int left, right;
+  if (!node)
+    return 1;
+  if (RBT_CNODE_COLOR (node) == RBT_RED
+      && ((RBT_CNODE_LEFT (node)
+           && RBT_CNODE_COLOR (RBT_CNODE_LEFT (node)) == RBT_RED)
+          || (RBT_CNODE_RIGHT (node)
+              && RBT_CNODE_COLOR (RBT_CNODE_RIGHT (node)) == RBT_RED)))
+    return -1;
+  left = compact_black_height (RBT_CNODE_LEFT (node));
+  right = compact_black_height (RBT_CNODE_RIGHT (node));
+  if (left < 0 || left != right)
+    return -1;
+  return left + (RBT_CNODE_COLOR (node) == RBT_BLACK);
+}
+
+static void
+compact_test (void)
+{
+  enum { N = 1000 };
+  static Compact_Node nodes[N];
+  static bool present[N];
+  struct rbtree_compact tree = RBT_COMPACT_EMPTY;
+  struct rbt_compact_cursor cursor;
+  struct rbt_cnode *node;
+  int i, key, expected;
+
+  assert (sizeof (struct rbt_cnode) == 2 * sizeof (void *));
+  assert (rbt_compact_first (&cursor, &tree) == NULL);
+  for (i = 0; i < 4 * N; ++i)
+    {
+      key = my_rand () % N;
+      if (my_rand () % 3)
+        {
+          nodes[key].key = key;
+          node = rbt_compact_insert (&tree, &nodes[key].node, &key,
+                                     compact_compare);
+          assert (node == (present[key] ? &nodes[key].node : NULL));
+          present[key] = true;
+        }
+      else
+        {
+          node = rbt_compact_erase (&tree, &key, compact_compare);
+          assert (node == (present[key] ? &nodes[key].node : NULL));
+          present[key] = false;
+        }
+      if (i % 64 == 0)
+        assert (compact_black_height (tree.root) > 0);
+    }
+  assert (compact_black_height (tree.root) > 0);
+
+  expected = 0;
+  for (node = rbt_compact_first (&cursor, &tree); node;
+       node = rbt_compact_next (&cursor))
+    {
+      while (!present[expected])
+        ++expected;
+      assert (COMPACT_NODE (node)->key == expected++);
+    }
+  for (key = -1; key <= N; ++key)
+    {
+      node = rbt_compact_find (&tree, &key, compact_compare);
+      assert (node == (key >= 0 && key < N && present[key]
+                       ? &nodes[key].node : NULL));
+      for (expected = key < 0 ? 0 : key; expected < N && !present[expected];
+           ++expected)
+        ;
+      node = rbt_compact_lower_bound (&cursor, &tree, &key, compact_compare);
+      assert (node == (expected < N ? &nodes[expected].node : NULL));
+      if (node)
+        {
+          node = rbt_compact_next (&cursor);
+          for (++expected; expected < N && !present[expected]; ++expected)
+            ;
+          assert (node == (expected < N ? &nodes[expected].node : NULL));
+        }
+    }
+
+  for (key = 0; key < N; ++key)
+    if (present[key])
+      assert (rbt_compact_erase (&tree, &key, compact_compare));
+  assert (tree.root == NULL);
+}
+
+static int64_t
+frozen_key (const struct rbt_node *node)
+{
+  return RBT_CONTAINER_OF (node, Int_Set_Node, rbt_node)->value;
+}
+
+static void
+frozen_test (void)
+{
+  enum { N = 300 };
+  static Int_Set_Node nodes[N];
+  struct rbt_node *array[N];
+  struct rbtree tree;
+  struct rbt_frozen frozen;
+  int i, n;
+
+  for (i = 0; i < N; ++i)
+    {
+      nodes[i].value = 2 * i;
+      array[i] = &nodes[i].rbt_node;
+    }
+  for (n = 0; n <= N; n += 7)
+    {
+      tree = RBT_EMPTY;
+      rbt_build_sorted (&tree, array, n);
+      assert (rbt_freeze (&frozen, &tree, frozen_key));
+      assert (frozen.size == (size_t)n);
+      assert ((uintptr_t)frozen.keys % 64 == 0);
+      for (i = 0; i < n; ++i)
+        {
+          assert (rbt_frozen_find (&frozen, 2 * i) == array[i]);
+          assert (rbt_frozen_find (&frozen, 2 * i + 1) == NULL);
+          assert (rbt_frozen_lower_bound (&frozen, 2 * i) == array[i]);
+          assert (rbt_frozen_lower_bound (&frozen, 2 * i - 1) == array[i]);
+        }
+      assert (rbt_frozen_find (&frozen, -1) == NULL);
+      assert (rbt_frozen_lower_bound (&frozen, 2 * n - 1) == NULL);
+      rbt_frozen_free (&frozen);
+    }
+}
+
+static int64_t
+verify_interval_impl (const struct rbt_node *node)
+{
+  int64_t last, child;
+  if (!node)
+    return INT64_MIN;
+  last = RBT_INTERVAL (node)->last;
+  child = verify_interval_impl (node->left);
+  last = child > last ? child : last;
+  child = verify_interval_impl (node->right);
+  last = child > last ? child : last;
+  assert (RBT_INTERVAL (node)->subtree_last == last);
+  return last;
+}
+
+static void
+interval_test (void)
+{
+  enum { N = 500, RANGE = 2000 };
+  static struct rbt_interval nodes[N];
+  static bool in_tree[N];
+  struct rbtree tree = RBT_EMPTY;
+  struct rbt_interval *it;
+  int64_t start, last, prev;
+  int i, j, q, found, expected;
+
+  for (i = 0; i < N; ++i)
+    {
+      nodes[i].start = my_rand () % RANGE;
+      nodes[i].last = nodes[i].start + my_rand () % (i % 10 ? 20 : 400);
+      rbt_interval_insert (&tree, &nodes[i]);
+      in_tree[i] = true;
+    }
+  assert (verify_tree (&tree));
+  verify_interval_impl (tree.root);
+
+  for (j = 0; j < 3; ++j)
+    {
+      for (q = 0; q < 200; ++q)
+        {
+          start = my_rand () % (RANGE + 200) - 100;
+          last = start + my_rand () % (q % 2 ? 5 : 300);
+          expected = 0;
+          for (i = 0; i < N; ++i)
+            expected += (in_tree[i] && nodes[i].start <= last
+                         && nodes[i].last >= start);
+          found = 0;
+          prev = INT64_MIN;
+          for (it = rbt_interval_first (&tree, start, last); it;
+               it = rbt_interval_next (it, start, last))
+            {
+              assert (it->start <= last && it->last >= start);
+              assert (it->start >= prev);
+              prev = it->start;
+              ++found;
+            }
+          assert (found == expected);
+        }
+      /* Erase a third of the remaining intervals. */
+      for (i = 0; i < N; ++i)
+        if (in_tree[i] && my_rand () % 3 == 0)
+          {
+            rbt_interval_erase (&tree, &nodes[i]);
+            in_tree[i] = false;
+          }
+      assert (verify_tree (&tree));
+      verify_interval_impl (tree.root);
+    }
+}
+
+/* The node is deliberately not the first member. */
+typedef struct
+{
+  int key;
+  int order;
+  struct rbt_node node;
+} Keyed_Node;
+
+RBT_DEFINE (keyed, Keyed_Node, node, key, RBT_NUMERIC_COMPARE)
+
+static void
+define_test (void)
+{
+  enum { N = 400 };
+  static Keyed_Node nodes[N];
+  static Keyed_Node extra;
+  struct rbtree tree = RBT_EMPTY;
+  struct rbt_node *n;
+  Keyed_Node *k;
+  int i, prev_key = -1, prev_order = -1;
+
+  /* keys 0, 2, 4, ... each inserted twice */
+  for (i = 0; i < N; ++i)
+    {
+      nodes[i].key = (i % (N / 2)) * 2;
+      nodes[i].order = i;
+      keyed_insert_multi (&tree, &nodes[i]);
+    }
+  for (n = rbt_first (&tree); n; n = rbt_next (n))
+    {
+      k = RBT_CONTAINER_OF (n, Keyed_Node, node);
+      assert (k->key > prev_key
+              || (k->key == prev_key && k->order > prev_order));
+      prev_key = k->key;
+      prev_order = k->order;
+    }
+
+  for (i = 0; i < N; ++i)
+    {
+      k = keyed_find (&tree, i);
+      assert (i % 2 ? k == NULL : k != NULL && k->key == i);
+      k = keyed_lower_bound (&tree, i);
+      assert (i < N - 1 ? k->key == i + i % 2 : k == NULL);
+      if (k && i % 2 == 0)
+        assert (k->order == i / 2);
+      k = keyed_upper_bound (&tree, i);
+      assert (i < N - 2 ? k->key == i + 2 - i % 2 : k == NULL);
+    }
+
+  extra.key = 10;
+  assert (keyed_insert_unique (&tree, &extra)->key == 10);
+  extra.key = 11;
+  assert (keyed_insert_unique (&tree, &extra) == NULL);
+  assert (keyed_find (&tree, 11) == &extra);
+  assert (keyed_erase_key (&tree, 11) == &extra);
+  assert (keyed_erase_key (&tree, 11) == NULL);
+  for (i = 0; i < N; i += 2)
+    {
+      assert (keyed_erase_key (&tree, i) != NULL);
+      assert (keyed_erase_key (&tree, i) != NULL);
+      assert (keyed_erase_key (&tree, i) == NULL);
+    }
+  assert (tree.root == NULL);
+}
+
+RBT_DEFINE_SMALL (keyed, Keyed_Node, node, key, RBT_NUMERIC_COMPARE)
+
+static void
+small_test (void)
+{
+  enum { N = 40 };
+  static Keyed_Node nodes[N];
+  static Keyed_Node other;
+  bool present[N] = { false };
+  struct keyed_small set;
+  struct rbt_small_cursor cursor;
+  Keyed_Node *k;
+  unsigned size = 0, count;
+  int i, step, prev;
+  bool was_tree = false, demoted = false;
+
+  keyed_small_init (&set);
+  assert (keyed_small_first (&set, &cursor) == NULL);
+  for (i = 0; i < N; ++i)
+    nodes[i].key = i;
+  for (step = 0; step < 20000; ++step)
+    {
+      /* Drift the size up and down across both limits. */
+      i = my_rand () % N;
+      if (my_rand () % 40 < (step / 1000 % 2 ? 12 : 28))
+        {
+          if (present[i])
+            {
+              other.key = i;
+              assert (keyed_small_insert (&set, &other) == &nodes[i]);
+            }
+          else
+            {
+              assert (keyed_small_insert (&set, &nodes[i]) == NULL);
+              present[i] = true;
+              ++size;
+            }
+        }
+      else
+        {
+          assert (keyed_small_erase_key (&set, i)
+                  == (present[i] ? &nodes[i] : NULL));
+          size -= present[i];
+          present[i] = false;
+        }
+      assert (set.size == size);
+      assert (set.is_tree ? size > RBT_SMALL_DEMOTE
+                          : size <= RBT_SMALL_CAPACITY);
+      if (set.is_tree)
+        assert (verify_tree (&set.tree) && rbt_size (&set.tree) == size);
+      demoted |= was_tree && !set.is_tree;
+      was_tree = set.is_tree;
+
+      i = my_rand () % N;
+      assert (keyed_small_find (&set, i) == (present[i] ? &nodes[i] : NULL));
+      prev = -1;
+      count = 0;
+      for (k = keyed_small_first (&set, &cursor); k;
+           k = keyed_small_next (&set, &cursor))
+        {
+          assert (k->key > prev && present[k->key] && k == &nodes[k->key]);
+          prev = k->key;
+          ++count;
+        }
+      assert (count == size);
+    }
+  assert (demoted);
+}
+
+static int range_freed;
+
+static void
+range_free_node (struct rbt_node *node)
+{
+  (void)node;
+  ++range_freed;
+}
+
+static void
+range_test (void)
+{
+  enum { N = 200 };
+  static Keyed_Node nodes[N];
+  struct rbt_node *array[N];
+  struct rbtree tree = RBT_EMPTY;
+  struct rbt_range range;
+  struct rbt_node *n;
+  Keyed_Node *k;
+  int i, lo, hi, expected;
+
+  for (i = 0; i < N; ++i)
+    {
+      nodes[i].key = 2 * i;
+      array[i] = &nodes[i].node;
+    }
+  for (lo = -1; lo <= 2 * N; lo += 3)
+    for (hi = lo - 1; hi <= 2 * N; hi += 5)
+      {
+        rbt_build_sorted (&tree, array, N);
+        expected = lo < 0 ? 0 : lo + lo % 2;
+        for (k = keyed_range_begin (&range, &tree, lo, hi); k;
+             k = keyed_range_next (&range))
+          {
+            assert (k->key == expected);
+            expected += 2;
+          }
+        if (lo <= hi)
+          assert (expected == (hi >= 2 * N - 2 ? 2 * N
+                               : hi + 1 + (hi + 1) % 2));
+
+        range_freed = 0;
+        keyed_erase_range (&tree, lo, hi, range_free_node);
+        assert (verify_tree (&tree));
+        i = 0;
+        for (n = tree.root ? rbt_first (&tree) : NULL; n; n = rbt_next (n))
+          {
+            k = RBT_CONTAINER_OF (n, Keyed_Node, node);
+            assert (k->key < lo || k->key > hi);
+            ++i;
+          }
+        assert (i + range_freed == N);
+      }
+
+  /* Erasing everything leaves an empty tree. */
+  rbt_build_sorted (&tree, array, N);
+  rbt_erase_range (&tree, array[0], array[N - 1], NULL);
+  assert (tree.root == NULL);
+}
+
+static int
+keyed_compare (const struct rbt_node *a, const struct rbt_node *b)
+{
+  const int x = RBT_CONTAINER_OF (a, Keyed_Node, node)->key;
+  const int y = RBT_CONTAINER_OF (b, Keyed_Node, node)->key;
+  return (x > y) - (x < y);
+}
+
+static long keyed_comparisons;
+
+static int
+keyed_compare_counted (const struct rbt_node *a, const struct rbt_node *b)
+{
+  ++keyed_comparisons;
+  return keyed_compare (a, b);
+}
+
+static void
+insert_hint_test (void)
+{
+  enum { N = 2000, M = 1 << 14 };
+  static Keyed_Node nodes[N], many[M];
+  static Keyed_Node extra;
+  struct rbtree tree = RBT_EMPTY;
+  struct rbt_node *n, *hint;
+  Keyed_Node *k;
+  int i, d, log_d, prev_key, prev_order;
+  long count;
+
+  /* Appending with the last node as hint. */
+  hint = NULL;
+  for (i = 0; i < N; ++i)
+    {
+      nodes[i].key = i / 3;
+      nodes[i].order = i;
+      keyed_comparisons = 0;
+      rbt_insert_hint (&tree, &nodes[i].node, hint, keyed_compare_counted);
+      assert (keyed_comparisons <= 2);
+      hint = &nodes[i].node;
+    }
+  assert (verify_tree (&tree));
+  for (i = 0, n = rbt_first (&tree); n; n = rbt_next (n), ++i)
+    assert (n == &nodes[i].node);
+
+  /* Prepending with the first node as hint. */
+  tree = RBT_EMPTY;
+  hint = NULL;
+  for (i = N - 1; i >= 0; --i)
+    {
+      nodes[i].key = i;
+      keyed_comparisons = 0;
+      rbt_insert_hint (&tree, &nodes[i].node, hint, keyed_compare_counted);
+      assert (keyed_comparisons <= 2);
+      hint = &nodes[i].node;
+    }
+  assert (verify_tree (&tree));
+  for (i = 0, n = rbt_first (&tree); n; n = rbt_next (n), ++i)
+    assert (n == &nodes[i].node);
+
+  /* A key d positions after the hint takes O(log d) comparisons on average,
+     far fewer than a search from the root for small d. */
+  tree = RBT_EMPTY;
+  for (i = 0; i < M; ++i)
+    {
+      many[i].key = 2 * i;
+      rbt_insert_hint (&tree, &many[i].node, i ? &many[i - 1].node : NULL,
+                       keyed_compare);
+    }
+  for (d = 1, log_d = 0; d <= 64; d *= 4, log_d += 2)
+    {
+      count = 0;
+      for (i = 0; i + d < M; ++i)
+        {
+          extra.key = 2 * (i + d) + 1;
+          keyed_comparisons = 0;
+          rbt_insert_hint (&tree, &extra.node, &many[i].node,
+                           keyed_compare_counted);
+          count += keyed_comparisons;
+          rbt_erase (&tree, &extra.node);
+        }
+      assert (count <= (2 * log_d + 4) * (long)(M - d));
+    }
+  assert (verify_tree (&tree));
+
+  /* Random keys with random hints, equal keys keep their insertion order. */
+  tree = RBT_EMPTY;
+  for (i = 0; i < N; ++i)
+    {
+      nodes[i].key = my_rand () % (N / 4);
+      hint = i ? &nodes[my_rand () % i].node : NULL;
+      rbt_insert_hint (&tree, &nodes[i].node, hint, keyed_compare);
+    }
+  assert (verify_tree (&tree));
+  prev_key = prev_order = -1;
+  for (i = 0, n = rbt_first (&tree); n; n = rbt_next (n), ++i)
+    {
+      k = RBT_CONTAINER_OF (n, Keyed_Node, node);
+      assert (k->key > prev_key
+              || (k->key == prev_key && k->order > prev_order));
+      prev_key = k->key;
+      prev_order = k->order;
+    }
+  assert (i == N);
+}
+
+static int build_parallel_freed;
+
+static void
+build_parallel_free_node (struct rbt_node *node)
+{
+  (void)node;
+  ++build_parallel_freed;
+}
+
+static void
+build_parallel_test (void)
+{
+  /* Large enough for the sort and the build to use several threads. */
+  enum { N = 40000, KEYS = N / 4 };
+  static Keyed_Node nodes[N];
+  static struct rbt_node *array[N];
+  static int first[KEYS], last[KEYS];
+  const enum rbt_duplicates policies[] = {
+    RBT_DUPLICATES_KEEP, RBT_DUPLICATES_FIRST, RBT_DUPLICATES_LAST
+  };
+  struct rbtree tree;
+  struct rbt_node *n;
+  Keyed_Node *k, *prev;
+  int i, p, count;
+
+  for (p = 0; p < 3; ++p)
+    {
+      memset (first, -1, sizeof (first));
+      for (i = 0; i < N; ++i)
+        {
+          nodes[i].key = my_rand () % KEYS;
+          nodes[i].order = i;
+          array[i] = &nodes[i].node;
+          if (first[nodes[i].key] < 0)
+            first[nodes[i].key] = i;
+          last[nodes[i].key] = i;
+        }
+      tree = RBT_EMPTY;
+      build_parallel_freed = 0;
+      assert (rbt_build_parallel (&tree, array, N, keyed_compare, policies[p],
+                                  build_parallel_free_node, 4));
+      assert (verify_tree (&tree));
+      prev = NULL;
+      count = 0;
+      for (n = rbt_first (&tree); n; n = rbt_next (n), ++count)
+        {
+          k = RBT_CONTAINER_OF (n, Keyed_Node, node);
+          assert (n == array[count]);
+          if (prev)
+            assert (prev->key < k->key
+                    || (prev->key == k->key && prev->order < k->order
+                        && policies[p] == RBT_DUPLICATES_KEEP));
+          if (policies[p] == RBT_DUPLICATES_FIRST)
+            assert (k->order == first[k->key]);
+          else if (policies[p] == RBT_DUPLICATES_LAST)
+            assert (k->order == last[k->key]);
+          prev = k;
+        }
+      assert (count + build_parallel_freed == N);
+      if (policies[p] == RBT_DUPLICATES_KEEP)
+        assert (count == N);
+    }
+
+  /* Small inputs take the sequential paths. */
+  for (i = 0; i < 3; ++i)
+    {
+      nodes[i].key = 2 - i;
+      array[i] = &nodes[i].node;
+    }
+  assert (rbt_build_parallel (&tree, array, 0, keyed_compare,
+                              RBT_DUPLICATES_KEEP, NULL, 4));
+  assert (tree.root == NULL);
+  assert (rbt_build_parallel (&tree, array, 3, keyed_compare,
+                              RBT_DUPLICATES_FIRST, NULL, 1));
+  assert (verify_tree (&tree) && rbt_first (&tree) == &nodes[2].node);
+}
+
+#ifdef RBT_STATS
+static void
+stats_test (void)
+{
+  enum { N = 1000 };
+  static Keyed_Node nodes[N], probe;
+  struct rbtree tree = RBT_EMPTY, less, greater;
+  unsigned long long depths;
+  char buffer[4096];
+  FILE *stream;
+  int i;
+
+  for (i = 0; i < N; ++i)
+    {
+      nodes[i].key = i;
+      keyed_insert_unique (&tree, &nodes[i]);
+    }
+  /* Ascending inserts rotate at every other step. */
+  assert (tree.stats.inserts == N);
+  assert (tree.stats.rotations >= N / 2);
+  assert (tree.stats.insert_fixups >= tree.stats.rotations / 2);
+  assert (tree.stats.searches == N);
+
+  /* Lookups do not write to the tree. */
+  rbt_stats_reset (&tree);
+  for (i = 0; i < N; ++i)
+    assert (keyed_find (&tree, i) == &nodes[i]);
+  assert (keyed_lower_bound (&tree, 0) && !keyed_upper_bound (&tree, N));
+  assert (tree.stats.searches == 0);
+
+  for (i = 0; i < N; ++i)
+    {
+      probe.key = i;
+      assert (keyed_insert_unique (&tree, &probe) == &nodes[i]);
+    }
+  assert (tree.stats.searches == N);
+  assert (tree.stats.depth[0] == 0 && tree.stats.depth[1] == 1);
+  depths = 0;
+  for (i = 0; i < RBT_STATS_DEPTHS; ++i)
+    {
+      depths += tree.stats.depth[i];
+      if (i > (int)rbt_height (&tree))
+        assert (tree.stats.depth[i] == 0);
+    }
+  assert (depths == tree.stats.searches);
+
+  /* Splitting and joining count their rebalancing in the tree split. */
+  rbt_stats_reset (&tree);
+  for (i = N / 8; i < N; i += N / 8)
+    {
+      rbt_split (&tree, &nodes[i].node, &less, &greater);
+      tree = less;
+      rbt_join (&tree, &nodes[i].node, &greater);
+    }
+  assert (verify_tree (&tree));
+  assert (tree.stats.rotations > 0 && tree.stats.insert_fixups > 0);
+  assert (tree.stats.inserts == 0 && tree.stats.searches == 0);
+
+  rbt_stats_reset (&tree);
+  for (i = 0; i < N; ++i)
+    assert (keyed_erase_key (&tree, i * 7 % N) == &nodes[i * 7 % N]);
+  assert (tree.stats.erases == N && tree.stats.searches == N);
+  assert (tree.stats.swaps > 0 && tree.stats.erase_fixups > 0);
+
+  stream = tmpfile ();
+  rbt_stats_dump (&tree, "test", stream);
+  rewind (stream);
+  assert (fgets (buffer, sizeof (buffer), stream));
+  fclose (stream);
+  assert (strncmp (buffer, "{\"name\":\"test\",\"inserts\":0,", 27) == 0);
+  assert (strstr (buffer, "\"erases\":1000,"));
+  assert (strstr (buffer, "\"search_depth\":[0,"));
+  assert (strcmp (buffer + strlen (buffer) - 3, "]}\n") == 0);
+}
+#endif
+
+typedef struct
+{
+  int key;
+  struct rbt_inode node;
+} Index_Node;
+
+static int
+verify_index_impl (const struct rbtree_index *tree, uint32_t node,
+                   uint32_t parent)
+{
+  const struct rbt_inode *n;
+  int left, right;
+  if (node == RBT_NIL)
+    return 1;
+  n = RBT_INODE (tree, node);
+  if (RBT_INDEX_PARENT (n) != parent)
+    return -1;
+  if (RBT_INDEX_COLOR (n) == RBT_RED
+      && ((n->left != RBT_NIL
+           && RBT_INDEX_COLOR (RBT_INODE (tree, n->left)) == RBT_RED)
+          || (n->right != RBT_NIL
+              && RBT_INDEX_COLOR (RBT_INODE (tree, n->right)) == RBT_RED)))
+    return -1;
+  left = verify_index_impl (tree, n->left, node);
+  right = verify_index_impl (tree, n->right, node);
+  if (left < 0 || left != right)
+    return -1;
+  return left + (RBT_INDEX_COLOR (n) == RBT_BLACK);
+}
+
+static void
+index_insert (struct rbtree_index *tree, uint32_t i)
+{
+  const int key = RBT_INDEX_ELEMENT (tree, i, Index_Node)->key;
+  uint32_t node = tree->root, parent = RBT_NIL;
+  enum rbt_direction dir = RBT_LEFT;
+  while (node != RBT_NIL)
+    {
+      parent = node;
+      dir = (key < RBT_INDEX_ELEMENT (tree, node, Index_Node)->key
+             ? RBT_LEFT : RBT_RIGHT);
+      node = RBT_INODE (tree, node)->child[dir];
+    }
+  rbt_index_insert (tree, i, parent, dir);
+}
+
+static void
+index_test (void)
+{
+  enum { N = 1000 };
+  Index_Node *nodes = (Index_Node *)malloc (N * sizeof (Index_Node));
+  Index_Node *moved;
+  struct rbtree_index tree = RBT_INDEX_EMPTY (nodes, Index_Node, node);
+  uint32_t i, n;
+  int prev, count;
+
+  assert (sizeof (struct rbt_inode) == 12);
+  assert (rbt_index_first (&tree) == RBT_NIL);
+  for (i = 0; i < N; ++i)
+    {
+      nodes[i].key = (int)((i * 7919) % N);
+      index_insert (&tree, i);
+    }
+  assert (verify_index_impl (&tree, tree.root, RBT_NIL) >= 0);
+
+  /* The links stay valid in a copy of the arena. */
+  moved = (Index_Node *)malloc (N * sizeof (Index_Node));
+  memcpy (moved, nodes, N * sizeof (Index_Node));
+  free (nodes);
+  tree.base = (char *)moved;
+
+  for (i = 0; i < N; i += 2)
+    rbt_index_erase (&tree, i);
+  assert (verify_index_impl (&tree, tree.root, RBT_NIL) >= 0);
+
+  prev = -1;
+  count = 0;
+  for (n = rbt_index_first (&tree); n != RBT_NIL;
+       n = rbt_index_next (&tree, n))
+    {
+      assert (n % 2 == 1);
+      assert (moved[n].key > prev);
+      prev = moved[n].key;
+      ++count;
+    }
+  assert (count == N / 2);
+  prev = N;
+  for (n = rbt_index_last (&tree); n != RBT_NIL;
+       n = rbt_index_prev (&tree, n))
+    {
+      assert (moved[n].key < prev);
+      prev = moved[n].key;
+      --count;
+    }
+  assert (count == 0);
+
+  for (i = 1; i < N; i += 2)
+    rbt_index_erase (&tree, i);
+  assert (tree.root == RBT_NIL);
+  free (moved);
+}
+
+static void
+mapped_test (void)
+{
+  enum { N = 3000 };
+  char path[] = "/tmp/rbt_mapped_XXXXXX";
+  struct rbt_mapped mapped;
+  uint32_t i, n;
+  int prev, count;
+
+  close (mkstemp (path));
+  assert (RBT_MAPPED_OPEN (&mapped, path, Index_Node, node));
+  for (i = 0; i < N; ++i)
+    {
+      /* Growing the file moves the arena. */
+      assert (rbt_mapped_alloc (&mapped) == i);
+      RBT_INDEX_ELEMENT (&mapped.tree, i, Index_Node)->key
+        = (int)((i * 7919) % N);
+      index_insert (&mapped.tree, i);
+    }
+  assert (mapped.header->capacity >= N);
+  assert (rbt_mapped_sync (&mapped));
+  rbt_mapped_close (&mapped);
+
+  /* A different element layout is rejected. */
+  assert (!rbt_mapped_open (&mapped, path, sizeof (Index_Node) + 4,
+                            offsetof (Index_Node, node)));
+  assert (errno == EINVAL);
+
+  /* Reopening needs no loading. */
+  assert (RBT_MAPPED_OPEN (&mapped, path, Index_Node, node));
+  assert (verify_index_impl (&mapped.tree, mapped.tree.root, RBT_NIL) >= 0);
+  for (i = 0; i < N; i += 2)
+    {
+      rbt_index_erase (&mapped.tree, i);
+      rbt_mapped_free (&mapped, i);
+    }
+  rbt_mapped_close (&mapped);
+
+  assert (RBT_MAPPED_OPEN (&mapped, path, Index_Node, node));
+  assert (verify_index_impl (&mapped.tree, mapped.tree.root, RBT_NIL) >= 0);
+  prev = -1;
+  count = 0;
+  for (n = rbt_index_first (&mapped.tree); n != RBT_NIL;
+       n = rbt_index_next (&mapped.tree, n))
+    {
+      assert (n % 2 == 1);
+      assert (RBT_INDEX_ELEMENT (&mapped.tree, n, Index_Node)->key > prev);
+      prev = RBT_INDEX_ELEMENT (&mapped.tree, n, Index_Node)->key;
+      ++count;
+    }
+  assert (count == N / 2);
+  /* Erased elements are reused before the arena grows. */
+  assert (rbt_mapped_alloc (&mapped) % 2 == 0);
+  assert (mapped.header->count == N);
+  rbt_mapped_close (&mapped);
+  unlink (path);
+}
+
 int
 main (int argc, const char *const *argv)
 {
@@ -263,6 +1829,7 @@ main (int argc, const char *const *argv)
   intset_print (&my_set);
 
   assert (my_set.size == COUNT);
+  assert (verify_structure (&my_set));
   for (i = 1; i <= COUNT; ++i)
     assert (intset_contains (&my_set, i));
 
@@ -278,9 +1845,36 @@ main (int argc, const char *const *argv)
   intset_print (&my_set);
 
   assert (my_set.size == COUNT/2);
+  assert (verify_structure (&my_set));
+#ifdef RBT_ORDER_STATISTICS
+  assert (verify_ranks (&my_set));
+#endif
   for (i = 1; i <= COUNT; ++i)
     assert (intset_contains (&my_set, i) == !(i % 2));
 
+  augmented_test ();
+  cached_test ();
+  build_sorted_test ();
+  join_split_test ();
+  set_operations_test ();
+  pool_test ();
+  latch_test ();
+  sharded_test ();
+  define_test ();
+  small_test ();
+  range_test ();
+  insert_hint_test ();
+  build_parallel_test ();
+#ifdef RBT_STATS
+  stats_test ();
+#endif
+  index_test ();
+  mapped_test ();
+  persistent_test ();
+  compact_test ();
+  frozen_test ();
+  interval_test ();
+
   intset_destruct (&my_set);
 }
 
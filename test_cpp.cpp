@@ -0,0 +1,130 @@
+#include <cassert>
+#include <cstdio>
+#include <algorithm>
+#include <iterator>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#define RBT_STATIC
+#define RBT_IMPLEMENTATION
+#include "rb_tree.hpp"
+
+#if __cplusplus >= 202002L
+#  include <ranges>
+#endif
+
+struct Item
+{
+  int key;
+  rbt_node node;
+  int payload;
+
+  friend bool operator< (const Item &a, const Item &b) { return a.key < b.key; }
+  friend bool operator< (const Item &a, int b) { return a.key < b; }
+  friend bool operator< (int a, const Item &b) { return a < b.key; }
+};
+
+using Item_Set = rbt::intrusive_set<Item, &Item::node>;
+
+/* Not transparent, so only `Item` can be looked up. */
+struct Item_Greater
+{
+  bool operator() (const Item &a, const Item &b) const { return a.key > b.key; }
+};
+
+using Item_Greater_Set = rbt::intrusive_set<Item, &Item::node, Item_Greater>;
+
+template <class Set, class K, class = void>
+struct has_find : std::false_type
+{
+};
+
+template <class Set, class K>
+struct has_find<Set, K, std::void_t<decltype (std::declval<Set &> ().find (
+                          std::declval<const K &> ()))>> : std::true_type
+{
+};
+
+static_assert (has_find<Item_Set, int>::value);
+static_assert (has_find<Item_Greater_Set, Item>::value);
+static_assert (!has_find<Item_Greater_Set, int>::value);
+
+#if __cplusplus >= 202002L
+static_assert (std::bidirectional_iterator<Item_Set::iterator>);
+static_assert (std::bidirectional_iterator<Item_Set::const_iterator>);
+static_assert (std::ranges::bidirectional_range<Item_Set>);
+#endif
+
+int
+main ()
+{
+  enum { N = 1000 };
+  std::vector<Item> items (N);
+  Item_Set set;
+  int i;
+
+  for (i = 0; i < N; ++i)
+    {
+      items[i].key = (i * 7919) % N * 2;
+      items[i].payload = i;
+      assert (set.insert (items[i]).second);
+    }
+  assert (!set.insert (items[0]).second);
+  assert (set.size () == N);
+  assert (std::is_sorted (set.begin (), set.end ()));
+  assert (std::distance (set.begin (), set.end ()) == N);
+  assert (std::distance (set.rbegin (), set.rend ()) == N);
+  assert ((--set.end ())->key == 2 * (N - 1));
+
+  for (i = 0; i < 2 * N; ++i)
+    {
+      assert (set.contains (i) == !(i % 2));
+      auto lower = set.lower_bound (i);
+      assert (i < 2 * N - 1 ? lower->key == i + i % 2 : lower == set.end ());
+      auto upper = set.upper_bound (i);
+      assert (i < 2 * N - 2 ? upper->key == i + 2 - i % 2
+                            : upper == set.end ());
+    }
+
+  auto it = set.find (10);
+  assert (it != set.end () && it->key == 10);
+  it = set.erase (it);
+  assert (it->key == 12 && !set.contains (10));
+  set.erase (*set.find (12));
+  assert (!set.contains (12) && set.size () == N - 2);
+
+#if __cplusplus >= 202002L
+  auto odd = std::ranges::find_if (set, [] (const Item &item) {
+    return item.payload % 2 == 1;
+  });
+  assert (odd != set.end () && odd->payload % 2 == 1);
+#endif
+
+  const Item_Set &const_set = set;
+  Item_Set::const_iterator c = const_set.find (20);
+  assert (c == set.find (20));
+
+  Item_Set moved (std::move (set));
+  assert (set.empty () && moved.size () == N - 2);
+  moved.clear ();
+  assert (moved.empty ());
+
+  Item_Greater_Set greater;
+  Item probe;
+  for (i = 0; i < N; ++i)
+    assert (greater.insert (items[i]).second);
+  assert (std::is_sorted (greater.begin (), greater.end (), Item_Greater ()));
+  assert (greater.begin ()->key == 2 * (N - 1));
+  for (i = 0; i < 2 * N; ++i)
+    {
+      probe.key = i;
+      assert (greater.contains (probe) == !(i % 2));
+      auto lower = greater.lower_bound (probe);
+      assert (lower->key == i - i % 2);
+    }
+  probe.key = 20;
+  assert (greater.find (probe)->key == 20);
+  greater.clear ();
+  puts ("C++ wrapper tests passed");
+}